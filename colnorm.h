@@ -13,16 +13,59 @@
 #include <assert.h>
 #include <math.h>
 #include <pthread.h>            // anticipating threading
+#include <sys/mman.h>
+#include <stdint.h>
 
 #define DIFFTOL 1e-04           // tolerated difference between expect/actual answers
+#define CN_LINE_DOUBLES 8       // doubles in a 64-byte cache line
+
+#define MATRIX_ALLOC_MALLOC 0   // data came from malloc()
+#define MATRIX_ALLOC_MMAP   1   // data is an anonymous mmap() of alloc_bytes
 
 typedef struct {
   long rows;                    // number of rows
   long cols;                    // number of columns
   long col_space;               // actual space for columns to allow for alignment
   double *data;                 // pointer to allocated data
+  int alloc;                    // how data was allocated, one of MATRIX_ALLOC_*
+  size_t alloc_bytes;           // size of the mapping for MATRIX_ALLOC_MMAP
 } matrix_t;
 
+// Single precision matrix laid out like matrix_t; col_space is padded
+// so rows start on 16-byte boundaries. MGET()/MSET() work on it too.
+typedef struct {
+  long rows;                    // number of rows
+  long cols;                    // number of columns
+  long col_space;               // actual space for columns to allow for alignment
+  float *data;                  // pointer to allocated data
+  int alloc;                    // how data was allocated, one of MATRIX_ALLOC_*
+  size_t alloc_bytes;           // size of the mapping for MATRIX_ALLOC_MMAP
+} fmatrix_t;
+
+// Compact matrix of 16-bit elements, either IEEE half precision
+// (COLNORM_F16) or bfloat16 (COLNORM_BF16), for data that is only
+// stored and normalized. Elements must be converted with
+// colnorm_half_to_double() and colnorm_double_to_half() rather than
+// read with MGET(). col_space is padded so rows start on 16 bytes.
+typedef struct {
+  long rows;                    // number of rows
+  long cols;                    // number of columns
+  long col_space;               // actual space for columns to allow for alignment
+  uint16_t *data;               // pointer to allocated data
+  int dtype;                    // COLNORM_F16 or COLNORM_BF16
+  int alloc;                    // how data was allocated, one of MATRIX_ALLOC_*
+  size_t alloc_bytes;           // size of the mapping for MATRIX_ALLOC_MMAP
+} hmatrix_t;
+
+#define MATRIX_HUGEPAGE 0x01    // matrix_init_aligned(): back data with huge pages
+
+// layout of a matrix's data as reported by matrix_mem_stats()
+typedef struct {
+  long row_align;               // largest power of 2 (up to 4096) dividing every row start
+  size_t bytes;                 // bytes spanned by the rows
+  size_t huge_bytes;            // bytes currently backed by transparent huge pages (estimated)
+} matrix_mem_stats_t;
+
 typedef struct {
   long len;                     // length of vector
   double *data;                 // data in vector
@@ -38,6 +81,9 @@ typedef struct {
 // colnorm_util.c
 int vector_init(vector_t *vec, long len);
 int matrix_init(matrix_t *mat, long rows, long cols);
+int matrix_init_numa(matrix_t *mat, long rows, long cols, int thread_count);
+int matrix_init_aligned(matrix_t *mat, long rows, long cols, long align, int flags);
+int matrix_mem_stats(matrix_t *mat, matrix_mem_stats_t *stats);
 int matrix_copy(matrix_t *dst, matrix_t *src);
 int vector_copy(vector_t *dst, vector_t *src);
 void vector_free_data(vector_t *vec);
@@ -53,6 +99,17 @@ void mset(matrix_t *mat, int i, int j, int x);
 int vget(vector_t *vec, int i);
 void vset(vector_t *vec, int i, int x);
 
+int fmatrix_init(fmatrix_t *mat, long rows, long cols);
+int fmatrix_copy(fmatrix_t *dst, fmatrix_t *src);
+int fmatrix_from_matrix(fmatrix_t *dst, matrix_t *src);
+void fmatrix_free_data(fmatrix_t *mat);
+int fmatrix_read_from_file(char *fname, fmatrix_t *mat_ref);
+void fmatrix_write(FILE *file, fmatrix_t mat);
+int hmatrix_init(hmatrix_t *mat, long rows, long cols, int dtype);
+int hmatrix_from_matrix(hmatrix_t *dst, matrix_t *src);
+int matrix_from_hmatrix(matrix_t *dst, hmatrix_t *src);
+void hmatrix_free_data(hmatrix_t *mat);
+
 void pb_srand(unsigned long seed);
 unsigned int pb_rand();
 void vector_fill_random(vector_t vec, double lo, double hi);
@@ -60,7 +117,345 @@ void matrix_fill_random(matrix_t mat, double lo, double hi);
 
 // colnorm_base.c
 int colnorm_BASE(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr);
+int colnorm_BASE_f32(fmatrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr);
 
 // colnorm_optm.c
+#define COLNORM_DEFAULT 0x00    // fast sum/sum-of-squares statistics
+#define COLNORM_STABLE  0x01    // single-pass Welford/Chan statistics, accurate for large offsets
+#define COLNORM_STATS_ONLY 0x02 // only compute avg/std, the matrix is left as it is
+#define COLNORM_APPLY_ONLY 0x04 // skip the statistics and normalize with the avg/std given
+
+#define COLNORM_F64  0          // element types colnorm_OPTM() can sweep; statistics
+#define COLNORM_F32  1          // are always accumulated in double
+#define COLNORM_F16  2          // IEEE half precision, hmatrix_t only
+#define COLNORM_BF16 3          // bfloat16, hmatrix_t only
+
+// How colnorm_OPTM() divides a matrix among threads
+typedef struct {
+  int row_parts;                // bands of rows
+  int col_parts;                // groups of columns; row_parts*col_parts == threads
+} colnorm_plan_t;
+
+void colnorm_split(long n, int parts, int idx, long *beg, long *end);
+colnorm_plan_t colnorm_plan(long rows, long cols, long col_space, int thread_count);
+void colnorm_plan_block(colnorm_plan_t plan, long rows, long cols, int thread_id,
+                        long *row_beg, long *row_end, long *col_beg, long *col_end);
 int colnorm_OPTM(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count);
+int colnorm_OPTM_flags(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count, int flags);
+int colnorm_OPTM_into(const matrix_t *src, matrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                      int thread_count, int flags);
+int colnorm_OPTM_stats(const matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr,
+                       int thread_count, int flags);
+int colnorm_OPTM_f32(fmatrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count, int flags);
+int colnorm_OPTM_f32_into(const fmatrix_t *src, fmatrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                          int thread_count, int flags);
+int colnorm_OPTM_half(hmatrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count, int flags);
+int colnorm_OPTM_half_into(const hmatrix_t *src, hmatrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                           int thread_count, int flags);
+int colnorm_OPTM_half_f64(const hmatrix_t *src, matrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                          int thread_count, int flags);
+
+// colnorm_batch.c
+int colnorm_batch(matrix_t *mats, vector_t *avgs, vector_t *stds, int n, int thread_count, int flags);
+
+// colnorm_async.c
+#define COLNORM_ASYNC_FIFO     0        // jobs run to completion in submission order
+#define COLNORM_ASYNC_FAIR     1        // jobs take turns a slice of rows at a time
+#define COLNORM_ASYNC_SHORTEST 2        // the job with the least work left goes next
+
+#define COLNORM_JOB_QUEUED    0         // status of a submitted job
+#define COLNORM_JOB_RUNNING   1
+#define COLNORM_JOB_DONE      2
+#define COLNORM_JOB_CANCELLED 3
+
+typedef struct colnorm_job colnorm_job_t;       // handle private to colnorm_async.c
+
+// Called once a job finishes with COLNORM_JOB_DONE or
+// COLNORM_JOB_CANCELLED; must not release the job
+typedef void (*colnorm_done_t)(colnorm_job_t *job, int status, void *arg);
+
+int colnorm_async_init(int thread_count, int policy, long slice_bytes);
+void colnorm_async_shutdown();
+colnorm_job_t *colnorm_async_submit(const matrix_t *src, matrix_t *dst, vector_t *avg_ptr,
+                                    vector_t *std_ptr, int flags, colnorm_done_t done, void *done_arg);
+int colnorm_async_poll(colnorm_job_t *job);
+int colnorm_async_wait(colnorm_job_t *job);
+int colnorm_async_cancel(colnorm_job_t *job);
+void colnorm_async_release(colnorm_job_t *job);
+
+// colnorm_sparse.c
+#define COLNORM_CSR 0           // compressed sparse rows: ptr[] has rows+1 entries, idx[] columns
+#define COLNORM_CSC 1           // compressed sparse columns: ptr[] has cols+1 entries, idx[] rows
+
+// Sparse matrix; the nonzeros of row (CSR) or column (CSC) b are
+// val[ptr[b]] to val[ptr[b+1]-1] at positions idx[ptr[b]] onward
+typedef struct {
+  long rows;
+  long cols;
+  long nnz;                     // stored elements
+  int format;                   // COLNORM_CSR or COLNORM_CSC
+  long *ptr;                    // start of each row or column in idx[]/val[], then nnz
+  long *idx;                    // column (CSR) or row (CSC) of each stored element
+  double *val;                  // stored elements
+} smatrix_t;
+
+int smatrix_init(smatrix_t *mat, long rows, long cols, long nnz, int format);
+void smatrix_free_data(smatrix_t *mat);
+int smatrix_from_matrix(smatrix_t *sp, const matrix_t *dense, int format);
+int colnorm_sparse_stats(const smatrix_t *mat, vector_t *avg_ptr, vector_t *std_ptr,
+                         int thread_count, int flags);
+int colnorm_sparse_dense(smatrix_t *mat, matrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                         int thread_count, int flags);
+int colnorm_sparse_scale(smatrix_t *mat, vector_t *avg_ptr, vector_t *std_ptr,
+                         int thread_count, int flags);
+
+// colnorm_view.c
+// Read-only view of a matrix returning normalized values on the fly
+typedef struct {
+  const matrix_t *mat;
+  long rows;
+  long cols;
+  const double *avg;            // column averages, borrowed from the caller's vector
+  double *inv_std;              // 1/std of each column
+} colnorm_view_t;
+
+// normalized element (i,j) of a colnorm_view_t
+#define COLNORM_VIEW_GET(view,i,j) \
+  ((MGET(*(view).mat,i,j) - (view).avg[(j)]) * (view).inv_std[(j)])
+
+int colnorm_view_init(colnorm_view_t *view, const matrix_t *mat, vector_t *avg_ptr, vector_t *std_ptr,
+                      int thread_count, int flags);
+void colnorm_view_free(colnorm_view_t *view);
+const double *colnorm_view_row(const colnorm_view_t *view, long i, long col_beg, long col_end, double *buf);
+void colnorm_view_tile(const colnorm_view_t *view, long row_beg, long row_end, long col_beg, long col_end,
+                       double *buf, long ld);
+
+// colnorm_io.c
+#define COLNORM_BIN_MAGIC   "CNMATRIX"
+#define COLNORM_BIN_VERSION 1
+#define MATRIX_MAP_SHARED   0x01        // *_map_binary(): writes go through to the file
+#define COLNORM_IO_THREADS  0x100       // matrix_read_binary(), colnorm_stream(): pread() threads, not io_uring
+#define COLNORM_IO_DIRECT   0x200       // matrix_read_binary(), colnorm_stream(): bypass the page cache
+
+// Header at the start of a binary matrix file
+typedef struct {
+  char magic[8];                // COLNORM_BIN_MAGIC, not nul terminated
+  uint32_t version;             // COLNORM_BIN_VERSION
+  uint32_t dtype;               // element type, one of COLNORM_F64, F32, F16, BF16
+  int64_t rows;
+  int64_t cols;
+  int64_t col_space;            // elements stored per row, >= cols
+  int64_t align;                // every row starts on a multiple of this many bytes
+  int64_t data_offset;          // file offset of row 0, a multiple of the page size
+  int64_t reserved;             // 0
+} colnorm_binhdr_t;
+
+int matrix_write_binary(char *fname, matrix_t *mat);
+int matrix_map_binary(char *fname, matrix_t *mat, int flags);
+int matrix_read_binary(char *fname, matrix_t *mat, int flags);
+int fmatrix_write_binary(char *fname, fmatrix_t *mat);
+int fmatrix_map_binary(char *fname, fmatrix_t *mat, int flags);
+int hmatrix_write_binary(char *fname, hmatrix_t *mat);
+int hmatrix_map_binary(char *fname, hmatrix_t *mat, int flags);
+int colnorm_binary_dtype(char *fname, int *dtype);
+int colnorm_binary_open(char *fname, colnorm_binhdr_t *hdr);
+int colnorm_binary_create(char *fname, colnorm_binhdr_t *hdr);
+long colnorm_dtype_bytes(int dtype);
+int vector_write_binary(char *fname, vector_t *vec);
+int vector_read_binary(char *fname, vector_t *vec);
+int matrix_save_text(char *fname, matrix_t *mat);
+int matrix_load_text(char *fname, matrix_t *mat_ref, int thread_count);
+
+#define COLNORM_FMT_FIXED    0  // "%6.2f" elements laid out as matrix_write() prints them
+#define COLNORM_FMT_LOSSLESS 1  // shortest exact elements in the matrix_read_from_file() format
+
+int matrix_write_fmt(FILE *file, matrix_t *mat, int fmt, int thread_count);
+int vector_write_fmt(FILE *file, vector_t *vec, int fmt);
+
+// colnorm_incr.c
+// Running column statistics of a matrix that grows and changes
+typedef struct {
+  long cols;
+  long count;                   // rows added so far
+  double *mean;                 // mean of each column
+  double *m2;                   // sum of squared deviations from the mean of each column
+  double *std;                  // population standard deviation, kept in step with m2
+  double *inv_std;              // 1/std for normalizing
+} colnorm_incr_t;
+
+int colnorm_incr_init(colnorm_incr_t *inc, long cols);
+void colnorm_incr_free(colnorm_incr_t *inc);
+int colnorm_incr_append(colnorm_incr_t *inc, matrix_t *mat, int thread_count);
+void colnorm_incr_append_row(colnorm_incr_t *inc, const double *row);
+int colnorm_incr_update(colnorm_incr_t *inc, long j, double old_val, double new_val);
+void colnorm_incr_stats(colnorm_incr_t *inc, vector_t *avg_ptr, vector_t *std_ptr);
+int colnorm_incr_normalize(colnorm_incr_t *inc, const matrix_t *src, matrix_t *dst, int thread_count);
+void colnorm_incr_normalize_rows(colnorm_incr_t *inc, const matrix_t *src, matrix_t *dst,
+                                 long row_beg, long row_end);
+
+// colnorm_window.c
+#define COLNORM_WINDOW_SLIDING 0        // statistics of the trailing rows
+#define COLNORM_WINDOW_EWMA    1        // exponentially weighted statistics of all rows
+
+// Column statistics over a moving window of rows, updated one row at
+// a time as rows stream through. A column whose window standard
+// deviation is 0, as it is for the first row pushed, normalizes to 0.
+typedef struct {
+  int kind;                     // COLNORM_WINDOW_SLIDING or COLNORM_WINDOW_EWMA
+  long cols;
+  long size;                    // rows in a full sliding window
+  double alpha;                 // weight of the newest row in an EWMA window
+  long count;                   // rows pushed so far
+  long head;                    // ring row holding the oldest row of a full window
+  long since_sync;              // rows since M2 was last recomputed from the ring
+  double *mean;                 // mean of each column over the window
+  double *m2;                   // sliding: sum of squared deviations; EWMA: variance
+  double *ring;                 // sliding: the last size rows, size x cols
+} colnorm_window_t;
+
+int colnorm_window_init(colnorm_window_t *win, long cols, long size);
+int colnorm_ewma_init(colnorm_window_t *win, long cols, double alpha);
+void colnorm_window_free(colnorm_window_t *win);
+void colnorm_window_push_row(colnorm_window_t *win, const double *src, double *dst);
+int colnorm_window_push(colnorm_window_t *win, const matrix_t *src, matrix_t *dst, int thread_count);
+void colnorm_window_stats(colnorm_window_t *win, vector_t *avg_ptr, vector_t *std_ptr);
+
+// colnorm_aio.c
+#define COLNORM_AIO_AUTO    0   // io_uring when the kernel allows it, threads otherwise
+#define COLNORM_AIO_URING   1   // io_uring only
+#define COLNORM_AIO_THREADS 2   // blocking pread()/pwrite() spread over threads
+#define COLNORM_AIO_BLOCK   (1024L*1024)  // bytes per request
+#define COLNORM_AIO_DEPTH   8   // requests kept in flight by default
+
+// Asynchronous I/O context; used by one thread at a time
+typedef struct {
+  int backend;                  // COLNORM_AIO_URING or COLNORM_AIO_THREADS once set up
+  int depth;                    // requests kept in flight
+  void *ring;                   // io_uring state private to colnorm_aio.c
+  void **bufs;                  // buffers registered with the ring
+  size_t *buf_bytes;
+  int nbufs;
+} colnorm_aio_t;
+
+int colnorm_aio_init(colnorm_aio_t *aio, int backend, int depth);
+void colnorm_aio_free(colnorm_aio_t *aio);
+const char *colnorm_aio_name(colnorm_aio_t *aio);
+int colnorm_aio_register(colnorm_aio_t *aio, void **bufs, size_t *bytes, int nbufs);
+int colnorm_aio_direct(int fd, int on);
+int colnorm_aio_read(colnorm_aio_t *aio, int fd, void *buf, size_t bytes, off_t off);
+int colnorm_aio_write(colnorm_aio_t *aio, int fd, const void *buf, size_t bytes, off_t off);
+
+// colnorm_stream.c
+#define COLNORM_STAGE_READ      0       // stages of the colnorm_stream() pipeline
+#define COLNORM_STAGE_STATS     1
+#define COLNORM_STAGE_NORMALIZE 2
+#define COLNORM_STAGE_WRITE     3
+#define COLNORM_STAGES          4
+
+// Time one stage of the colnorm_stream() pipeline spent working and
+// stalled. Each stage runs on its own thread so busy / wall is the
+// fraction of the run it was occupied.
+typedef struct {
+  long chunks;                  // chunks the stage handled
+  double busy;                  // seconds spent reading, computing or writing
+  double wait_in;               // seconds stalled waiting for a chunk from the stage before
+  double wait_out;              // seconds stalled waiting for a buffer to be freed
+} colnorm_stage_t;
+
+typedef struct {
+  double wall;                  // seconds for the whole call
+  long chunk_rows;              // rows in each chunk but perhaps the last
+  long chunks;                  // chunks in one pass over the file
+  int buffers;                  // chunk buffers fitting in the memory budget
+  int resident;                 // every chunk stayed in memory so the file was read once
+  const char *io_backend;       // colnorm_aio_name() of the reader
+  colnorm_stage_t stage[COLNORM_STAGES];
+} colnorm_stream_stats_t;
+
+int colnorm_stream(char *src_fname, char *dst_fname, vector_t *avg_ptr, vector_t *std_ptr,
+                   size_t mem_budget, int thread_count, int flags);
+int colnorm_stream_stats(char *src_fname, char *dst_fname, vector_t *avg_ptr, vector_t *std_ptr,
+                         size_t mem_budget, int thread_count, int flags, colnorm_stream_stats_t *stats);
+void colnorm_stream_stats_print(FILE *file, colnorm_stream_stats_t *stats);
+
+// colnorm_simd.c
+// Row kernels used by colnorm_OPTM(); one table per instruction set
+typedef struct {
+  const char *name;             // instruction set, e.g. "avx2"
+  void (*accum)(const double *row, double *sum, double *sumsq, long n);
+  void (*normalize)(const double *src, double *dst, const double *avg, const double *inv_std, long n);
+  void (*normalize_nt)(const double *src, double *dst, const double *avg, const double *inv_std, long n);
+  void (*welford)(const double *row, double *mean, double *m2, double inv_count, long n);
+  // single precision rows, widened to double for the arithmetic
+  void (*accum_f32)(const float *row, double *sum, double *sumsq, long n);
+  void (*welford_f32)(const float *row, double *mean, double *m2, double inv_count, long n);
+  void (*normalize_f32)(const float *src, float *dst, const double *avg, const double *inv_std, long n);
+  void (*normalize_nt_f32)(const float *src, float *dst, const double *avg, const double *inv_std, long n);
+  // 16-bit elements are converted to and from double row segments
+  void (*widen_f16)(const uint16_t *src, double *dst, long n);
+  void (*widen_bf16)(const uint16_t *src, double *dst, long n);
+  void (*narrow_f16)(const double *src, uint16_t *dst, long n);
+  void (*narrow_bf16)(const double *src, uint16_t *dst, long n);
+  // one row through a sliding or exponentially weighted window, see colnorm_window.c
+  void (*window_step)(const double *in, double *ring, double *mean, double *m2,
+                      double *out, double inv_n, long n);
+  void (*ewma_step)(const double *in, double *mean, double *var, double *out, double alpha, long n);
+} colnorm_kernels_t;
+
+extern const colnorm_kernels_t *colnorm_kernels;   // chosen at startup via cpuid
+
+double colnorm_half_to_double(uint16_t h, int dtype);
+uint16_t colnorm_double_to_half(double x, int dtype);
+
+// colnorm_topo.c
+#define CN_MAX_CPUS 1024        // matches CPU_SETSIZE
+
+// cpus available to the process and the NUMA node of each
+typedef struct {
+  int nnodes;                   // NUMA nodes found, at least 1
+  int ncpus;                    // cpus this process may run on
+  int cpus[CN_MAX_CPUS];        // cpu ids ordered node by node
+  int cpu_node[CN_MAX_CPUS];    // node of each entry in cpus[]
+} colnorm_topo_t;
+
+long colnorm_cache_bytes(int level);
+void colnorm_tile_size(long cols, long *tile_rows, long *tile_cols);
+const colnorm_topo_t *colnorm_topology();
+int colnorm_topo_slot(int member, int team_size);
+int colnorm_topo_pin(int member, int team_size);
+int colnorm_topo_unpin();
+void colnorm_topology_print(FILE *file, int thread_count);
+
+// colnorm_pool.c
+// Work run by each member of a team; thread_id is in 0..thread_count-1
+typedef void (*colnorm_task_t)(int thread_id, int thread_count, void *arg);
+
+#define COLNORM_POOL_PIN 0x01   // pin team members to cpus spread over NUMA nodes
+
+int colnorm_pool_init(int thread_count);
+int colnorm_pool_init_flags(int thread_count, int flags);
+int colnorm_pool_pinned();
+void colnorm_pool_shutdown();
+int colnorm_pool_size();
+int colnorm_team_run(colnorm_task_t task, void *arg, int thread_count);
+
+// Work run on one chunk of a job by a member of a work-stealing team
+typedef void (*colnorm_chunk_t)(int thread_id, long chunk, void *arg);
+
+#define COLNORM_SCHED_STATIC 0  // each thread takes a fixed block of the work
+#define COLNORM_SCHED_STEAL  1  // threads take chunks from their own deque and steal when it runs dry
+
+// Counters for one member of colnorm_steal_run() teams
+typedef struct {
+  long chunks;                  // chunks run, including stolen ones
+  long stolen;                  // chunks taken from another member's deque
+  long failed;                  // steal attempts that found a deque empty or lost a race
+  double idle;                  // seconds spent looking for work to steal
+} colnorm_steal_stats_t;
+
+int colnorm_steal_run(colnorm_chunk_t fn, void *arg, long nchunks, int thread_count);
+int colnorm_steal_stats(colnorm_steal_stats_t *stats, int max);
+void colnorm_steal_stats_reset();
+void colnorm_sched_set(int mode, long chunk_rows);
+int colnorm_sched_get(long *chunk_rows);
 
@@ -0,0 +1,341 @@
+// colnorm_aio.c: asynchronous reads and writes of large ranges of a
+// file for the matrix file reader and writer and colnorm_stream(). A
+// range is cut into COLNORM_AIO_BLOCK sized requests of which up to
+// depth are kept in flight, which is what it takes for an NVMe drive
+// to reach its bandwidth. Two backends are provided:
+//   - io_uring, set up with the raw system calls; buffers registered
+//     with colnorm_aio_register() are pinned once and transferred with
+//     the fixed buffer operations
+//   - a team of threads each doing blocking pread()/pwrite(), used
+//     when the kernel lacks io_uring or it is disabled
+// Files with O_DIRECT set, see colnorm_aio_direct(), bypass the page
+// cache; the part of a range that isn't aligned for direct I/O is
+// transferred through the page cache instead.
+#define _GNU_SOURCE             // for O_DIRECT
+#include "colnorm.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define AIO_ALIGN 4096          // alignment of buffers, offsets and lengths for O_DIRECT
+
+// io_uring rings as mapped from the kernel
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;        // the ring mappings and their sizes
+  size_t sq_map_bytes, cq_map_bytes;
+  size_t sqes_bytes;
+} aio_ring_t;
+
+static int ring_setup(aio_ring_t *ring, int depth){
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+  if(ring->fd < 0){
+    return 1;
+  }
+  ring->sq_map_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){  // both rings in one mapping
+    if(ring->cq_map_bytes > ring->sq_map_bytes){
+      ring->sq_map_bytes = ring->cq_map_bytes;
+    }
+    ring->cq_map_bytes = 0;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = ring->sq_map;
+  if(ring->sq_map != MAP_FAILED && ring->cq_map_bytes > 0){
+    ring->cq_map = mmap(NULL, ring->cq_map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if(ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED){
+    close(ring->fd);            // the mappings that did succeed go with the process
+    return 1;
+  }
+  char *sq = ring->sq_map, *cq = ring->cq_map;
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return 0;
+}
+
+static void ring_free(aio_ring_t *ring){
+  munmap(ring->sqes, ring->sqes_bytes);
+  if(ring->cq_map != ring->sq_map){
+    munmap(ring->cq_map, ring->cq_map_bytes);
+  }
+  munmap(ring->sq_map, ring->sq_map_bytes);
+  close(ring->fd);
+}
+
+// Set up aio for transfers with up to depth requests in flight using
+// backend COLNORM_AIO_URING, COLNORM_AIO_THREADS, or COLNORM_AIO_AUTO
+// to use io_uring when the kernel allows it and threads otherwise.
+// Returns 0 on success and nonzero if io_uring was demanded and can't
+// be had.
+int colnorm_aio_init(colnorm_aio_t *aio, int backend, int depth){
+  memset(aio, 0, sizeof(*aio));
+  aio->depth = depth < 1 ? 1 : depth;
+  aio->backend = COLNORM_AIO_THREADS;
+  if(backend != COLNORM_AIO_THREADS){
+    aio->ring = malloc(sizeof(aio_ring_t));
+    if(ring_setup(aio->ring, aio->depth) == 0){
+      aio->backend = COLNORM_AIO_URING;
+    }
+    else{
+      free(aio->ring);
+      aio->ring = NULL;
+      if(backend == COLNORM_AIO_URING){
+        perror("colnorm_aio_init: io_uring unavailable");
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Release what colnorm_aio_init() and colnorm_aio_register() set up
+void colnorm_aio_free(colnorm_aio_t *aio){
+  if(aio->ring != NULL){
+    ring_free(aio->ring);       // also unregisters the buffers
+    free(aio->ring);
+    aio->ring = NULL;
+  }
+  free(aio->bufs);
+  free(aio->buf_bytes);
+  aio->bufs = NULL;
+  aio->buf_bytes = NULL;
+  aio->nbufs = 0;
+}
+
+// Name of the backend in use, e.g. for reports
+const char *colnorm_aio_name(colnorm_aio_t *aio){
+  return aio->backend == COLNORM_AIO_URING ? (aio->nbufs > 0 ? "io_uring fixed" : "io_uring")
+    : "threads";
+}
+
+// Register nbufs buffers, buffer b being bytes[b] long, which later
+// transfers will use so io_uring can pin them once rather than on
+// every request. Registration is only an optimization: if the kernel
+// refuses, e.g. over the locked memory limit, transfers still work.
+// Returns 0 if the buffers were registered.
+int colnorm_aio_register(colnorm_aio_t *aio, void **bufs, size_t *bytes, int nbufs){
+  if(aio->backend != COLNORM_AIO_URING || nbufs < 1){
+    return 1;
+  }
+  struct iovec iov[nbufs];
+  for(int b=0; b<nbufs; b++){
+    iov[b].iov_base = bufs[b];
+    iov[b].iov_len = bytes[b];
+  }
+  aio_ring_t *ring = aio->ring;
+  if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, nbufs) != 0){
+    return 1;
+  }
+  aio->bufs = malloc(sizeof(void *) * nbufs);
+  aio->buf_bytes = malloc(sizeof(size_t) * nbufs);
+  memcpy(aio->bufs, bufs, sizeof(void *) * nbufs);
+  memcpy(aio->buf_bytes, bytes, sizeof(size_t) * nbufs);
+  aio->nbufs = nbufs;
+  return 0;
+}
+
+// Turn O_DIRECT on or off for fd. Returns 0 on success and nonzero if
+// the file system doesn't support it.
+int colnorm_aio_direct(int fd, int on){
+  int fl = fcntl(fd, F_GETFL);
+  if(fl < 0){
+    return 1;
+  }
+  fl = on ? (fl | O_DIRECT) : (fl & ~O_DIRECT);
+  return fcntl(fd, F_SETFL, fl) != 0;
+}
+
+// Blocking transfer of a whole range, retrying short transfers.
+// Returns 0 on success and nonzero on error or early end of file.
+static int sync_rw(int fd, char *buf, size_t bytes, off_t off, int write){
+  while(bytes > 0){
+    ssize_t got = write ? pwrite(fd, buf, bytes, off) : pread(fd, buf, bytes, off);
+    if(got <= 0){
+      return 1;
+    }
+    buf += got;
+    off += got;
+    bytes -= got;
+  }
+  return 0;
+}
+
+// Transfer [off, off+bytes) in blocks over an io_uring with up to
+// depth blocks in flight. Every submitted block is reaped before
+// returning, even after an error, as the kernel may still be using
+// the buffer.
+static int uring_rw(colnorm_aio_t *aio, int fd, char *buf, size_t bytes, off_t off, int write){
+  aio_ring_t *ring = aio->ring;
+  int buf_index = -1;           // registered buffer holding the whole range
+  for(int b=0; b<aio->nbufs; b++){
+    char *base = aio->bufs[b];
+    if(buf >= base && buf + bytes <= base + aio->buf_bytes[b]){
+      buf_index = b;
+    }
+  }
+  long nblocks = (bytes + COLNORM_AIO_BLOCK - 1) / COLNORM_AIO_BLOCK;
+  long next = 0;
+  int inflight = 0;
+  int bad = 0;
+  while(next < nblocks || inflight > 0){
+    unsigned tail = *ring->sq_tail;
+    int to_submit = 0;
+    while(!bad && next < nblocks && inflight < aio->depth){
+      size_t pos = next * COLNORM_AIO_BLOCK;
+      size_t len = bytes - pos < COLNORM_AIO_BLOCK ? bytes - pos : COLNORM_AIO_BLOCK;
+      unsigned idx = tail & *ring->sq_mask;
+      struct io_uring_sqe *sqe = &ring->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      if(buf_index >= 0){
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buf_index;
+      }
+      else{
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+      }
+      sqe->fd = fd;
+      sqe->addr = (unsigned long) (buf + pos);
+      sqe->len = len;
+      sqe->off = off + pos;
+      sqe->user_data = next;
+      ring->sq_array[idx] = idx;
+      tail++;
+      next++;
+      inflight++;
+      to_submit++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    if(inflight == 0){
+      break;                    // only reached after an error
+    }
+    if(syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("colnorm_aio: io_uring_enter");
+      return 1;                 // the ring is unusable; nothing more will complete
+    }
+    unsigned head = *ring->cq_head;
+    unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != cq_tail; head++){
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      size_t pos = cqe->user_data * COLNORM_AIO_BLOCK;
+      size_t len = bytes - pos < COLNORM_AIO_BLOCK ? bytes - pos : COLNORM_AIO_BLOCK;
+      if(cqe->res < 0){
+        errno = -cqe->res;
+        bad = 1;
+      }
+      else if((size_t) cqe->res < len){   // short transfer; finish it here
+        bad = bad || sync_rw(fd, buf + pos + cqe->res, len - cqe->res, off + pos + cqe->res, write);
+      }
+      inflight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return bad;
+}
+
+// context of one thread of the pread()/pwrite() backend
+typedef struct {
+  int fd;
+  char *buf;
+  size_t bytes;
+  off_t off;
+  int write;
+  int member;                   // this thread does blocks member, member+team, ...
+  int team;
+  int bad;
+} aio_thread_t;
+
+static void *aio_thread(void *arg){
+  aio_thread_t *t = (aio_thread_t *) arg;
+  long nblocks = (t->bytes + COLNORM_AIO_BLOCK - 1) / COLNORM_AIO_BLOCK;
+  for(long blk = t->member; blk < nblocks && !t->bad; blk += t->team){
+    size_t pos = blk * COLNORM_AIO_BLOCK;
+    size_t len = t->bytes - pos < COLNORM_AIO_BLOCK ? t->bytes - pos : COLNORM_AIO_BLOCK;
+    t->bad = sync_rw(t->fd, t->buf + pos, len, t->off + pos, t->write);
+  }
+  return NULL;
+}
+
+// Transfer [off, off+bytes) in blocks spread over up to depth threads,
+// the calling thread being one of them
+static int threads_rw(colnorm_aio_t *aio, int fd, char *buf, size_t bytes, off_t off, int write){
+  long nblocks = (bytes + COLNORM_AIO_BLOCK - 1) / COLNORM_AIO_BLOCK;
+  int team = nblocks < aio->depth ? nblocks : aio->depth;
+  if(team <= 1){
+    return sync_rw(fd, buf, bytes, off, write);
+  }
+  pthread_t threads[team];
+  aio_thread_t ctxs[team];
+  for(int i=0; i<team; i++){
+    ctxs[i] = (aio_thread_t) { fd, buf, bytes, off, write, i, team, 0 };
+    if(i > 0 && pthread_create(&threads[i], NULL, aio_thread, &ctxs[i]) != 0){
+      perror("colnorm_aio: couldn't create thread");
+      exit(1);
+    }
+  }
+  aio_thread(&ctxs[0]);
+  int bad = ctxs[0].bad;
+  for(int i=1; i<team; i++){
+    pthread_join(threads[i], NULL);
+    bad = bad || ctxs[i].bad;
+  }
+  return bad;
+}
+
+// Transfer with the chosen backend. On a file opened with O_DIRECT
+// the aligned part of the range goes directly to the device and an
+// unaligned tail goes through the page cache; a range whose start
+// isn't aligned goes through the page cache entirely.
+static int aio_rw(colnorm_aio_t *aio, int fd, char *buf, size_t bytes, off_t off, int write){
+  int fl = fcntl(fd, F_GETFL);
+  size_t direct_bytes = bytes;  // without O_DIRECT the whole range is fine
+  if(fl >= 0 && (fl & O_DIRECT)){
+    int aligned = (unsigned long) buf % AIO_ALIGN == 0 && off % AIO_ALIGN == 0;
+    direct_bytes = aligned ? bytes / AIO_ALIGN * AIO_ALIGN : 0;
+  }
+  int bad = 0;
+  if(direct_bytes > 0){
+    bad = aio->backend == COLNORM_AIO_URING ? uring_rw(aio, fd, buf, direct_bytes, off, write)
+      : threads_rw(aio, fd, buf, direct_bytes, off, write);
+  }
+  if(!bad && direct_bytes < bytes){
+    colnorm_aio_direct(fd, 0);
+    bad = sync_rw(fd, buf + direct_bytes, bytes - direct_bytes, off + direct_bytes, write);
+    colnorm_aio_direct(fd, 1);
+  }
+  return bad;
+}
+
+// Read bytes at file offset off of fd into buf, or write them from
+// buf, waiting until the whole range is done. Returns 0 on success
+// and nonzero on error or early end of file.
+int colnorm_aio_read(colnorm_aio_t *aio, int fd, void *buf, size_t bytes, off_t off){
+  return aio_rw(aio, fd, buf, bytes, off, 0);
+}
+
+int colnorm_aio_write(colnorm_aio_t *aio, int fd, const void *buf, size_t bytes, off_t off){
+  return aio_rw(aio, fd, (char *) buf, bytes, off, 1);
+}
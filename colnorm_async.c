@@ -0,0 +1,420 @@
+// colnorm_async.c: submit column normalizations without waiting for
+// them. colnorm_async_submit() queues a job and returns a handle at
+// once; the caller can poll it, wait for it, cancel it, or have a
+// callback run when it finishes. A dispatcher thread runs the queued
+// jobs as teams on the worker pool, so the pool's threads are shared
+// by every job in flight rather than each caller starting its own.
+//
+// Jobs larger than a slice are run a slice of rows at a time: first
+// the statistics of each slice, merged with Chan's formula, then the
+// normalizing of each slice with COLNORM_APPLY_ONLY. Between slices
+// the dispatcher checks for cancellation and picks the next job by
+// the policy chosen at colnorm_async_init():
+//   COLNORM_ASYNC_FIFO      jobs run to completion in submission order
+//   COLNORM_ASYNC_FAIR      jobs take turns a slice at a time so a small
+//                           job isn't stuck behind a large one
+//   COLNORM_ASYNC_SHORTEST  the job with the fewest rows left goes next
+// A job of one slice runs as a single colnorm_OPTM_into() call and
+// gives exactly the same result.
+#include "colnorm.h"
+
+#define ASYNC_SLICE_BYTES (8L*1024*1024)        // default bytes of source rows per slice
+
+struct colnorm_job {
+  const matrix_t *src;
+  matrix_t *dst;
+  vector_t *avg;                // running mean while the statistics are gathered
+  vector_t *std;
+  int flags;
+  colnorm_done_t done;
+  void *done_arg;
+  int status;                   // COLNORM_JOB_*
+  int cancel;                   // set by colnorm_async_cancel()
+  int running;                  // the dispatcher is working on a slice
+  int in_callback;              // done() is running on callback_thread
+  pthread_t callback_thread;
+  int released;                 // released from its own callback; freed once it returns
+  int phase;                    // 0: statistics, 1: normalizing
+  long next_row;                // first row of the next slice in this phase
+  double count;                 // rows merged into the statistics so far
+  double *m2;                   // sum of squared deviations of each column
+  vector_t slice_avg;           // statistics of one slice
+  vector_t slice_std;
+  struct colnorm_job *next;     // next job in the queue
+};
+
+// State of the single dispatcher. The lock protects the queue and the
+// status, cancel, running and callback fields of every job. The lock
+// and condition variables are never destroyed so that handles can
+// still be waited on and released after colnorm_async_shutdown().
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;          // signalled when a job is queued or on shutdown
+  pthread_cond_t finished;      // broadcast when any job finishes
+  colnorm_job_t *head;          // queued and partly done jobs
+  colnorm_job_t *tail;
+  int policy;
+  int thread_count;
+  long slice_bytes;
+  int shutdown;
+} cn_async_t;
+
+static cn_async_t async = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .finished = PTHREAD_COND_INITIALIZER,
+};
+static int async_active = 0;
+
+// Unlink job from the queue; the lock must be held
+static void queue_remove(colnorm_job_t *job){
+  colnorm_job_t **link = &async.head;
+  colnorm_job_t *prev = NULL;
+  while(*link != NULL && *link != job){
+    prev = *link;
+    link = &(*link)->next;
+  }
+  if(*link == NULL){
+    return;
+  }
+  *link = job->next;
+  if(async.tail == job){
+    async.tail = prev;
+  }
+  job->next = NULL;
+}
+
+// Append job to the queue; the lock must be held
+static void queue_append(colnorm_job_t *job){
+  job->next = NULL;
+  if(async.tail == NULL){
+    async.head = job;
+  }
+  else{
+    async.tail->next = job;
+  }
+  async.tail = job;
+}
+
+// Rows of work a job has left: each row is read once for the
+// statistics and once to normalize
+static long job_remaining(colnorm_job_t *job){
+  long rows = job->src->rows;
+  long stats_left = (job->phase == 0 && !(job->flags & COLNORM_APPLY_ONLY)) ? rows - job->next_row : 0;
+  long norm_left = (job->flags & COLNORM_STATS_ONLY) ? 0 : (job->phase == 0 ? rows : rows - job->next_row);
+  return stats_left + norm_left;
+}
+
+// Choose the job to run a slice of next; the lock must be held. A
+// cancelled job goes first whatever the policy so that it is finished
+// promptly rather than waiting behind longer jobs.
+static colnorm_job_t *queue_pick(){
+  for(colnorm_job_t *job = async.head; job != NULL; job = job->next){
+    if(job->cancel){
+      return job;
+    }
+  }
+  if(async.policy != COLNORM_ASYNC_SHORTEST){
+    return async.head;            // FIFO keeps the head, FAIR rotates it after each slice
+  }
+  colnorm_job_t *best = async.head;
+  for(colnorm_job_t *job = async.head; job != NULL; job = job->next){
+    if(job_remaining(job) < job_remaining(best)){
+      best = job;
+    }
+  }
+  return best;
+}
+
+// Set the final status of a job which is off the queue, then run its
+// callback, so that the callback sees the job finished and may wait
+// for or release it. Waiters on other threads are woken once the
+// callback has returned. Called without the lock.
+static void job_finish(colnorm_job_t *job, int status){
+  free(job->m2);
+  vector_free_data(&job->slice_avg);
+  vector_free_data(&job->slice_std);
+  job->m2 = NULL;
+  colnorm_done_t done = job->done;
+  void *done_arg = job->done_arg;
+  pthread_mutex_lock(&async.lock);
+  job->status = status;
+  job->in_callback = done != NULL;
+  job->callback_thread = pthread_self();
+  pthread_cond_broadcast(&async.finished);
+  pthread_mutex_unlock(&async.lock);
+  if(done == NULL){
+    return;
+  }
+
+  done(job, status, done_arg);
+  pthread_mutex_lock(&async.lock);
+  job->in_callback = 0;
+  int released = job->released;
+  pthread_cond_broadcast(&async.finished);
+  pthread_mutex_unlock(&async.lock);
+  if(released){
+    free(job);
+  }
+}
+
+// Nonzero while a wait for job on this thread must keep blocking: the
+// job hasn't finished or its callback is still running elsewhere. The
+// callback itself doesn't wait for its own return. The lock must be
+// held.
+static int job_pending(colnorm_job_t *job){
+  if(job->status == COLNORM_JOB_QUEUED || job->status == COLNORM_JOB_RUNNING){
+    return 1;
+  }
+  return job->in_callback && !pthread_equal(job->callback_thread, pthread_self());
+}
+
+// Run the next slice of job. Returns nonzero once the job is complete.
+static int job_slice(colnorm_job_t *job){
+  const matrix_t *src = job->src;
+  long cols = src->cols;
+  long slice_rows = async.slice_bytes / (sizeof(double) * src->col_space);
+  if(slice_rows < 1){
+    slice_rows = 1;
+  }
+  if(job->next_row == 0 && job->phase == 0 && slice_rows >= src->rows){
+    colnorm_OPTM_into(src, job->dst, job->avg, job->std, async.thread_count, job->flags);
+    return 1;                     // small enough to run as one call
+  }
+
+  if(job->phase == 0 && (job->flags & COLNORM_APPLY_ONLY)){
+    job->phase = 1;
+  }
+  long r0 = job->next_row;
+  long r1 = r0 + slice_rows < src->rows ? r0 + slice_rows : src->rows;
+  matrix_t part_src = *src;
+  part_src.data = &MGET(*src,r0,0);
+  part_src.rows = r1 - r0;
+  matrix_t part_dst = *job->dst;
+  part_dst.data = &MGET(*job->dst,r0,0);
+  part_dst.rows = r1 - r0;
+
+  if(job->phase == 0){            // merge this slice's statistics into the job's
+    colnorm_OPTM_into(&part_src, &part_dst, &job->slice_avg, &job->slice_std, async.thread_count,
+                      (job->flags & COLNORM_STABLE) | COLNORM_STATS_ONLY);
+    double n_a = job->count;
+    double n_b = r1 - r0;
+    double n_ab = n_a + n_b;
+    for(long j=0; j<cols; j++){
+      double delta = VGET(job->slice_avg,j) - VGET(*job->avg,j);
+      VSET(*job->avg,j, VGET(*job->avg,j) + delta * (n_b / n_ab));
+      job->m2[j] += VGET(job->slice_std,j) * VGET(job->slice_std,j) * n_b +
+        delta * delta * (n_a * n_b / n_ab);
+    }
+    job->count = n_ab;
+    job->next_row = r1;
+    if(r1 == src->rows){
+      for(long j=0; j<cols; j++){
+        VSET(*job->std,j, sqrt(job->m2[j] / src->rows));
+      }
+      job->phase = 1;
+      job->next_row = 0;
+      return (job->flags & COLNORM_STATS_ONLY) != 0;
+    }
+    return 0;
+  }
+
+  colnorm_OPTM_into(&part_src, &part_dst, job->avg, job->std, async.thread_count, COLNORM_APPLY_ONLY);
+  job->next_row = r1;
+  return r1 == src->rows;
+}
+
+// Dispatcher main loop: run a slice of the job the policy picks, then
+// requeue or finish it, until shut down with the queue empty
+static void *async_dispatcher(void *arg){
+  pthread_mutex_lock(&async.lock);
+  while(1){
+    while(async.head == NULL && !async.shutdown){
+      pthread_cond_wait(&async.wake, &async.lock);
+    }
+    if(async.head == NULL){
+      break;
+    }
+    colnorm_job_t *job = queue_pick();
+    if(job->cancel || async.shutdown){
+      queue_remove(job);
+      pthread_mutex_unlock(&async.lock);
+      job_finish(job, COLNORM_JOB_CANCELLED);
+      pthread_mutex_lock(&async.lock);
+      continue;
+    }
+    job->status = COLNORM_JOB_RUNNING;
+    job->running = 1;
+    pthread_mutex_unlock(&async.lock);
+
+    int complete = job_slice(job);
+
+    pthread_mutex_lock(&async.lock);
+    job->running = 0;
+    if(complete){
+      queue_remove(job);
+      pthread_mutex_unlock(&async.lock);
+      job_finish(job, COLNORM_JOB_DONE);
+      pthread_mutex_lock(&async.lock);
+    }
+    else if(async.policy == COLNORM_ASYNC_FAIR){
+      queue_remove(job);          // to the back of the line
+      queue_append(job);
+    }
+  }
+  pthread_mutex_unlock(&async.lock);
+  return NULL;
+}
+
+// Start the dispatcher, running each job on teams of thread_count
+// threads from the worker pool, which is started if it is smaller.
+// policy is one of COLNORM_ASYNC_FIFO, FAIR or SHORTEST; slice_bytes
+// bounds the source rows run between scheduling decisions, 0 for the
+// default. Returns 0 on success and nonzero on error.
+int colnorm_async_init(int thread_count, int policy, long slice_bytes){
+  if(thread_count < 1 || policy < COLNORM_ASYNC_FIFO || policy > COLNORM_ASYNC_SHORTEST){
+    printf("colnorm_async_init: invalid thread_count %d or policy %d\n",thread_count,policy);
+    return 1;
+  }
+  if(async_active){
+    colnorm_async_shutdown();
+  }
+  if(colnorm_pool_size() < thread_count && colnorm_pool_init(thread_count)){
+    return 1;
+  }
+  pthread_mutex_lock(&async.lock);
+  async.head = async.tail = NULL;
+  async.shutdown = 0;
+  async.policy = policy;
+  async.thread_count = thread_count;
+  async.slice_bytes = slice_bytes > 0 ? slice_bytes : ASYNC_SLICE_BYTES;
+  pthread_mutex_unlock(&async.lock);
+  if(pthread_create(&async.thread, NULL, async_dispatcher, NULL) != 0){
+    perror("colnorm_async_init: couldn't create dispatcher");
+    return 1;
+  }
+  async_active = 1;
+  return 0;
+}
+
+// Cancel every job that hasn't finished, wait for the slice being
+// run, and stop the dispatcher. Handles stay valid until released and
+// may still be polled, waited on and released afterwards. Safe to call
+// when the dispatcher isn't running.
+void colnorm_async_shutdown(){
+  if(!async_active){
+    return;
+  }
+  pthread_mutex_lock(&async.lock);
+  async.shutdown = 1;
+  pthread_cond_signal(&async.wake);
+  pthread_mutex_unlock(&async.lock);
+  pthread_join(async.thread, NULL);
+  async_active = 0;
+}
+
+// Queue the normalization of src into dst, which may be the same
+// matrix, storing the column statistics in avg_ptr and std_ptr; flags
+// are as for colnorm_OPTM_into(). None of them may be touched until
+// the job has finished. If done is not NULL, done(job, status,
+// done_arg) is called on the dispatcher thread when the job finishes,
+// or on the cancelling thread for a job cancelled before it started.
+// By then the job's status is final, so the callback may poll, wait
+// for or release job, but must not use it after releasing it, nor
+// wait for another job the dispatcher has yet to run. Returns a
+// handle to release with colnorm_async_release() once finished, or
+// NULL on error.
+colnorm_job_t *colnorm_async_submit(const matrix_t *src, matrix_t *dst, vector_t *avg_ptr,
+                                    vector_t *std_ptr, int flags, colnorm_done_t done, void *done_arg){
+  if(!async_active){
+    printf("colnorm_async_submit: colnorm_async_init() has not been called\n");
+    return NULL;
+  }
+  if(src->rows != dst->rows || src->cols != dst->cols ||
+     avg_ptr->len < src->cols || std_ptr->len < src->cols){
+    printf("colnorm_async_submit: bad sizes\n");
+    return NULL;
+  }
+  colnorm_job_t *job = calloc(1, sizeof(colnorm_job_t));
+  job->src = src;
+  job->dst = dst;
+  job->avg = avg_ptr;
+  job->std = std_ptr;
+  job->flags = flags;
+  job->done = done;
+  job->done_arg = done_arg;
+  job->status = COLNORM_JOB_QUEUED;
+  if(!(flags & COLNORM_APPLY_ONLY)){
+    job->m2 = calloc(src->cols, sizeof(double));
+    vector_init(&job->slice_avg, src->cols);
+    vector_init(&job->slice_std, src->cols);
+    memset(avg_ptr->data, 0, sizeof(double) * src->cols);
+  }
+
+  pthread_mutex_lock(&async.lock);
+  queue_append(job);
+  pthread_cond_signal(&async.wake);
+  pthread_mutex_unlock(&async.lock);
+  return job;
+}
+
+// Returns the current COLNORM_JOB_* status of job without blocking
+int colnorm_async_poll(colnorm_job_t *job){
+  pthread_mutex_lock(&async.lock);
+  int status = job->status;
+  pthread_mutex_unlock(&async.lock);
+  return status;
+}
+
+// Block until job has finished and its callback has returned, then
+// return COLNORM_JOB_DONE or COLNORM_JOB_CANCELLED. Called from the
+// job's own callback it returns at once.
+int colnorm_async_wait(colnorm_job_t *job){
+  pthread_mutex_lock(&async.lock);
+  while(job_pending(job)){
+    pthread_cond_wait(&async.finished, &async.lock);
+  }
+  int status = job->status;
+  pthread_mutex_unlock(&async.lock);
+  return status;
+}
+
+// Ask for job to be stopped. A job that hasn't started is removed from
+// the queue and finished as cancelled at once, leaving dst untouched.
+// A running job stops at the end of its current slice, so part of dst
+// may already be normalized. Returns 0 if the job will finish as
+// cancelled and 1 if it had already finished.
+int colnorm_async_cancel(colnorm_job_t *job){
+  pthread_mutex_lock(&async.lock);
+  if(job->status == COLNORM_JOB_DONE || job->status == COLNORM_JOB_CANCELLED){
+    pthread_mutex_unlock(&async.lock);
+    return 1;
+  }
+  job->cancel = 1;
+  int unstarted = job->status == COLNORM_JOB_QUEUED && !job->running;
+  if(unstarted){
+    queue_remove(job);
+  }
+  pthread_mutex_unlock(&async.lock);
+  if(unstarted){
+    job_finish(job, COLNORM_JOB_CANCELLED);
+  }
+  return 0;
+}
+
+// Free the handle of a finished job; waits for it to finish first.
+// Released from its own callback, the handle is freed once the
+// callback returns.
+void colnorm_async_release(colnorm_job_t *job){
+  pthread_mutex_lock(&async.lock);
+  while(job_pending(job)){
+    pthread_cond_wait(&async.finished, &async.lock);
+  }
+  int deferred = job->in_callback;
+  job->released = deferred;
+  pthread_mutex_unlock(&async.lock);
+  if(!deferred){
+    free(job);
+  }
+}
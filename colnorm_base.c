@@ -85,6 +85,40 @@ int colnorm_BASE_DEBUG(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr)
   return 0;
 }
 
+// Single precision version of colnorm_BASE_1(). Sums are kept in
+// double so the statistics match those of the same data held in a
+// matrix_t; normalized elements are rounded back to float.
+int colnorm_BASE_f32_1(fmatrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr) {
+  fmatrix_t mat = *mat_ptr;
+  vector_t avg = *avg_ptr;
+  vector_t std = *std_ptr;
+
+  for(int j=0; j<mat.cols; j++){             // for each column in matrix
+
+    double sum_j = 0.0;                      // PASS 1: Compute column average
+    for(int i=0; i<mat.rows; i++){
+      sum_j += MGET(mat,i,j);
+    }
+    double avg_j = sum_j / mat.rows;
+    VSET(avg,j,avg_j);
+    sum_j = 0.0;
+
+    for(int i=0; i<mat.rows; i++){           // PASS 2: Compute standard deviation
+      double diff = MGET(mat,i,j) - avg_j;
+      sum_j += diff*diff;
+    };
+    double std_j = sqrt(sum_j / mat.rows);
+    VSET(std,j,std_j);
+
+    for(int i=0; i<mat.rows; i++){           // PASS 3: Normalize matrix column
+      double mij = MGET(mat,i,j);
+      mij = (mij - avg_j) / std_j;
+      MSET(mat,i,j,(float) mij);
+    }
+  }
+  return 0;
+}
+
 int colnorm_BASE(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr) {
   if(avg_ptr->len != mat_ptr->cols || std_ptr->len != mat_ptr->cols){
     printf("colnorm_base: bad sizes\n");
@@ -92,3 +126,11 @@ int colnorm_BASE(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr) {
   }
   return colnorm_BASE_1(mat_ptr, avg_ptr, std_ptr);
 }
+
+int colnorm_BASE_f32(fmatrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr) {
+  if(avg_ptr->len != mat_ptr->cols || std_ptr->len != mat_ptr->cols){
+    printf("colnorm_base: bad sizes\n");
+    return 1;
+  }
+  return colnorm_BASE_f32_1(mat_ptr, avg_ptr, std_ptr);
+}
@@ -0,0 +1,151 @@
+// colnorm_batch.c: normalize many small matrices in one call. A
+// matrix of a few thousand elements is normalized in microseconds, so
+// colnorm_OPTM() on each one would spend most of its time waking a
+// team, setting up a barrier and allocating partial sums. Here whole
+// matrices are the unit of work instead: groups of them are chunks
+// of a colnorm_steal_run(), and whichever thread runs a chunk
+// normalizes each of its matrices on its own, in cache, with the row
+// kernels of colnorm_simd.c. Scratch space is allocated once per call and
+// shared out among the threads, and the team runs on the persistent
+// pool when one has been started with colnorm_pool_init().
+#include "colnorm.h"
+
+#define BATCH_CHUNK_CELLS (32L*1024)    // about how many elements make up one chunk
+
+// Normalize one matrix on the calling thread, honouring the same
+// flags as colnorm_OPTM_flags(). avg and std double as the sum/sumsq
+// (or mean/M2) accumulators so the only other space needed is
+// inv_std, at least mat->cols doubles.
+static void batch_one(const colnorm_kernels_t *kern, matrix_t *mat, vector_t *avg, vector_t *std,
+                      double *inv_std, int flags){
+  long rows = mat->rows, cols = mat->cols;
+  if(flags & COLNORM_APPLY_ONLY){
+    for(long j=0; j<cols; j++){
+      inv_std[j] = 1.0 / VGET(*std,j);
+    }
+  }
+  else{
+    memset(avg->data, 0, sizeof(double) * cols);
+    memset(std->data, 0, sizeof(double) * cols);
+    if(flags & COLNORM_STABLE){
+      for(long i=0; i<rows; i++){
+        kern->welford(&MGET(*mat,i,0), avg->data, std->data, 1.0 / (i+1), cols);
+      }
+    }
+    else{
+      for(long i=0; i<rows; i++){
+        kern->accum(&MGET(*mat,i,0), avg->data, std->data, cols);
+      }
+    }
+    for(long j=0; j<cols; j++){
+      double mean, variance;
+      if(flags & COLNORM_STABLE){
+        mean = VGET(*avg,j);
+        variance = VGET(*std,j) / rows;
+      }
+      else{
+        mean = VGET(*avg,j) / rows;
+        variance = (VGET(*std,j) / rows) - (mean * mean);
+      }
+      double stddev = sqrt(variance);
+      VSET(*avg,j, mean);
+      VSET(*std,j, stddev);
+      inv_std[j] = 1.0 / stddev;
+    }
+  }
+  if(flags & COLNORM_STATS_ONLY){
+    return;
+  }
+  for(long i=0; i<rows; i++){
+    kern->normalize(&MGET(*mat,i,0), &MGET(*mat,i,0), avg->data, inv_std, cols);
+  }
+}
+
+// Context shared by the team normalizing one batch
+typedef struct {
+  matrix_t *mats;
+  vector_t *avgs;
+  vector_t *stds;
+  int n;
+  int flags;
+  int claim;                    // matrices in each chunk
+  double *scratch;              // inv_std space for each thread
+  long scratch_stride;          // largest cols rounded up to a whole cache line
+  const colnorm_kernels_t *kern;
+} batch_ctx_t;
+
+// Normalize the matrices of one chunk. Stealing chunks, rather than
+// splitting the batch up front, keeps threads busy when matrices
+// differ in size.
+static void batch_chunk(int thread_id, long chunk, void *arg){
+  batch_ctx_t *ctx = (batch_ctx_t *) arg;
+  double *inv_std = ctx->scratch + thread_id * ctx->scratch_stride;
+  int beg = chunk * ctx->claim;
+  int end = beg + ctx->claim < ctx->n ? beg + ctx->claim : ctx->n;
+  for(int k=beg; k<end; k++){
+    batch_one(ctx->kern, &ctx->mats[k], &ctx->avgs[k], &ctx->stds[k], inv_std, ctx->flags);
+  }
+}
+
+// Normalize each of the n matrices in mats[] in place, storing the
+// column averages and standard deviations of mats[k] in avgs[k] and
+// stds[k], on up to thread_count threads. Matrices may have different
+// sizes. flags are as for colnorm_OPTM_flags(); each matrix's result
+// is the same as colnorm_OPTM_flags() on one thread would give.
+// Returns 0 on success and nonzero on error.
+int colnorm_batch(matrix_t *mats, vector_t *avgs, vector_t *stds, int n, int thread_count, int flags){
+  long max_cols = 0, cells = 0;
+  for(int k=0; k<n; k++){
+    if(avgs[k].len < mats[k].cols || stds[k].len < mats[k].cols || mats[k].rows <= 0){
+      printf("colnorm_batch: matrix %d is %ld x %ld with vectors of %ld and %ld\n",
+             k,mats[k].rows,mats[k].cols,avgs[k].len,stds[k].len);
+      return 1;
+    }
+    if(mats[k].cols > max_cols){
+      max_cols = mats[k].cols;
+    }
+    cells += mats[k].rows * mats[k].cols;
+  }
+  if(n <= 0){
+    return 0;
+  }
+
+  // put enough matrices in a chunk that the deques are touched rarely,
+  // but leave several chunks per thread to balance. The chunk size of
+  // colnorm_sched_set() counts rows of one colnorm_OPTM() matrix so it
+  // is not used here.
+  int claim = BATCH_CHUNK_CELLS / (cells / n + 1) + 1;
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+  if(claim > n / (4*thread_count)){
+    claim = n / (4*thread_count);
+  }
+  if(claim < 1){
+    claim = 1;
+  }
+  if(thread_count > (n + claim - 1) / claim){
+    thread_count = (n + claim - 1) / claim;
+  }
+
+  // whole 64-byte lines per thread
+  long stride = (max_cols + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES * CN_LINE_DOUBLES;
+  batch_ctx_t ctx = {
+    .mats = mats,
+    .avgs = avgs,
+    .stds = stds,
+    .n = n,
+    .flags = flags,
+    .claim = claim,
+    .scratch = aligned_alloc(64, sizeof(double) * thread_count * stride),
+    .scratch_stride = stride,
+    .kern = colnorm_kernels,
+  };
+  if(ctx.scratch == NULL){
+    printf("colnorm_batch: couldn't allocate scratch\n");
+    return 1;
+  }
+  colnorm_steal_run(batch_chunk, &ctx, (n + claim - 1) / claim, thread_count);
+  free(ctx.scratch);
+  return 0;
+}
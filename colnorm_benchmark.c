@@ -1,4 +1,6 @@
 #include "colnorm.h"
+#include <sys/stat.h>
+#include <fcntl.h>
 
 double total_points = 0;
 double actual_score = 0;
@@ -94,24 +96,1295 @@ double timing_stop(){
   return wall_time;             // real-world time
 }
 
+// Small matrix and number of calls used to measure the fixed cost of
+// each colnorm_OPTM() call with and without the worker pool
+int OVERHEAD_ROWS  = 32;
+int OVERHEAD_COLS  = 64;
+int OVERHEAD_CALLS = 2000;
+
+// Time OVERHEAD_CALLS calls to colnorm_OPTM() on a small matrix and
+// return the average wall time per call in microseconds.
+double time_per_call(matrix_t *mat, vector_t *avg, vector_t *std, int thread_count){
+  timing_start();
+  for(int i=0; i<OVERHEAD_CALLS; i++){
+    colnorm_OPTM(mat,avg,std,thread_count);
+  }
+  return timing_stop() / OVERHEAD_CALLS * 1e6;
+}
+
+// Report the per-call cost of colnorm_OPTM() on a small matrix when
+// threads are created for each call versus when the persistent pool
+// is used. Leaves the pool shut down.
+void overhead_report(){
+  matrix_t mat;
+  vector_t avg, std;
+  matrix_init(&mat, OVERHEAD_ROWS, OVERHEAD_COLS);
+  vector_init(&avg, OVERHEAD_COLS);
+  vector_init(&std, OVERHEAD_COLS);
+  matrix_fill_random(mat, -10,+10);
+
+  printf("==== Per-call overhead: %d x %d matrix, %d calls ====\n",
+         OVERHEAD_ROWS, OVERHEAD_COLS, OVERHEAD_CALLS);
+  printf("%2s %8s %8s (usec/call)\n","T","NOPOOL","POOL");
+  for(int tidx = 0; tidx < nthread_counts; tidx++){
+    int thread_count = thread_counts[tidx];
+    colnorm_pool_shutdown();
+    double nopool = time_per_call(&mat, &avg, &std, thread_count);
+    colnorm_pool_init(thread_count);
+    double withpool = time_per_call(&mat, &avg, &std, thread_count);
+    printf("%2d %8.2f %8.2f\n", thread_count, nopool, withpool);
+  }
+  colnorm_pool_shutdown();
+
+  matrix_free_data(&mat);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+}
+
+// Time one colnorm_OPTM() call on a random rows x cols matrix stored
+// in each of several layouts and print alignment and huge page stats
+// for each.
+void storage_report(long rows, long cols, int thread_count){
+  char *names[] = {"malloc", "align64", "hugepage"};
+  matrix_t src;
+  vector_t avg, std;
+  matrix_init(&src, rows, cols);
+  matrix_fill_random(src, -10,+10);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  printf("==== Matrix storage: %ld x %ld, %d threads ====\n",
+         rows, cols, thread_count);
+  printf("%-9s %6s %8s %6s %6s\n","LAYOUT","ALIGN","MB","HUGE%","OPTM");
+  for(int k=0; k<3; k++){
+    matrix_t mat;
+    if(k == 0){
+      matrix_init(&mat, rows, cols);
+    }
+    else{
+      matrix_init_aligned(&mat, rows, cols, 64, k == 2 ? MATRIX_HUGEPAGE : 0);
+    }
+    matrix_copy(&mat, &src);    // touches every page
+    timing_start();
+    colnorm_OPTM(&mat, &avg, &std, thread_count);
+    double wall_time = timing_stop();
+    matrix_mem_stats_t stats;
+    matrix_mem_stats(&mat, &stats);
+    printf("%-9s %6ld %8.1f %6.1f %6.3f\n", names[k], stats.row_align,
+           stats.bytes / 1048576.0, 100.0 * stats.huge_bytes / stats.bytes, wall_time);
+    matrix_free_data(&mat);
+  }
+  matrix_free_data(&src);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+}
+
+// Offset added to every element when checking accuracy; large enough
+// that sum-of-squares variance loses all significant digits
+double ACCURACY_OFFSET = 1.0e9;
+
+// Returns the largest absolute difference between elements of x and y
+double max_vector_diff(vector_t x, vector_t y){
+  double max = 0.0;
+  for(int i=0; i<x.len; i++){
+    double diff = fabs(VGET(x,i) - VGET(y,i));
+    if(isnan(diff) || diff > max){
+      max = isnan(diff) ? INFINITY : diff;
+    }
+  }
+  return max;
+}
+
+// Compare the std computed by colnorm_OPTM() with default and
+// COLNORM_STABLE statistics against colnorm_BASE() on columns with a
+// large offset. Reports an ERROR if the stable version is off.
+void accuracy_report(int thread_count){
+  long rows = 301, cols = 67;
+  matrix_t mat_SRC, mat;
+  vector_t avg_BASE, std_BASE, avg, std;
+  matrix_init(&mat_SRC, rows, cols);
+  matrix_init(&mat, rows, cols);
+  vector_init(&avg_BASE, cols);
+  vector_init(&std_BASE, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  matrix_fill_random(mat_SRC, -10,+10);
+  for(int i=0; i<rows; i++){
+    for(int j=0; j<cols; j++){
+      MSET(mat_SRC,i,j, MGET(mat_SRC,i,j) + ACCURACY_OFFSET);
+    }
+  }
+
+  matrix_copy(&mat, &mat_SRC);
+  colnorm_BASE(&mat, &avg_BASE, &std_BASE);
+
+  printf("==== Accuracy with column offset %.0e, %ld x %ld, %d threads ====\n",
+         ACCURACY_OFFSET, rows, cols, thread_count);
+  matrix_copy(&mat, &mat_SRC);
+  colnorm_OPTM_flags(&mat, &avg, &std, thread_count, COLNORM_DEFAULT);
+  printf("max std diff DEFAULT: %.3e\n", max_vector_diff(std, std_BASE));
+
+  matrix_copy(&mat, &mat_SRC);
+  colnorm_OPTM_flags(&mat, &avg, &std, thread_count, COLNORM_STABLE);
+  double diff = max_vector_diff(std, std_BASE);
+  printf("max std diff STABLE:  %.3e\n", diff);
+  if(diff > DIFFTOL || max_vector_diff(avg, avg_BASE) > DIFFTOL){
+    printf("ERROR: COLNORM_STABLE statistics differ from BASE\n");
+  }
+
+  matrix_free_data(&mat_SRC);
+  matrix_free_data(&mat);
+  vector_free_data(&avg_BASE);
+  vector_free_data(&std_BASE);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+}
+
+// Time colnorm_OPTM() in place on a copy of a random rows x cols
+// matrix against colnorm_OPTM_into() writing a second matrix from the
+// same source; only the calls are timed, not the copy. Reports an
+// ERROR if the out-of-place results differ from the in-place ones.
+void into_report(long rows, long cols, int thread_count){
+  matrix_t src, mat, dst;
+  vector_t avg, std, avg_into, std_into;
+  matrix_init(&src, rows, cols);
+  matrix_init(&mat, rows, cols);
+  matrix_init(&dst, rows, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  vector_init(&avg_into, cols);
+  vector_init(&std_into, cols);
+  matrix_fill_random(src, -10,+10);
+
+  printf("==== Out of place: %ld x %ld, %d threads ====\n", rows, cols, thread_count);
+  printf("%-10s %6s\n","CALL","OPTM");
+  double wall_inplace = 0.0, wall_into = 0.0;
+  for(int i=0; i<WARMUP+REPEATS; i++){
+    matrix_copy(&mat, &src);
+    timing_start();
+    colnorm_OPTM(&mat, &avg, &std, thread_count);
+    double t = timing_stop();
+    wall_inplace += i < WARMUP ? 0.0 : t;
+    timing_start();
+    colnorm_OPTM_into(&src, &dst, &avg_into, &std_into, thread_count, COLNORM_DEFAULT);
+    t = timing_stop();
+    wall_into += i < WARMUP ? 0.0 : t;
+  }
+  printf("%-10s %6.3f\n", "in place", wall_inplace / REPEATS);
+  printf("%-10s %6.3f  (%.2fx)\n", "into", wall_into / REPEATS, wall_inplace / wall_into);
+
+  double diff = max_vector_diff(avg, avg_into);
+  double std_diff = max_vector_diff(std, std_into);
+  diff = std_diff > diff ? std_diff : diff;
+  for(long i=0; i<rows; i++){
+    for(long j=0; j<cols; j++){
+      double d = fabs(MGET(mat,i,j) - MGET(dst,i,j));
+      diff = d > diff ? d : diff;
+    }
+  }
+  if(diff > DIFFTOL){
+    printf("ERROR: colnorm_OPTM_into() differs from colnorm_OPTM() by %.3e\n", diff);
+  }
+
+  matrix_free_data(&src);
+  matrix_free_data(&mat);
+  matrix_free_data(&dst);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+  vector_free_data(&avg_into);
+  vector_free_data(&std_into);
+}
+
+// Time colnorm_OPTM_into() on a random rows x cols matrix held as
+// double, float, half and bfloat16, checking the float statistics and
+// elements against colnorm_BASE_f32() and the statistics of the 16-bit
+// types against the double ones. Reports an ERROR on a mismatch. The
+// random elements are small integers so every type holds them exactly.
+void precision_report(long rows, long cols, int thread_count){
+  matrix_t src, dst;
+  fmatrix_t fsrc, fdst, fbase;
+  vector_t avg, std, avg_BASE, std_BASE;
+  matrix_init(&src, rows, cols);
+  matrix_init(&dst, rows, cols);
+  fmatrix_init(&fsrc, rows, cols);
+  fmatrix_init(&fdst, rows, cols);
+  fmatrix_init(&fbase, rows, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  vector_init(&avg_BASE, cols);
+  vector_init(&std_BASE, cols);
+  matrix_fill_random(src, -10,+10);
+  fmatrix_from_matrix(&fsrc, &src);
+  fmatrix_copy(&fbase, &fsrc);
+  colnorm_BASE_f32(&fbase, &avg_BASE, &std_BASE);
+
+  printf("==== Element type: %ld x %ld, %d threads ====\n", rows, cols, thread_count);
+  printf("%-6s %8s %6s\n","TYPE","MB","OPTM");
+  colnorm_OPTM_into(&src, &dst, &avg, &std, thread_count, COLNORM_DEFAULT);      // warmup
+  timing_start();
+  colnorm_OPTM_into(&src, &dst, &avg, &std, thread_count, COLNORM_DEFAULT);
+  double wall_f64 = timing_stop();
+  printf("%-6s %8.1f %6.3f\n", "double", sizeof(double)*rows*src.col_space / 1048576.0, wall_f64);
+
+  colnorm_OPTM_f32_into(&fsrc, &fdst, &avg, &std, thread_count, COLNORM_DEFAULT);
+  timing_start();
+  colnorm_OPTM_f32_into(&fsrc, &fdst, &avg, &std, thread_count, COLNORM_DEFAULT);
+  double wall_f32 = timing_stop();
+  printf("%-6s %8.1f %6.3f  (%.2fx)\n", "float", sizeof(float)*rows*fsrc.col_space / 1048576.0,
+         wall_f32, wall_f64 / wall_f32);
+
+  double diff = max_vector_diff(avg, avg_BASE);
+  double std_diff = max_vector_diff(std, std_BASE);
+  diff = std_diff > diff ? std_diff : diff;
+  for(long i=0; i<rows; i++){
+    for(long j=0; j<cols; j++){
+      double d = fabs(MGET(fdst,i,j) - MGET(fbase,i,j));
+      diff = d > diff ? d : diff;
+    }
+  }
+  if(diff > DIFFTOL){
+    printf("ERROR: float OPTM differs from BASE by %.3e\n", diff);
+  }
+
+  int dtypes[] = {COLNORM_F16, COLNORM_BF16};
+  char *dtype_names[] = {"half", "bf16"};
+  for(int k=0; k<2; k++){
+    hmatrix_t hsrc, hdst;
+    hmatrix_init(&hsrc, rows, cols, dtypes[k]);
+    hmatrix_init(&hdst, rows, cols, dtypes[k]);
+    hmatrix_from_matrix(&hsrc, &src);
+    colnorm_OPTM_half_into(&hsrc, &hdst, &avg, &std, thread_count, COLNORM_DEFAULT);
+    timing_start();
+    colnorm_OPTM_half_into(&hsrc, &hdst, &avg, &std, thread_count, COLNORM_DEFAULT);
+    double wall_half = timing_stop();
+    printf("%-6s %8.1f %6.3f  (%.2fx)\n", dtype_names[k],
+           sizeof(uint16_t)*rows*hsrc.col_space / 1048576.0, wall_half, wall_f64 / wall_half);
+    diff = fmax(max_vector_diff(avg, avg_BASE), max_vector_diff(std, std_BASE));
+    if(diff > DIFFTOL){
+      printf("ERROR: %s OPTM statistics differ from BASE by %.3e\n", dtype_names[k], diff);
+    }
+    hmatrix_free_data(&hsrc);
+    hmatrix_free_data(&hdst);
+  }
+
+  matrix_free_data(&src);
+  matrix_free_data(&dst);
+  fmatrix_free_data(&fsrc);
+  fmatrix_free_data(&fdst);
+  fmatrix_free_data(&fbase);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+  vector_free_data(&avg_BASE);
+  vector_free_data(&std_BASE);
+}
+
+// Writes mat the way matrix_write() used to, with one fprintf() per
+// element, as a baseline for matrix_write_fmt()
+void matrix_write_fprintf(FILE *file, matrix_t mat){
+  fprintf(file,"%ld x %ld matrix\n",mat.rows,mat.cols);
+  for(int i=0; i<mat.rows; i++){
+    fprintf(file,"%4d: ",i);
+    for(int j=0; j<mat.cols; j++){
+      fprintf(file,"%6.2f ", MGET(mat,i,j));
+    }
+    fprintf(file,"\n");
+  }
+}
+
+// Time writing a normalized rows x cols matrix to /dev/null with one
+// fprintf() per element and with matrix_write_fmt() in both formats
+// on thread_count threads.
+void write_report(long rows, long cols, int thread_count){
+  matrix_t mat;
+  vector_t avg, std;
+  matrix_init(&mat, rows, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  matrix_fill_random(mat, -10,+10);
+  colnorm_OPTM(&mat, &avg, &std, thread_count);
+  FILE *null = fopen("/dev/null","w");
+  if(null == NULL){
+    printf("ERROR: couldn't open /dev/null\n");
+    return;
+  }
+  printf("==== Writing a %ld x %ld matrix, %d threads ====\n", rows, cols, thread_count);
+  timing_start();
+  matrix_write_fprintf(null, mat);
+  double base = timing_stop();
+  timing_start();
+  matrix_write_fmt(null, &mat, COLNORM_FMT_FIXED, thread_count);
+  double fixed = timing_stop();
+  timing_start();
+  matrix_write_fmt(null, &mat, COLNORM_FMT_LOSSLESS, thread_count);
+  double lossless = timing_stop();
+  printf("%-9s %6.3f\n", "fprintf", base);
+  printf("%-9s %6.3f  (%.1fx)\n", "fixed", fixed, base / fixed);
+  printf("%-9s %6.3f\n", "lossless", lossless);
+  fclose(null);
+  matrix_free_data(&mat);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+}
+
+// Save a random rows x cols matrix as text and as binary in temporary
+// files and time loading each back: parsing the text with
+// matrix_load_text() on 1 and on thread_count threads versus mapping
+// the binary file with matrix_map_binary() and touching every element.
+// Reports an ERROR if the loaded matrices differ from the original.
+void io_report(long rows, long cols, int thread_count){
+  char text_name[] = "/tmp/colnorm_text_XXXXXX";
+  char bin_name[] = "/tmp/colnorm_bin_XXXXXX";
+  int text_fd = mkstemp(text_name);
+  int bin_fd = mkstemp(bin_name);
+  if(text_fd < 0 || bin_fd < 0){
+    printf("ERROR: couldn't create temporary files for io_report\n");
+    return;
+  }
+  close(text_fd);
+  close(bin_fd);
+
+  matrix_t src, text_mat, par_mat, bin_mat;
+  matrix_init(&src, rows, cols);
+  matrix_fill_random(src, -10,+10);
+  matrix_save_text(text_name, &src);
+  matrix_write_binary(bin_name, &src);
+
+  printf("==== Loading a %ld x %ld matrix ====\n", rows, cols);
+  struct stat st;
+  stat(text_name, &st);
+  double text_mb = st.st_size / 1048576.0;
+  timing_start();
+  int ret = matrix_load_text(text_name, &text_mat, 1);
+  double text_time = timing_stop();
+  timing_start();
+  ret = ret || matrix_load_text(text_name, &par_mat, thread_count);
+  double par_time = timing_stop();
+  timing_start();
+  ret = ret || matrix_map_binary(bin_name, &bin_mat, 0);
+  volatile double sum = 0.0;    // keeps the touching loop from being optimized out
+  for(long i=0; ret==0 && i<rows; i++){
+    for(long j=0; j<cols; j++){
+      sum += MGET(bin_mat,i,j);
+    }
+  }
+  double bin_time = timing_stop();
+  if(ret){
+    printf("ERROR: couldn't load saved matrices\n");
+    matrix_free_data(&src);
+    return;
+  }
+  printf("%-8s %6.3f  %7.1f MB/s\n", "text T1", text_time, text_mb / text_time);
+  printf("text T%-2d %6.3f  %7.1f MB/s\n", thread_count, par_time, text_mb / par_time);
+  printf("%-8s %6.3f  (%.0fx faster than text T1)\n", "mmap", bin_time, text_time / bin_time);
+
+  for(long i=0; i<rows; i++){
+    if(memcmp(&MGET(text_mat,i,0), &MGET(src,i,0), sizeof(double)*cols) != 0 ||
+       memcmp(&MGET(par_mat,i,0), &MGET(src,i,0), sizeof(double)*cols) != 0 ||
+       memcmp(&MGET(bin_mat,i,0), &MGET(src,i,0), sizeof(double)*cols) != 0){
+      printf("ERROR: loaded matrix differs from the one saved in row %ld\n", i);
+      break;
+    }
+  }
+  matrix_free_data(&src);
+  matrix_free_data(&text_mat);
+  matrix_free_data(&par_mat);
+  matrix_free_data(&bin_mat);
+  unlink(text_name);
+  unlink(bin_name);
+}
+
+// Grow a random rows x cols matrix from half its rows to all of them
+// in batches of 64 rows, keeping colnorm_incr_t statistics up to date,
+// then change some cells. Compares the time of one batch against
+// recomputing the statistics of the whole matrix and checks the final
+// statistics and normalized rows against colnorm_OPTM_into(). Reports
+// an ERROR on a mismatch.
+void incr_report(long rows, long cols, int thread_count){
+  long batch = 64;
+  matrix_t mat, dst, out;
+  vector_t avg, std, avg_OPTM, std_OPTM;
+  matrix_init(&mat, rows, cols);
+  matrix_init(&dst, rows, cols);
+  matrix_init(&out, rows, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  vector_init(&avg_OPTM, cols);
+  vector_init(&std_OPTM, cols);
+  matrix_fill_random(mat, -10,+10);
+
+  colnorm_incr_t inc;
+  colnorm_incr_init(&inc, cols);
+  matrix_t head = mat;          // views of leading rows and of each batch
+  head.rows = rows / 2;
+  colnorm_incr_append(&inc, &head, thread_count);
+  double append_time = 0.0;
+  long batches = 0;
+  for(long r0 = rows / 2; r0 < rows; r0 += batch){
+    matrix_t part = mat;
+    part.data = &MGET(mat,r0,0);
+    part.rows = r0 + batch < rows ? batch : rows - r0;
+    timing_start();
+    colnorm_incr_append(&inc, &part, thread_count);
+    append_time += timing_stop();
+    batches++;
+  }
+  for(long k=0; k<cols; k++){   // change one cell per column
+    long i = (k * 7919) % rows;
+    double old_val = MGET(mat,i,k);
+    MSET(mat,i,k, old_val + 3.0);
+    colnorm_incr_update(&inc, k, old_val, old_val + 3.0);
+  }
+
+  timing_start();
+  colnorm_OPTM_flags(&mat, &avg_OPTM, &std_OPTM, thread_count, COLNORM_STABLE | COLNORM_STATS_ONLY);
+  double full_time = timing_stop();
+  printf("==== Incremental statistics of a %ld x %ld matrix, batches of %ld rows ====\n",
+         rows, cols, batch);
+  printf("%-12s %8.5f\n", "full", full_time);
+  printf("%-12s %8.5f  (%.0fx faster)\n", "append", append_time / batches,
+         full_time / (append_time / batches));
+
+  colnorm_incr_stats(&inc, &avg, &std);
+  if(max_vector_diff(avg, avg_OPTM) > DIFFTOL || max_vector_diff(std, std_OPTM) > DIFFTOL){
+    printf("ERROR: incremental statistics differ from OPTM\n");
+  }
+  colnorm_OPTM_into(&mat, &dst, &avg_OPTM, &std_OPTM, thread_count, COLNORM_STABLE);
+  colnorm_incr_normalize_rows(&inc, &mat, &out, rows-batch, rows);
+  for(long i=rows-batch; i<rows; i++){
+    int bad = 0;
+    for(long j=0; j<cols; j++){
+      bad = bad || fabs(MGET(out,i,j) - MGET(dst,i,j)) > DIFFTOL;
+    }
+    if(bad){
+      printf("ERROR: incrementally normalized row %ld differs from OPTM\n", i);
+      break;
+    }
+  }
+  colnorm_incr_free(&inc);
+  matrix_free_data(&mat);
+  matrix_free_data(&dst);
+  matrix_free_data(&out);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+  vector_free_data(&avg_OPTM);
+  vector_free_data(&std_OPTM);
+}
+
+// Push rows x cols random rows through sliding (64 rows) and EWMA
+// (alpha 1/64) windows as 4 pushes of the same batch, on one thread
+// and on thread_count threads, reporting rows per second. The rows of
+// the last batch are checked against statistics recomputed from
+// scratch for each row, and the first row pushed into a fresh window
+// must normalize to 0; reports an ERROR on a mismatch.
+void window_report(long rows, long cols, int thread_count){
+  long pushes = 4, size = 64;
+  long batch = rows / pushes > size ? rows / pushes : size;
+  double alpha = 1.0 / size;
+  matrix_t mat, out, out1;
+  matrix_init(&mat, batch, cols);
+  matrix_init(&out, batch, cols);
+  matrix_init(&out1, batch, cols);
+  matrix_fill_random(mat, -10,+10);
+
+  printf("==== Windowed normalization of %ld rows x %ld cols, batches of %ld rows ====\n",
+         batch*pushes, cols, batch);
+  printf("%-8s %8s %14s %14s\n", "window", "threads", "rows/s", "Mcells/s");
+  for(int kind=COLNORM_WINDOW_SLIDING; kind<=COLNORM_WINDOW_EWMA; kind++){
+    int threads[2] = {1, thread_count};
+    for(int t=0; t<2; t++){
+      colnorm_window_t win;
+      if(kind == COLNORM_WINDOW_SLIDING){
+        colnorm_window_init(&win, cols, size);
+      }
+      else{
+        colnorm_ewma_init(&win, cols, alpha);
+      }
+      matrix_t *dst = t == 0 ? &out1 : &out;
+      timing_start();
+      for(long p=0; p<pushes; p++){
+        colnorm_window_push(&win, &mat, dst, threads[t]);
+      }
+      double secs = timing_stop();
+      printf("%-8s %8d %14.0f %14.1f\n", kind == COLNORM_WINDOW_SLIDING ? "sliding" : "ewma",
+             threads[t], batch*pushes / secs, batch*pushes*cols / secs / 1e6);
+      colnorm_window_free(&win);
+    }
+    for(long i=0; i<batch; i++){       // rows only; the padding past cols is never written
+      if(memcmp(&MGET(out,i,0), &MGET(out1,i,0), sizeof(double) * cols) != 0){
+        printf("ERROR: windowed rows differ between 1 and %d threads\n", thread_count);
+        break;
+      }
+    }
+
+    // Recompute each checked column from scratch: the sliding window of
+    // row i is the size rows before it, wrapping into the previous copy
+    // of the batch; the EWMA runs through every pushed row.
+    int bad = 0;
+    for(long j=0; j<cols && !bad; j+=97){
+      if(kind == COLNORM_WINDOW_SLIDING){
+        for(long i=0; i<batch && !bad; i++){
+          double sum = 0.0, sumsq = 0.0;
+          for(long k=0; k<size; k++){
+            sum += MGET(mat,(i-k+batch) % batch,j);
+          }
+          double mean = sum / size;
+          for(long k=0; k<size; k++){
+            double d = MGET(mat,(i-k+batch) % batch,j) - mean;
+            sumsq += d*d;
+          }
+          double expect = (MGET(mat,i,j) - mean) / sqrt(sumsq / size);
+          bad = fabs(expect - MGET(out,i,j)) > DIFFTOL;
+        }
+      }
+      else{
+        double mean = MGET(mat,0,j), var = 0.0;
+        for(long p=0; p<pushes && !bad; p++){
+          for(long i=0; i<batch && !bad; i++){
+            double d = MGET(mat,i,j) - mean;
+            mean += alpha * d;
+            var = (1.0 - alpha) * (var + alpha * d * d);
+            double expect = (MGET(mat,i,j) - mean) / sqrt(var);
+            bad = p == pushes-1 && fabs(expect - MGET(out,i,j)) > DIFFTOL;
+          }
+        }
+      }
+      if(bad){
+        printf("ERROR: %s window column %ld differs from recomputed statistics\n",
+               kind == COLNORM_WINDOW_SLIDING ? "sliding" : "ewma", j);
+      }
+    }
+
+    colnorm_window_t win;
+    if(kind == COLNORM_WINDOW_SLIDING){
+      colnorm_window_init(&win, cols, size);
+    }
+    else{
+      colnorm_ewma_init(&win, cols, alpha);
+    }
+    colnorm_window_push_row(&win, &MGET(mat,0,0), &MGET(out,0,0));
+    for(long j=0; j<cols; j++){
+      if(MGET(out,0,j) != 0.0){
+        printf("ERROR: first row of a %s window gives %g in column %ld, expected 0\n",
+               kind == COLNORM_WINDOW_SLIDING ? "sliding" : "ewma", MGET(out,0,j), j);
+        break;
+      }
+    }
+    colnorm_window_free(&win);
+  }
+  matrix_free_data(&mat);
+  matrix_free_data(&out);
+  matrix_free_data(&out1);
+}
+
+// Number of small matrices normalized by batch_report()
+int BATCH_MATRICES = 4096;
+
+// Normalize a batch of n small rows x cols matrices with a
+// colnorm_OPTM() call for each and with one colnorm_batch() call, on
+// one thread and on thread_count threads, reporting matrices per
+// second. Reports an ERROR if colnorm_batch() gives different results
+// than colnorm_OPTM() on one thread.
+void batch_report(int n, long rows, long cols, int thread_count){
+  matrix_t *mats = malloc(sizeof(matrix_t) * n);
+  matrix_t *copies = malloc(sizeof(matrix_t) * n);
+  vector_t *avgs = malloc(sizeof(vector_t) * n);
+  vector_t *stds = malloc(sizeof(vector_t) * n);
+  vector_t avg, std;
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  for(int k=0; k<n; k++){
+    matrix_init(&mats[k], rows, cols);
+    matrix_init(&copies[k], rows, cols);
+    vector_init(&avgs[k], cols);
+    vector_init(&stds[k], cols);
+    matrix_fill_random(mats[k], -10,+10);
+  }
+
+  printf("==== Batch of %d matrices of %ld x %ld ====\n", n, rows, cols);
+  printf("%-12s %8s %14s\n", "method", "threads", "matrices/s");
+  int threads[2] = {1, thread_count};
+  for(int t=0; t<2; t++){
+    timing_start();
+    for(int k=0; k<n; k++){
+      colnorm_OPTM(&mats[k], &avg, &std, threads[t]);
+    }
+    double secs = timing_stop();
+    printf("%-12s %8d %14.0f\n", "OPTM each", threads[t], n / secs);
+  }
+  for(int t=0; t<2; t++){
+    timing_start();
+    colnorm_batch(mats, avgs, stds, n, threads[t], COLNORM_DEFAULT);
+    double secs = timing_stop();
+    printf("%-12s %8d %14.0f\n", "batch", threads[t], n / secs);
+  }
+
+  // check against one-thread colnorm_OPTM() on fresh copies of the data
+  for(int k=0; k<n; k++){
+    matrix_fill_random(mats[k], -10,+10);
+    memcpy(copies[k].data, mats[k].data, sizeof(double) * rows * mats[k].col_space);
+  }
+  colnorm_batch(copies, avgs, stds, n, thread_count, COLNORM_DEFAULT);
+  for(int k=0; k<n; k++){
+    colnorm_OPTM(&mats[k], &avg, &std, 1);
+    if(memcmp(mats[k].data, copies[k].data, sizeof(double) * rows * mats[k].col_space) != 0 ||
+       memcmp(avg.data, avgs[k].data, sizeof(double) * cols) != 0 ||
+       memcmp(std.data, stds[k].data, sizeof(double) * cols) != 0){
+      printf("ERROR: batch result for matrix %d differs from OPTM\n", k);
+      break;
+    }
+  }
+
+  for(int k=0; k<n; k++){
+    matrix_free_data(&mats[k]);
+    matrix_free_data(&copies[k]);
+    vector_free_data(&avgs[k]);
+    vector_free_data(&stds[k]);
+  }
+  free(mats);
+  free(copies);
+  free(avgs);
+  free(stds);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+}
+
+// Busy loop standing in for a noisy neighbour on the cpu of the last
+// team member until *arg is cleared
+void *neighbour_spin(void *arg){
+  int *running = (int *) arg;
+  colnorm_topo_pin(thread_counts[nthread_counts-1]-1, thread_counts[nthread_counts-1]);
+  while(__atomic_load_n(running, __ATOMIC_RELAXED)){
+  }
+  return NULL;
+}
+
+// Time colnorm_OPTM() on a rows x cols matrix on thread_count threads
+// with static blocks and with work stealing, alone and while another
+// thread competes for the cpu of the last team member. Prints the
+// steal counters of each member over the stealing runs with the
+// neighbour. Reports an ERROR if
+// either schedule's result differs from colnorm_OPTM_into() with the
+// static schedule.
+void sched_report(long rows, long cols, int thread_count){
+  matrix_t src, dst, ref;
+  vector_t avg, std, avg_ref, std_ref;
+  matrix_init(&src, rows, cols);
+  matrix_init(&dst, rows, cols);
+  matrix_init(&ref, rows, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  vector_init(&avg_ref, cols);
+  vector_init(&std_ref, cols);
+  matrix_fill_random(src, -10,+10);
+  colnorm_sched_set(COLNORM_SCHED_STATIC, 0);
+  colnorm_OPTM_into(&src, &ref, &avg_ref, &std_ref, thread_count, COLNORM_DEFAULT);
+
+  printf("==== Scheduling a %ld x %ld matrix on %d threads ====\n", rows, cols, thread_count);
+  printf("%-8s %-10s %10s\n", "sched", "neighbour", "OPTM");
+  for(int busy=0; busy<2; busy++){
+    int running = 1;
+    pthread_t neighbour;
+    if(busy){
+      pthread_create(&neighbour, NULL, neighbour_spin, &running);
+    }
+    for(int mode=COLNORM_SCHED_STATIC; mode<=COLNORM_SCHED_STEAL; mode++){
+      colnorm_sched_set(mode, 0);
+      colnorm_steal_stats_reset();
+      double secs = 0.0;
+      for(int r=0; r<REPEATS; r++){
+        timing_start();
+        colnorm_OPTM_into(&src, &dst, &avg, &std, thread_count, COLNORM_DEFAULT);
+        secs += timing_stop();
+      }
+      printf("%-8s %-10s %10.5f\n", mode == COLNORM_SCHED_STEAL ? "steal" : "static",
+             busy ? "spinning" : "none", secs / REPEATS);
+
+      double diff = fmax(max_vector_diff(avg, avg_ref), max_vector_diff(std, std_ref));
+      for(long i=0; i<rows; i++){
+        for(long j=0; j<cols; j++){
+          diff = fmax(diff, fabs(MGET(dst,i,j) - MGET(ref,i,j)));
+        }
+      }
+      colnorm_OPTM_into(&src, &dst, &avg, &std, thread_count, COLNORM_STABLE);
+      diff = fmax(diff, fmax(max_vector_diff(avg, avg_ref), max_vector_diff(std, std_ref)));
+      if(diff > DIFFTOL){
+        printf("ERROR: %s schedule differs from static OPTM by %.3e\n",
+               mode == COLNORM_SCHED_STEAL ? "steal" : "static", diff);
+      }
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    if(busy){
+      pthread_join(neighbour, NULL);
+    }
+  }
+  colnorm_steal_stats_t stats[CN_MAX_CPUS];
+  int n = colnorm_steal_stats(stats, CN_MAX_CPUS);
+  printf("%6s %8s %8s %8s %10s\n", "member", "chunks", "stolen", "failed", "idle(s)");
+  for(int t=0; t<n; t++){
+    printf("%6d %8ld %8ld %8ld %10.5f\n", t, stats[t].chunks, stats[t].stolen,
+           stats[t].failed, stats[t].idle);
+  }
+  colnorm_sched_set(COLNORM_SCHED_STATIC, 0);
+
+  matrix_free_data(&src);
+  matrix_free_data(&dst);
+  matrix_free_data(&ref);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+  vector_free_data(&avg_ref);
+  vector_free_data(&std_ref);
+}
+
+// Completion record filled in by async_done()
+typedef struct {
+  struct timeval when;
+  int status;
+  int calls;
+} async_mark_t;
+
+void async_done(colnorm_job_t *job, int status, void *arg){
+  async_mark_t *mark = (async_mark_t *) arg;
+  gettimeofday(&mark->when, NULL);
+  mark->status = status;
+  mark->calls++;
+}
+
+// Callback that checks its job is seen as finished, waits for it and
+// releases it, as a caller that owns no other reference would
+void async_release_done(colnorm_job_t *job, int status, void *arg){
+  async_mark_t *mark = (async_mark_t *) arg;
+  mark->status = colnorm_async_poll(job) == status && colnorm_async_wait(job) == status ? status : -1;
+  colnorm_async_release(job);
+  mark->calls++;
+}
+
+double seconds_between(struct timeval a, struct timeval b){
+  return (b.tv_sec - a.tv_sec) + (b.tv_usec - a.tv_usec) / 1000000.0;
+}
+
+// Submit one large rows x cols job followed at once by 32 small jobs
+// of 64 x cols under each colnorm_async_init() policy, with slices of
+// a quarter of the large job, and report when the large job and, on
+// average, the small jobs completed. Then cancel a large job with a
+// small one queued behind it. Reports an ERROR if a result differs
+// from colnorm_OPTM_into() or a job ends in the wrong state.
+void async_report(long rows, long cols, int thread_count){
+  int nsmall = 32;
+  long small_rows = 64;
+  matrix_t big, big_out, big_ref, small, small_out[nsmall], small_ref;
+  vector_t big_avg, big_std, avg_ref, std_ref, small_avg[nsmall], small_std[nsmall];
+  matrix_init(&big, rows, cols);
+  matrix_init(&big_out, rows, cols);
+  matrix_init(&big_ref, rows, cols);
+  matrix_init(&small, small_rows, cols);
+  matrix_init(&small_ref, small_rows, cols);
+  vector_init(&big_avg, cols);
+  vector_init(&big_std, cols);
+  vector_init(&avg_ref, cols);
+  vector_init(&std_ref, cols);
+  for(int k=0; k<nsmall; k++){
+    matrix_init(&small_out[k], small_rows, cols);
+    vector_init(&small_avg[k], cols);
+    vector_init(&small_std[k], cols);
+  }
+  matrix_fill_random(big, -10,+10);
+  matrix_fill_random(small, -10,+10);
+  colnorm_OPTM_into(&big, &big_ref, &avg_ref, &std_ref, thread_count, COLNORM_DEFAULT);
+
+  long slice_bytes = sizeof(double) * rows * big.col_space / 4;
+  const char *names[] = {"fifo", "fair", "shortest"};
+  printf("==== Async jobs: one %ld x %ld then %d of %ld x %ld, %d threads ====\n",
+         rows, cols, nsmall, small_rows, cols, thread_count);
+  printf("%-10s %10s %10s %10s\n", "policy", "large", "small avg", "all");
+  for(int policy=COLNORM_ASYNC_FIFO; policy<=COLNORM_ASYNC_SHORTEST; policy++){
+    colnorm_async_init(thread_count, policy, slice_bytes);
+    async_mark_t big_mark = {{0,0}, -1, 0}, small_mark[nsmall];
+    memset(small_mark, 0, sizeof(small_mark));
+    colnorm_job_t *small_jobs[nsmall];
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    colnorm_job_t *big_job = colnorm_async_submit(&big, &big_out, &big_avg, &big_std,
+                                                  COLNORM_DEFAULT, async_done, &big_mark);
+    for(int k=0; k<nsmall; k++){
+      small_jobs[k] = colnorm_async_submit(&small, &small_out[k], &small_avg[k], &small_std[k],
+                                           COLNORM_DEFAULT, async_done, &small_mark[k]);
+    }
+    int bad = colnorm_async_wait(big_job) != COLNORM_JOB_DONE;
+    double small_secs = 0.0, last = seconds_between(start, big_mark.when);
+    for(int k=0; k<nsmall; k++){
+      bad = bad || colnorm_async_wait(small_jobs[k]) != COLNORM_JOB_DONE || small_mark[k].calls != 1;
+      small_secs += seconds_between(start, small_mark[k].when);
+      last = fmax(last, seconds_between(start, small_mark[k].when));
+      colnorm_async_release(small_jobs[k]);
+    }
+    colnorm_async_release(big_job);
+    colnorm_async_shutdown();
+    printf("%-10s %10.5f %10.5f %10.5f\n", names[policy], seconds_between(start, big_mark.when),
+           small_secs / nsmall, last);
+
+    double diff = fmax(max_vector_diff(big_avg, avg_ref), max_vector_diff(big_std, std_ref));
+    for(long i=0; i<rows; i++){
+      for(long j=0; j<cols; j++){
+        diff = fmax(diff, fabs(MGET(big_out,i,j) - MGET(big_ref,i,j)));
+      }
+    }
+    colnorm_OPTM_into(&small, &small_ref, &avg_ref, &std_ref, thread_count, COLNORM_DEFAULT);
+    for(int k=0; k<nsmall; k++){
+      for(long i=0; i<small_rows; i++){
+        for(long j=0; j<cols; j++){
+          diff = fmax(diff, fabs(MGET(small_out[k],i,j) - MGET(small_ref,i,j)));
+        }
+      }
+    }
+    colnorm_OPTM_into(&big, &big_ref, &avg_ref, &std_ref, thread_count, COLNORM_DEFAULT);
+    if(bad || diff > DIFFTOL){
+      printf("ERROR: %s async jobs failed or differ from OPTM by %.3e\n", names[policy], diff);
+    }
+  }
+
+  // a queued job cancelled before it starts must finish cancelled with
+  // its callback run once; the running job may finish either way
+  colnorm_async_init(thread_count, COLNORM_ASYNC_FIFO, slice_bytes);
+  async_mark_t big_mark = {{0,0}, -1, 0}, small_mark = {{0,0}, -1, 0};
+  colnorm_job_t *big_job = colnorm_async_submit(&big, &big_out, &big_avg, &big_std,
+                                                COLNORM_DEFAULT, async_done, &big_mark);
+  colnorm_job_t *small_job = colnorm_async_submit(&small, &small_out[0], &small_avg[0], &small_std[0],
+                                                  COLNORM_DEFAULT, async_done, &small_mark);
+  colnorm_async_cancel(small_job);
+  colnorm_async_cancel(big_job);
+  int big_status = colnorm_async_wait(big_job);
+  if(colnorm_async_wait(small_job) != COLNORM_JOB_CANCELLED || small_mark.calls != 1 ||
+     big_mark.calls != 1 || big_status != big_mark.status){
+    printf("ERROR: cancelled async jobs ended in the wrong state\n");
+  }
+  printf("cancelled while running: %s\n",
+         big_status == COLNORM_JOB_CANCELLED ? "stopped early" : "had already finished");
+  colnorm_async_release(big_job);
+  colnorm_async_release(small_job);
+  colnorm_async_shutdown();
+
+  // a callback may wait for and release its own job, and handles can
+  // still be waited on and released after shutdown
+  colnorm_async_init(thread_count, COLNORM_ASYNC_FIFO, slice_bytes);
+  small_mark.calls = 0;
+  colnorm_async_submit(&small, &small_out[0], &small_avg[0], &small_std[0],
+                       COLNORM_DEFAULT, async_release_done, &small_mark);
+  small_job = colnorm_async_submit(&small, &small_out[1], &small_avg[1], &small_std[1],
+                                   COLNORM_DEFAULT, NULL, NULL);
+  colnorm_async_shutdown();
+  if(small_mark.calls != 1 || small_mark.status == -1 ||
+     colnorm_async_wait(small_job) == COLNORM_JOB_QUEUED){
+    printf("ERROR: async callback couldn't wait for and release its job\n");
+  }
+  colnorm_async_release(small_job);
+
+  matrix_free_data(&big);
+  matrix_free_data(&big_out);
+  matrix_free_data(&big_ref);
+  matrix_free_data(&small);
+  matrix_free_data(&small_ref);
+  vector_free_data(&big_avg);
+  vector_free_data(&big_std);
+  vector_free_data(&avg_ref);
+  vector_free_data(&std_ref);
+  for(int k=0; k<nsmall; k++){
+    matrix_free_data(&small_out[k]);
+    vector_free_data(&small_avg[k]);
+    vector_free_data(&small_std[k]);
+  }
+}
+
+// Normalize a rows x cols matrix with 2% nonzeros densely with
+// colnorm_OPTM_into() and from CSR and CSC copies, timing the sparse
+// statistics, the scale-only normalize and the centered dense output,
+// and the bytes each form takes. Reports an ERROR if sparse statistics
+// or output differ from the dense results.
+void sparse_report(long rows, long cols, int thread_count){
+  matrix_t mat, dst_OPTM, dst;
+  vector_t avg, std, avg_OPTM, std_OPTM;
+  matrix_init(&mat, rows, cols);
+  matrix_init(&dst_OPTM, rows, cols);
+  matrix_init(&dst, rows, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  vector_init(&avg_OPTM, cols);
+  vector_init(&std_OPTM, cols);
+  for(long i=0; i<rows; i++){
+    for(long j=0; j<cols; j++){
+      MSET(mat,i,j, pb_rand() % 50 == 0 ? 1.0 + pb_rand() % 10 : 0.0);
+    }
+  }
+
+  timing_start();
+  colnorm_OPTM_into(&mat, &dst_OPTM, &avg_OPTM, &std_OPTM, thread_count, COLNORM_DEFAULT);
+  double dense_time = timing_stop();
+  printf("==== Sparse normalization of a %ld x %ld matrix with 2%% nonzeros ====\n", rows, cols);
+  printf("%-6s %10s %10s %10s %12s\n", "form", "stats", "scale", "dense out", "MB");
+  printf("%-6s %10s %10s %10.5f %12.1f\n", "dense", "", "", dense_time,
+         sizeof(double) * rows * mat.col_space / 1048576.0);
+
+  const char *names[] = {"csr", "csc"};
+  for(int format=COLNORM_CSR; format<=COLNORM_CSC; format++){
+    smatrix_t sp;
+    smatrix_from_matrix(&sp, &mat, format);
+    int bad = 0;
+    for(int flags=COLNORM_DEFAULT; flags<=COLNORM_STABLE; flags++){
+      colnorm_sparse_stats(&sp, &avg, &std, thread_count, flags);
+      bad = bad || max_vector_diff(avg, avg_OPTM) > DIFFTOL || max_vector_diff(std, std_OPTM) > DIFFTOL;
+    }
+    timing_start();
+    colnorm_sparse_stats(&sp, &avg, &std, thread_count, COLNORM_DEFAULT);
+    double stats_time = timing_stop();
+
+    timing_start();
+    colnorm_sparse_dense(&sp, &dst, &avg, &std, thread_count, COLNORM_DEFAULT);
+    double dense_out_time = timing_stop();
+    for(long i=0; i<rows && !bad; i++){
+      for(long j=0; j<cols; j++){
+        bad = bad || fabs(MGET(dst,i,j) - MGET(dst_OPTM,i,j)) > DIFFTOL;
+      }
+    }
+
+    timing_start();
+    colnorm_sparse_scale(&sp, &avg, &std, thread_count, COLNORM_DEFAULT);
+    double scale_time = timing_stop();
+    long outer = format == COLNORM_CSR ? rows : cols;
+    for(long b=0; b<outer && !bad; b++){
+      for(long k=sp.ptr[b]; k<sp.ptr[b+1]; k++){
+        long i = format == COLNORM_CSR ? b : sp.idx[k];
+        long j = format == COLNORM_CSR ? sp.idx[k] : b;
+        bad = bad || fabs(sp.val[k] - MGET(mat,i,j) / VGET(std_OPTM,j)) > DIFFTOL;
+      }
+    }
+    printf("%-6s %10.5f %10.5f %10.5f %12.1f\n", names[format], stats_time, scale_time,
+           dense_out_time, (sizeof(long) * (outer + 1 + sp.nnz) + sizeof(double) * sp.nnz) / 1048576.0);
+    if(bad){
+      printf("ERROR: %s sparse results differ from dense OPTM\n", names[format]);
+    }
+    smatrix_free_data(&sp);
+  }
+
+  matrix_free_data(&mat);
+  matrix_free_data(&dst_OPTM);
+  matrix_free_data(&dst);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+  vector_free_data(&avg_OPTM);
+  vector_free_data(&std_OPTM);
+}
+
+// Feed the normalized rows x cols matrix to a consumer taking the dot
+// product of each row with a weight vector three ways: by normalizing
+// into a second matrix with colnorm_OPTM_into() and reading that; from
+// colnorm_OPTM_stats() and a colnorm_view_t normalizing one L1 sized
+// row segment at a time; and fused, the consumer's loop applying the
+// view's avg/inv_std itself. Skipping the materialized matrix can only
+// pay off once the matrix is larger than the last level cache, when
+// writing and re-reading it goes to memory, so the sizes are printed
+// alongside the times. The output matrix is touched before
+// timing so first-touch page faults don't count against materializing.
+// Reports an ERROR if the statistics pass changes the matrix or the
+// view's values differ from OPTM's.
+void view_report(long rows, long cols, int thread_count){
+  long seg = 512;               // doubles per segment handed to the consumer
+  matrix_t mat, copy, dst;
+  vector_t avg, std, avg_OPTM, std_OPTM, weights, dots, dots_OPTM, dots_fused;
+  matrix_init(&mat, rows, cols);
+  matrix_init(&copy, rows, cols);
+  matrix_init(&dst, rows, cols);
+  vector_init(&avg, cols);
+  vector_init(&std, cols);
+  vector_init(&avg_OPTM, cols);
+  vector_init(&std_OPTM, cols);
+  vector_init(&weights, cols);
+  vector_init(&dots, rows);
+  vector_init(&dots_OPTM, rows);
+  vector_init(&dots_fused, rows);
+  matrix_fill_random(mat, -10,+10);
+  vector_fill_random(weights, -2,+2);
+  memcpy(copy.data, mat.data, sizeof(double) * rows * mat.col_space);
+  memset(dst.data, 0, sizeof(double) * rows * dst.col_space);
+  double *buf = aligned_alloc(64, sizeof(double) * seg);
+
+  timing_start();
+  colnorm_OPTM_into(&mat, &dst, &avg_OPTM, &std_OPTM, thread_count, COLNORM_DEFAULT);
+  for(long i=0; i<rows; i++){
+    double dot = 0.0;
+    for(long j=0; j<cols; j++){
+      dot += MGET(dst,i,j) * VGET(weights,j);
+    }
+    VSET(dots_OPTM,i, dot);
+  }
+  double materialize_time = timing_stop();
+
+  timing_start();
+  colnorm_view_t view;
+  colnorm_view_init(&view, &mat, &avg, &std, thread_count, COLNORM_DEFAULT);
+  for(long i=0; i<rows; i++){
+    double dot = 0.0;
+    for(long c0=0; c0<cols; c0+=seg){
+      long c1 = c0 + seg < cols ? c0 + seg : cols;
+      const double *vals = colnorm_view_row(&view, i, c0, c1, buf);
+      for(long j=c0; j<c1; j++){
+        dot += vals[j-c0] * VGET(weights,j);
+      }
+    }
+    VSET(dots,i, dot);
+  }
+  double view_time = timing_stop();
+
+  // fused: the statistics pass is timed again so all three include it
+  timing_start();
+  colnorm_view_t fused;
+  colnorm_view_init(&fused, &mat, &avg, &std, thread_count, COLNORM_DEFAULT);
+  for(long i=0; i<rows; i++){
+    const double *row = &MGET(mat,i,0);
+    double dot = 0.0;
+    for(long j=0; j<cols; j++){
+      dot += (row[j] - fused.avg[j]) * fused.inv_std[j] * VGET(weights,j);
+    }
+    VSET(dots_fused,i, dot);
+  }
+  double fused_time = timing_stop();
+  colnorm_view_free(&fused);
+
+  double mb = sizeof(double) * rows * mat.col_space / 1048576.0;
+  printf("==== Normalized %ld x %ld matrix fed to a row dot product ====\n", rows, cols);
+  printf("matrix %.1f MB, last level cache %.1f MB: %s\n", mb, colnorm_cache_bytes(3) / 1048576.0,
+         mb * 1048576.0 > colnorm_cache_bytes(3) ? "matrix is larger" : "matrix fits");
+  printf("%-12s %10.5f\n", "materialize", materialize_time);
+  printf("%-12s %10.5f  (%.2fx)\n", "view", view_time, materialize_time / view_time);
+  printf("%-12s %10.5f  (%.2fx)\n", "fused", fused_time, materialize_time / fused_time);
+
+  int bad = memcmp(mat.data, copy.data, sizeof(double) * rows * mat.col_space) != 0 ||
+    memcmp(avg.data, avg_OPTM.data, sizeof(double) * cols) != 0 ||
+    memcmp(std.data, std_OPTM.data, sizeof(double) * cols) != 0 ||
+    max_vector_diff(dots, dots_OPTM) > DIFFTOL ||
+    max_vector_diff(dots_fused, dots_OPTM) > DIFFTOL;
+  for(long i=0; i+2<=rows && !bad; i+=rows/7+1){  // dst still holds OPTM's values
+    colnorm_view_tile(&view, i, i+2, 0, cols, copy.data, copy.col_space);
+    bad = memcmp(copy.data, &MGET(dst,i,0), sizeof(double) * cols) != 0 ||
+      memcmp(&MGET(copy,1,0), &MGET(dst,i+1,0), sizeof(double) * cols) != 0;
+    for(long j=0; j<cols; j+=cols/5+1){
+      bad = bad || COLNORM_VIEW_GET(view,i,j) != MGET(dst,i,j);
+    }
+  }
+  if(bad){
+    printf("ERROR: stats-only pass changed the matrix or view differs from OPTM\n");
+  }
+
+  colnorm_view_free(&view);
+  free(buf);
+  matrix_free_data(&mat);
+  matrix_free_data(&copy);
+  matrix_free_data(&dst);
+  vector_free_data(&avg);
+  vector_free_data(&std);
+  vector_free_data(&avg_OPTM);
+  vector_free_data(&std_OPTM);
+  vector_free_data(&weights);
+  vector_free_data(&dots);
+  vector_free_data(&dots_OPTM);
+  vector_free_data(&dots_fused);
+}
+
+// Bandwidth in MB/s of reading bytes from the start of the block
+// device named by the COLNORM_RAW_DEVICE environment variable with
+// O_DIRECT and a deep io_uring queue, the most the device can deliver,
+// or 0 if no device is named or it can't be read.
+double raw_device_bandwidth(size_t bytes){
+  char *dev = getenv("COLNORM_RAW_DEVICE");
+  if(dev == NULL){
+    return 0.0;
+  }
+  int fd = open(dev, O_RDONLY);
+  char *buf = aligned_alloc(4096, bytes);
+  colnorm_aio_t aio;
+  if(fd < 0 || colnorm_aio_direct(fd, 1) || colnorm_aio_init(&aio, COLNORM_AIO_URING, 32)){
+    printf("WARNING: couldn't read %s with O_DIRECT and io_uring\n", dev);
+    free(buf);
+    if(fd >= 0){
+      close(fd);
+    }
+    return 0.0;
+  }
+  timing_start();
+  int bad = colnorm_aio_read(&aio, fd, buf, bytes, 0);
+  double secs = timing_stop();
+  colnorm_aio_free(&aio);
+  close(fd);
+  free(buf);
+  return bad ? 0.0 : bytes / 1048576.0 / secs;
+}
+
+// Time matrix_write_binary() and matrix_read_binary() with each I/O
+// backend, through the page cache and with O_DIRECT, on a rows x cols
+// matrix. Bandwidths are compared with that of the raw device named
+// by COLNORM_RAW_DEVICE if set. Reports an ERROR if a read matrix
+// differs from the one written.
+void aio_report(long rows, long cols){
+  char bin_name[] = "/tmp/colnorm_aio_XXXXXX";
+  int bin_fd = mkstemp(bin_name);
+  if(bin_fd < 0){
+    printf("ERROR: couldn't create temporary file for aio_report\n");
+    return;
+  }
+  close(bin_fd);
+  matrix_t src, mat;
+  matrix_init(&src, rows, cols);
+  matrix_fill_random(src, -10,+10);
+  double mb = sizeof(double) * rows * src.col_space / 1048576.0;
+
+  printf("==== Binary I/O of a %ld x %ld matrix, %.1f MB ====\n", rows, cols, mb);
+  double raw = raw_device_bandwidth(sizeof(double) * rows * src.col_space);
+  if(raw > 0){
+    printf("%-22s %8.1f MB/s\n", "raw device", raw);
+  }
+  timing_start();
+  if(matrix_write_binary(bin_name, &src)){
+    printf("ERROR: couldn't write binary matrix\n");
+    matrix_free_data(&src);
+    unlink(bin_name);
+    return;
+  }
+  double secs = timing_stop();
+  printf("%-22s %8.1f MB/s\n", "write", mb / secs);
+
+  char *names[4] = { "read threads cached", "read io_uring cached",
+                     "read threads direct", "read io_uring direct" };
+  int flags[4] = { COLNORM_IO_THREADS, 0, COLNORM_IO_THREADS | COLNORM_IO_DIRECT, COLNORM_IO_DIRECT };
+  for(int i=0; i<4; i++){
+    timing_start();
+    int ret = matrix_read_binary(bin_name, &mat, flags[i]);
+    secs = timing_stop();
+    if(ret){
+      printf("ERROR: couldn't read binary matrix\n");
+      continue;
+    }
+    printf("%-22s %8.1f MB/s", names[i], mb / secs);
+    if(raw > 0){
+      printf("  %5.1f%% of raw", 100.0 * mb / secs / raw);
+    }
+    printf("\n");
+    for(long r=0; r<rows; r++){
+      if(memcmp(&MGET(mat,r,0), &MGET(src,r,0), sizeof(double)*cols) != 0){
+        printf("ERROR: binary matrix read back differs in row %ld\n", r);
+        break;
+      }
+    }
+    matrix_free_data(&mat);
+  }
+  matrix_free_data(&src);
+  unlink(bin_name);
+}
+
+// Check the matrix file written by colnorm_stream() and its
+// statistics against those from colnorm_OPTM_into(). Reports an ERROR
+// on a mismatch.
+void check_stream(char *dst_name, matrix_t *dst, vector_t avg, vector_t std,
+                  vector_t avg_OPTM, vector_t std_OPTM){
+  matrix_t out;
+  if(matrix_map_binary(dst_name, &out, 0)){
+    printf("ERROR: couldn't map the streamed matrix\n");
+    return;
+  }
+  if(max_vector_diff(avg, avg_OPTM) > DIFFTOL || max_vector_diff(std, std_OPTM) > DIFFTOL){
+    printf("ERROR: streamed statistics differ from OPTM\n");
+  }
+  for(long i=0; i<out.rows; i++){
+    int bad = 0;
+    for(long j=0; j<out.cols; j++){
+      bad = bad || fabs(MGET(out,i,j) - MGET(*dst,i,j)) > DIFFTOL;
+    }
+    if(bad){
+      printf("ERROR: streamed matrix differs from OPTM in row %ld\n", i);
+      break;
+    }
+  }
+  matrix_free_data(&out);
+}
+
+// Normalize a random rows x cols matrix saved in the binary format
+// with colnorm_stream() under a memory budget of a quarter of its
+// size, then with one large enough to hold it, and compare with
+// colnorm_OPTM_into() on the matrix held in memory. The time each
+// stage of the pipeline was busy and stalled is printed for both.
+void stream_report(long rows, long cols, int thread_count){
+  char src_name[] = "/tmp/colnorm_src_XXXXXX";
+  char dst_name[] = "/tmp/colnorm_dst_XXXXXX";
+  int src_fd = mkstemp(src_name);
+  int dst_fd = mkstemp(dst_name);
+  if(src_fd < 0 || dst_fd < 0){
+    printf("ERROR: couldn't create temporary files for stream_report\n");
+    return;
+  }
+  close(src_fd);
+  close(dst_fd);
+
+  matrix_t src, dst;
+  vector_t avg, std, avg_OPTM, std_OPTM;
+  matrix_init(&src, rows, cols);
+  matrix_init(&dst, rows, cols);
+  vector_init(&avg_OPTM, cols);
+  vector_init(&std_OPTM, cols);
+  matrix_fill_random(src, -10,+10);
+  matrix_write_binary(src_name, &src);
+  colnorm_OPTM_into(&src, &dst, &avg_OPTM, &std_OPTM, thread_count, COLNORM_STABLE);
+
+  size_t bytes = sizeof(double) * rows * src.col_space;
+  size_t budgets[2] = { bytes / 4, 2 * bytes };
+  for(int b=0; b<2; b++){
+    printf("==== Streaming a %ld x %ld matrix file with a %.1f MB budget ====\n",
+           rows, cols, budgets[b] / 1048576.0);
+    colnorm_stream_stats_t stats;
+    if(colnorm_stream_stats(src_name, dst_name, &avg, &std, budgets[b], thread_count,
+                            COLNORM_STABLE, &stats)){
+      printf("ERROR: colnorm_stream() failed\n");
+      continue;
+    }
+    colnorm_stream_stats_print(stdout, &stats);
+    check_stream(dst_name, &dst, avg, std, avg_OPTM, std_OPTM);
+    vector_free_data(&avg);
+    vector_free_data(&std);
+  }
+  matrix_free_data(&src);
+  matrix_free_data(&dst);
+  vector_free_data(&avg_OPTM);
+  vector_free_data(&std_OPTM);
+  unlink(src_name);
+  unlink(dst_name);
+}
+
 int main(int argc, char *argv[]){
   check_hostname();             // complain if not on a odd GRACE node
 
-  if(argc > 1 && strcmp(argv[1],"-test")==0){
+  int test_mode = argc > 1 && strcmp(argv[1],"-test")==0;
+  if(test_mode){
     nsizes = 6;                 // for valgrind testing
     REPEATS = 1;
     sizes[0] = 105; sizes[1] =  211;
     sizes[2] = 258; sizes[3] =  516;
     sizes[4] = 511; sizes[5] = 1021;
+    OVERHEAD_CALLS = 50;
+    BATCH_MATRICES = 256;
   }
 
   printf("==== Matrix Column Normalization Benchmark Version 1.1 ====\n");
   printf("Running with REPEATS: %d and WARMUP: %d\n",REPEATS,WARMUP);
   printf("Running with %d sizes and %d thread_counts (max %d)\n",
          nsizes/2, nthread_counts, thread_counts[nthread_counts-1]);
+  long tile_rows, tile_cols;
+  colnorm_tile_size(sizes[nsizes-1], &tile_rows, &tile_cols);
+  printf("OPTM kernels: %s  L1: %ldK  L2: %ldK  tile for %d cols: %ld x %ld\n",
+         colnorm_kernels->name, colnorm_cache_bytes(1)/1024, colnorm_cache_bytes(2)/1024,
+         sizes[nsizes-1], tile_rows, tile_cols);
+  colnorm_topology_print(stdout, thread_counts[nthread_counts-1]);
 
   print_result(-1,0,0,0,0,0,0,0);  // print header
 
+  // keep workers parked between calls for the main timing loop,
+  // pinned so that pages of the OPTM matrix stay local to them
+  colnorm_pool_init_flags(thread_counts[nthread_counts-1], COLNORM_POOL_PIN);
+
   pb_srand(1234567);
 
   // Iterate over different sizes of the matrix
@@ -133,7 +1406,7 @@ int main(int argc, char *argv[]){
     vector_init(&avg_BASE, cols);
     vector_init(&std_BASE, cols);
 
-    matrix_init(&mat_OPTM, rows, cols);
+    matrix_init_numa(&mat_OPTM, rows, cols, thread_counts[nthread_counts-1]);
     vector_init(&avg_OPTM, cols);
     vector_init(&std_OPTM, cols);
 
@@ -260,6 +1533,30 @@ int main(int argc, char *argv[]){
 
   printf("TOTAL POINTS: %.0f / %.0f\n",actual_score,max_score);
 
+  // the reports below run on the largest size, or under -test on the
+  // smallest so that the valgrind run stays within its time limit
+  long report_rows = test_mode ? sizes[0] : sizes[nsizes-2];
+  long report_cols = test_mode ? sizes[1] : sizes[nsizes-1];
+  int max_threads = thread_counts[nthread_counts-1];
+  accuracy_report(max_threads);
+  storage_report(report_rows, report_cols, max_threads);
+  into_report(report_rows, report_cols, max_threads);
+  precision_report(report_rows, report_cols, max_threads);
+  io_report(report_rows, report_cols, max_threads);
+  write_report(report_rows, report_cols, max_threads);
+  aio_report(report_rows, report_cols);
+  incr_report(report_rows, report_cols, max_threads);
+  window_report(report_rows, report_cols, max_threads);
+  batch_report(BATCH_MATRICES, 32, 64, max_threads);
+  sched_report(report_rows, report_cols, max_threads);
+  async_report(report_rows, report_cols, max_threads);
+  sparse_report(report_rows, report_cols, max_threads);
+  view_report(report_rows, report_cols, max_threads);
+  // a quarter of the smallest matrix is under the fixed memory that
+  // colnorm_stream() holds back, so streaming keeps the largest size
+  stream_report(sizes[nsizes-2], sizes[nsizes-1], max_threads);
+  overhead_report();
+
   check_hostname();
 
   return 0;
@@ -0,0 +1,94 @@
+// colnorm_convert.c: convert matrices between the text format read by
+// matrix_read_from_file() and the binary format of colnorm_io.c which
+// can be mapped straight into a matrix_t.
+
+#include "colnorm.h"
+
+int main(int argc, char *argv[]){
+  if(argc < 3){
+    printf("usage: %s [-f32|-f16|-bf16] <text_in> <binary_out>\n",argv[0]);
+    printf("       %s -text <binary_in> <text_out>\n",argv[0]);
+    exit(1);
+  }
+
+  char *opt = argc > 3 ? argv[1] : "-f64";
+  char *in = argv[argc-2];
+  char *out = argv[argc-1];
+
+  if(strcmp(opt,"-text") == 0){                 // binary to text
+    int dtype;
+    if(colnorm_binary_dtype(in, &dtype)){
+      printf("%s: not a binary matrix file\n",in);
+      return 1;
+    }
+    matrix_t mat;
+    int ret;
+    if(dtype == COLNORM_F64){
+      ret = matrix_map_binary(in, &mat, 0);
+    }
+    else if(dtype == COLNORM_F32){              // widen to doubles to print
+      fmatrix_t fmat;
+      ret = fmatrix_map_binary(in, &fmat, 0);
+      if(ret == 0){
+        ret = matrix_init(&mat, fmat.rows, fmat.cols);
+        for(long i=0; ret==0 && i<mat.rows; i++){
+          for(long j=0; j<mat.cols; j++){
+            MSET(mat,i,j, MGET(fmat,i,j));
+          }
+        }
+        fmatrix_free_data(&fmat);
+      }
+    }
+    else{
+      hmatrix_t hmat;
+      ret = hmatrix_map_binary(in, &hmat, 0);
+      if(ret == 0){
+        ret = matrix_init(&mat, hmat.rows, hmat.cols);
+        if(ret == 0 && matrix_from_hmatrix(&mat, &hmat)){
+          matrix_free_data(&mat);
+          ret = 1;
+        }
+        hmatrix_free_data(&hmat);
+      }
+    }
+    if(ret){
+      return 1;
+    }
+    ret = matrix_save_text(out, &mat);
+    matrix_free_data(&mat);
+    return ret;
+  }
+
+  matrix_t mat;                                 // text to binary
+  if(matrix_read_from_file(in, &mat)){
+    return 1;
+  }
+  int ret;
+  if(strcmp(opt,"-f64") == 0){
+    ret = matrix_write_binary(out, &mat);
+  }
+  else if(strcmp(opt,"-f32") == 0){
+    fmatrix_t fmat;
+    ret = fmatrix_init(&fmat, mat.rows, mat.cols);
+    if(ret == 0){
+      fmatrix_from_matrix(&fmat, &mat);
+      ret = fmatrix_write_binary(out, &fmat);
+      fmatrix_free_data(&fmat);
+    }
+  }
+  else if(strcmp(opt,"-f16") == 0 || strcmp(opt,"-bf16") == 0){
+    hmatrix_t hmat;
+    ret = hmatrix_init(&hmat, mat.rows, mat.cols, strcmp(opt,"-f16") == 0 ? COLNORM_F16 : COLNORM_BF16);
+    if(ret == 0){
+      ret = hmatrix_from_matrix(&hmat, &mat) != 0;
+      ret = ret || hmatrix_write_binary(out, &hmat);
+      hmatrix_free_data(&hmat);
+    }
+  }
+  else{
+    printf("unknown option '%s'\n",opt);
+    ret = 1;
+  }
+  matrix_free_data(&mat);
+  return ret;
+}
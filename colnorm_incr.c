@@ -0,0 +1,155 @@
+// colnorm_incr.c: column statistics kept up to date as a matrix grows
+// by appended rows and has single cells changed, so avg/std don't have
+// to be recomputed from the whole matrix after every change. The state
+// is the count, mean and M2 (sum of squared deviations from the mean)
+// of each column, as in the COLNORM_STABLE statistics of
+// colnorm_OPTM(); each change costs time proportional to the cells it
+// touches. Normalized values are produced only when asked for, either
+// for a whole matrix or for just the rows about to be read.
+#include "colnorm.h"
+
+#define INCR_PARALLEL_ROWS 256  // appends of fewer rows are merged one row at a time
+
+// Refresh std and inv_std of column j from its M2
+static void incr_finish_col(colnorm_incr_t *inc, long j){
+  double variance = inc->count > 0 ? inc->m2[j] / inc->count : 0.0;
+  if(variance < 0.0){           // rounding in colnorm_incr_update() can undershoot
+    variance = 0.0;
+    inc->m2[j] = 0.0;
+  }
+  inc->std[j] = sqrt(variance);
+  inc->inv_std[j] = 1.0 / inc->std[j];
+}
+
+// Initialize inc to the statistics of an empty matrix with cols
+// columns. Free with colnorm_incr_free(). Returns 0 on success and
+// nonzero on error.
+int colnorm_incr_init(colnorm_incr_t *inc, long cols){
+  if(cols <= 0){
+    printf("colnorm_incr_init: invalid cols %ld\n",cols);
+    return 1;
+  }
+  inc->cols = cols;
+  inc->count = 0;
+  inc->mean = calloc(cols, sizeof(double));
+  inc->m2 = calloc(cols, sizeof(double));
+  inc->std = calloc(cols, sizeof(double));
+  inc->inv_std = calloc(cols, sizeof(double));
+  if(inc->mean == NULL || inc->m2 == NULL || inc->std == NULL || inc->inv_std == NULL){
+    printf("colnorm_incr_init: couldn't allocate statistics\n");
+    colnorm_incr_free(inc);
+    return 1;
+  }
+  return 0;
+}
+
+void colnorm_incr_free(colnorm_incr_t *inc){
+  free(inc->mean);
+  free(inc->m2);
+  free(inc->std);
+  free(inc->inv_std);
+  inc->mean = inc->m2 = inc->std = inc->inv_std = NULL;
+}
+
+// Add the rows of mat, which must have inc->cols columns, to the
+// statistics. A few rows are folded in one at a time with the Welford
+// kernel; larger blocks are summarized by colnorm_OPTM() on
+// thread_count threads and merged with Chan's formula. mat is not
+// changed. Returns 0 on success and nonzero on error.
+int colnorm_incr_append(colnorm_incr_t *inc, matrix_t *mat, int thread_count){
+  if(mat->cols != inc->cols){
+    printf("colnorm_incr_append: matrix has %ld cols, expected %ld\n",mat->cols,inc->cols);
+    return 1;
+  }
+  if(mat->rows < INCR_PARALLEL_ROWS){
+    for(long i=0; i<mat->rows; i++){
+      inc->count++;
+      colnorm_kernels->welford(&MGET(*mat,i,0), inc->mean, inc->m2, 1.0 / inc->count, inc->cols);
+    }
+    for(long j=0; j<inc->cols; j++){
+      incr_finish_col(inc, j);
+    }
+    return 0;
+  }
+
+  vector_t avg, std;
+  if(vector_init(&avg, inc->cols) || vector_init(&std, inc->cols)){
+    return 1;
+  }
+  int ret = colnorm_OPTM_flags(mat, &avg, &std, thread_count, COLNORM_STABLE | COLNORM_STATS_ONLY);
+  double n_a = inc->count;
+  double n_b = mat->rows;
+  double n_ab = n_a + n_b;
+  for(long j=0; ret == 0 && j<inc->cols; j++){
+    double delta = VGET(avg,j) - inc->mean[j];
+    inc->mean[j] += delta * (n_b / n_ab);
+    inc->m2[j] += VGET(std,j) * VGET(std,j) * n_b + delta * delta * (n_a * n_b / n_ab);
+  }
+  if(ret == 0){                 // nothing was merged on failure
+    inc->count += mat->rows;
+    for(long j=0; j<inc->cols; j++){
+      incr_finish_col(inc, j);
+    }
+  }
+  vector_free_data(&avg);
+  vector_free_data(&std);
+  return ret;
+}
+
+// Add one row of inc->cols values to the statistics
+void colnorm_incr_append_row(colnorm_incr_t *inc, const double *row){
+  inc->count++;
+  colnorm_kernels->welford(row, inc->mean, inc->m2, 1.0 / inc->count, inc->cols);
+  for(long j=0; j<inc->cols; j++){
+    incr_finish_col(inc, j);
+  }
+}
+
+// Account for the cell in column j of one of the rows already added
+// changing from old_val to new_val. The count is unchanged so the mean
+// moves by the difference over the count and M2 by
+//   (new_val - old_val) * (new_val - new_mean + old_val - old_mean)
+// which follows from M2 = sum(x^2) - count*mean^2. Constant time.
+// Returns 0 on success and 1 if no rows have been added yet.
+int colnorm_incr_update(colnorm_incr_t *inc, long j, double old_val, double new_val){
+  if(inc->count == 0){
+    printf("colnorm_incr_update: no rows have been added to update\n");
+    return 1;
+  }
+  double diff = new_val - old_val;
+  double old_mean = inc->mean[j];
+  inc->mean[j] += diff / inc->count;
+  inc->m2[j] += diff * (new_val - inc->mean[j] + old_val - old_mean);
+  incr_finish_col(inc, j);
+  return 0;
+}
+
+// Copy the current column means and standard deviations into avg_ptr
+// and std_ptr which must have inc->cols elements
+void colnorm_incr_stats(colnorm_incr_t *inc, vector_t *avg_ptr, vector_t *std_ptr){
+  memcpy(avg_ptr->data, inc->mean, sizeof(double) * inc->cols);
+  memcpy(std_ptr->data, inc->std, sizeof(double) * inc->cols);
+}
+
+// Normalize all of src into dst, which may be the same matrix, with
+// the current statistics on thread_count threads. Returns 0 on success
+// and nonzero on error.
+int colnorm_incr_normalize(colnorm_incr_t *inc, const matrix_t *src, matrix_t *dst, int thread_count){
+  if(src->cols != inc->cols){
+    printf("colnorm_incr_normalize: matrix has %ld cols, expected %ld\n",src->cols,inc->cols);
+    return 1;
+  }
+  vector_t avg = { inc->cols, inc->mean };
+  vector_t std = { inc->cols, inc->std };
+  return colnorm_OPTM_into(src, dst, &avg, &std, thread_count, COLNORM_APPLY_ONLY);
+}
+
+// Normalize only rows [row_beg,row_end) of src into the same rows of
+// dst with the current statistics, for readers that look at a few
+// rows of a large matrix and shouldn't pay to normalize all of it.
+void colnorm_incr_normalize_rows(colnorm_incr_t *inc, const matrix_t *src, matrix_t *dst,
+                                 long row_beg, long row_end){
+  for(long i=row_beg; i<row_end; i++){
+    colnorm_kernels->normalize(&MGET(*src,i,0), &MGET(*dst,i,0), inc->mean, inc->inv_std, inc->cols);
+  }
+}
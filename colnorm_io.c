@@ -0,0 +1,979 @@
+// colnorm_io.c: reading and writing matrices in files. Besides the
+// whitespace separated text format read by matrix_read_from_file()
+// matrices may be stored in a binary format whose rows are laid out
+// exactly as in memory so that a matrix can be mapped from the file
+// with mmap() and used without any parsing.
+//
+// Binary layout, all integers little endian as on x86-64:
+//   bytes 0..63    colnorm_binhdr_t header
+//   data_offset    rows * col_space elements, row after row including
+//                  the padding at the end of each row
+// data_offset is a multiple of the page size so the data can be mapped
+// on its own and every row starts on a multiple of align bytes.
+#include "colnorm.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <float.h>
+
+#define BIN_PAGE 4096           // data_offset granularity, a multiple of any page size we map with
+
+// Returns the bytes taken by one element of the given type or 0 for
+// an unknown type
+long colnorm_dtype_bytes(int dtype){
+  switch(dtype){
+  case COLNORM_F64:  return sizeof(double);
+  case COLNORM_F32:  return sizeof(float);
+  case COLNORM_F16:
+  case COLNORM_BF16: return sizeof(uint16_t);
+  }
+  return 0;
+}
+
+// Write a header and rows*col_space elements of the given type
+// starting at data to the named file. Large matrices are written as
+// many requests in flight through colnorm_aio_write(). Returns 0 on
+// success and nonzero on error.
+static int bin_write(char *fname, int dtype, long rows, long cols, long col_space, const void *data){
+  colnorm_binhdr_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.dtype = dtype;
+  hdr.rows = rows;
+  hdr.cols = cols;
+  hdr.col_space = col_space;
+  int fd = colnorm_binary_create(fname, &hdr);
+  if(fd < 0){
+    return 1;
+  }
+  size_t bytes = colnorm_dtype_bytes(dtype) * rows * col_space;
+  colnorm_aio_t aio;
+  colnorm_aio_init(&aio, bytes > COLNORM_AIO_BLOCK ? COLNORM_AIO_AUTO : COLNORM_AIO_THREADS,
+                   COLNORM_AIO_DEPTH);
+  int bad = colnorm_aio_write(&aio, fd, data, bytes, hdr.data_offset);
+  colnorm_aio_free(&aio);
+  if(close(fd) != 0 || bad){
+    perror("couldn't write binary matrix file");
+    return 1;
+  }
+  return 0;
+}
+
+// Open the named binary matrix file for reading, or for reading and
+// writing if write is nonzero, and check its header which is copied
+// into hdr. dtype must match the file's type unless it is -1. Returns
+// the file descriptor or -1 on error.
+static int bin_open(char *fname, int dtype, int write, colnorm_binhdr_t *hdr){
+  int fd = open(fname, write ? O_RDWR : O_RDONLY);
+  if(fd < 0){
+    perror("couldn't open binary matrix file");
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)){
+    printf("%s: can't read binary matrix header\n",fname);
+    close(fd);
+    return -1;
+  }
+  long elem_bytes = colnorm_dtype_bytes(hdr->dtype);
+  if(memcmp(hdr->magic, COLNORM_BIN_MAGIC, sizeof(hdr->magic)) != 0){
+    printf("%s: not a binary matrix file\n",fname);
+    close(fd);
+    return -1;
+  }
+  if(hdr->version != COLNORM_BIN_VERSION){
+    printf("%s: unsupported binary matrix version %u\n",fname,hdr->version);
+    close(fd);
+    return -1;
+  }
+  if(elem_bytes == 0 || (dtype != -1 && (int) hdr->dtype != dtype)){
+    printf("%s: element type %u where %d expected\n",fname,hdr->dtype,dtype);
+    close(fd);
+    return -1;
+  }
+  if(hdr->rows <= 0 || hdr->cols <= 0 || hdr->col_space < hdr->cols ||
+     hdr->data_offset < (int64_t) sizeof(*hdr) || hdr->data_offset % BIN_PAGE != 0 ||
+     hdr->rows > (st.st_size - hdr->data_offset) / (elem_bytes * hdr->col_space)){
+    printf("%s: corrupt binary matrix header or truncated data\n",fname);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Open the named binary matrix file, check its header and map its
+// data. dtype must match the file's type unless it is -1. Fills in
+// hdr and sets *data to the mapping of the data which is
+// hdr->rows*hdr->col_space elements long. With MATRIX_MAP_SHARED
+// writes to the data go to the file, otherwise they stay private to
+// the process. Returns 0 on success and nonzero on error.
+static int bin_map(char *fname, int dtype, int flags, colnorm_binhdr_t *hdr, void **data,
+                   size_t *data_bytes){
+  int fd = bin_open(fname, dtype, flags & MATRIX_MAP_SHARED, hdr);
+  if(fd < 0){
+    return 1;
+  }
+  *data_bytes = colnorm_dtype_bytes(hdr->dtype) * hdr->rows * hdr->col_space;
+  *data = mmap(NULL, *data_bytes, PROT_READ | PROT_WRITE,
+               (flags & MATRIX_MAP_SHARED) ? MAP_SHARED : MAP_PRIVATE, fd, hdr->data_offset);
+  close(fd);                    // the mapping keeps the file open
+  if(*data == MAP_FAILED){
+    perror("couldn't map binary matrix file");
+    return 1;
+  }
+  madvise(*data, *data_bytes, MADV_SEQUENTIAL);  // only a hint; ignore failure
+  return 0;
+}
+
+// Open the named binary matrix file for reading with pread() and
+// check its header which is copied into hdr. Rows start at
+// hdr->data_offset in the file. Returns the file descriptor, to be
+// closed by the caller, or -1 on error.
+int colnorm_binary_open(char *fname, colnorm_binhdr_t *hdr){
+  return bin_open(fname, -1, 0, hdr);
+}
+
+// Create the named binary matrix file with the shape and type given
+// in hdr, whose data_offset and align are filled in, and size it to
+// hold every row so the rows can then be written in any order with
+// pwrite(). Returns the file descriptor, to be closed by the caller,
+// or -1 on error.
+int colnorm_binary_create(char *fname, colnorm_binhdr_t *hdr){
+  long elem_bytes = colnorm_dtype_bytes(hdr->dtype);
+  if(elem_bytes == 0 || hdr->rows <= 0 || hdr->cols <= 0 || hdr->col_space < hdr->cols){
+    printf("%s: bad binary matrix shape\n",fname);
+    return -1;
+  }
+  size_t row_bytes = elem_bytes * hdr->col_space;
+  long align = BIN_PAGE;
+  while(align > 1 && hdr->rows > 1 && row_bytes % align != 0){
+    align /= 2;
+  }
+  memcpy(hdr->magic, COLNORM_BIN_MAGIC, sizeof(hdr->magic));
+  hdr->version = COLNORM_BIN_VERSION;
+  hdr->align = align;
+  hdr->data_offset = BIN_PAGE;
+  hdr->reserved = 0;
+
+  int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    perror("couldn't create binary matrix file");
+    return -1;
+  }
+  if(pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+     ftruncate(fd, hdr->data_offset + row_bytes * hdr->rows) != 0){
+    perror("couldn't write binary matrix file");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Write mat to the named file in the binary format. Returns 0 on
+// success and nonzero on error.
+int matrix_write_binary(char *fname, matrix_t *mat){
+  return bin_write(fname, COLNORM_F64, mat->rows, mat->cols, mat->col_space, mat->data);
+}
+
+// Initialize mat to point directly at the rows in the named binary
+// file of doubles, which is mapped rather than read, so pages are only
+// brought in as they are used. Without MATRIX_MAP_SHARED in flags the
+// mapping is private and normalizing the matrix in place leaves the
+// file untouched. Free with matrix_free_data(). Returns 0 on success
+// and nonzero on error.
+int matrix_map_binary(char *fname, matrix_t *mat, int flags){
+  colnorm_binhdr_t hdr;
+  void *data;
+  size_t bytes;
+  if(bin_map(fname, COLNORM_F64, flags, &hdr, &data, &bytes)){
+    return 1;
+  }
+  mat->rows = hdr.rows;
+  mat->cols = hdr.cols;
+  mat->col_space = hdr.col_space;
+  mat->data = data;
+  mat->alloc = MATRIX_ALLOC_MMAP;
+  mat->alloc_bytes = bytes;
+  return 0;
+}
+
+// Like matrix_map_binary() but reads the rows into memory of their
+// own with colnorm_aio_read(), through io_uring with several requests
+// in flight unless flags has COLNORM_IO_THREADS. With
+// COLNORM_IO_DIRECT the reads bypass the page cache, which suits files
+// read once that would otherwise push other data out of it. Free with
+// matrix_free_data(). Returns 0 on success and nonzero on error.
+int matrix_read_binary(char *fname, matrix_t *mat, int flags){
+  colnorm_binhdr_t hdr;
+  int fd = bin_open(fname, COLNORM_F64, 0, &hdr);
+  if(fd < 0){
+    return 1;
+  }
+  size_t bytes = sizeof(double) * hdr.rows * hdr.col_space;
+  size_t alloc_bytes = (bytes + BIN_PAGE - 1) / BIN_PAGE * BIN_PAGE;
+  double *data = aligned_alloc(BIN_PAGE, alloc_bytes);
+  if(data == NULL){
+    printf("%s: couldn't allocate %zu bytes\n",fname,alloc_bytes);
+    close(fd);
+    return 1;
+  }
+  if((flags & COLNORM_IO_DIRECT) && colnorm_aio_direct(fd, 1)){
+    printf("%s: O_DIRECT not supported, going through the page cache\n",fname);
+  }
+  colnorm_aio_t aio;
+  colnorm_aio_init(&aio, (flags & COLNORM_IO_THREADS) ? COLNORM_AIO_THREADS : COLNORM_AIO_AUTO,
+                   COLNORM_AIO_DEPTH);
+  colnorm_aio_register(&aio, (void **) &data, &alloc_bytes, 1);
+  int bad = colnorm_aio_read(&aio, fd, data, bytes, hdr.data_offset);
+  colnorm_aio_free(&aio);
+  close(fd);
+  if(bad){
+    printf("%s: couldn't read binary matrix data\n",fname);
+    free(data);
+    return 1;
+  }
+  mat->rows = hdr.rows;
+  mat->cols = hdr.cols;
+  mat->col_space = hdr.col_space;
+  mat->data = data;
+  mat->alloc = MATRIX_ALLOC_MALLOC;
+  mat->alloc_bytes = 0;
+  return 0;
+}
+
+// fmatrix_t versions of matrix_write_binary() and matrix_map_binary()
+int fmatrix_write_binary(char *fname, fmatrix_t *mat){
+  return bin_write(fname, COLNORM_F32, mat->rows, mat->cols, mat->col_space, mat->data);
+}
+
+int fmatrix_map_binary(char *fname, fmatrix_t *mat, int flags){
+  colnorm_binhdr_t hdr;
+  void *data;
+  size_t bytes;
+  if(bin_map(fname, COLNORM_F32, flags, &hdr, &data, &bytes)){
+    return 1;
+  }
+  mat->rows = hdr.rows;
+  mat->cols = hdr.cols;
+  mat->col_space = hdr.col_space;
+  mat->data = data;
+  mat->alloc = MATRIX_ALLOC_MMAP;
+  mat->alloc_bytes = bytes;
+  return 0;
+}
+
+// hmatrix_t versions of matrix_write_binary() and
+// matrix_map_binary(); the 16-bit type is taken from the file
+int hmatrix_write_binary(char *fname, hmatrix_t *mat){
+  return bin_write(fname, mat->dtype, mat->rows, mat->cols, mat->col_space, mat->data);
+}
+
+int hmatrix_map_binary(char *fname, hmatrix_t *mat, int flags){
+  colnorm_binhdr_t hdr;
+  void *data;
+  size_t bytes;
+  if(bin_map(fname, -1, flags, &hdr, &data, &bytes)){
+    return 1;
+  }
+  if(hdr.dtype != COLNORM_F16 && hdr.dtype != COLNORM_BF16){
+    printf("%s: not a 16-bit matrix\n",fname);
+    munmap(data, bytes);
+    return 1;
+  }
+  mat->rows = hdr.rows;
+  mat->cols = hdr.cols;
+  mat->col_space = hdr.col_space;
+  mat->dtype = hdr.dtype;
+  mat->data = data;
+  mat->alloc = MATRIX_ALLOC_MMAP;
+  mat->alloc_bytes = bytes;
+  return 0;
+}
+
+// Read the element type recorded in the named binary file into
+// *dtype. Returns 0 on success and nonzero if the file can't be read
+// or isn't a binary matrix file.
+int colnorm_binary_dtype(char *fname, int *dtype){
+  colnorm_binhdr_t hdr;
+  FILE *file = fopen(fname,"r");
+  if(file == NULL){
+    return 1;
+  }
+  int ok = fread(&hdr, sizeof(hdr), 1, file) == 1 &&
+    memcmp(hdr.magic, COLNORM_BIN_MAGIC, sizeof(hdr.magic)) == 0;
+  fclose(file);
+  if(!ok){
+    return 1;
+  }
+  *dtype = hdr.dtype;
+  return 0;
+}
+
+// Vectors are stored as a 1 x len matrix of doubles. They are small
+// so they are read into memory from vector_init() rather than mapped.
+int vector_write_binary(char *fname, vector_t *vec){
+  return bin_write(fname, COLNORM_F64, 1, vec->len, vec->len, vec->data);
+}
+
+int vector_read_binary(char *fname, vector_t *vec){
+  matrix_t mat;
+  if(matrix_map_binary(fname, &mat, 0)){
+    return 1;
+  }
+  if(mat.rows != 1 || vector_init(vec, mat.cols)){
+    printf("%s: not a vector\n",fname);
+    matrix_free_data(&mat);
+    return 1;
+  }
+  memcpy(vec->data, mat.data, sizeof(double) * mat.cols);
+  matrix_free_data(&mat);
+  return 0;
+}
+
+// Write mat to the named file in the text format read by
+// matrix_read_from_file(). Elements are printed with enough digits to
+// be read back exactly. Returns 0 on success and nonzero on error.
+int matrix_save_text(char *fname, matrix_t *mat){
+  FILE *file = fopen(fname,"w");
+  if(file == NULL){
+    perror("couldn't open matrix file");
+    return 1;
+  }
+  int thread_count = colnorm_pool_size();
+  int bad = matrix_write_fmt(file, mat, COLNORM_FMT_LOSSLESS, thread_count > 0 ? thread_count : 1);
+  if(fclose(file) != 0 || bad){
+    perror("couldn't write matrix file");
+    return 1;
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Parallel text loading
+
+#define PARSE_MAX_TOKEN 512     // longest number handed to strtod()
+
+static int is_space(char c){
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// powers of ten which are exact doubles
+static const double exact_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// powers of ten which are exact x87 long doubles (64-bit mantissa)
+static const long double exact_pow10l[] = {
+  1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+  1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+  1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L,
+};
+
+// Convert m * 10^exp10 for |exp10| <= 27 by one long double multiply
+// or divide, which rounds to 64 bits, and then rounding to double.
+// That second rounding can only differ from rounding the exact value
+// when the long double lands within an ulp of a point halfway between
+// two doubles, i.e. its 11 extra mantissa bits are near 0x400. Returns
+// 0 and sets *x when the result is certain and nonzero otherwise.
+static int pow10_long_double(unsigned long m, int exp10, double *x){
+  long double v = (long double) m;
+  v = exp10 < 0 ? v / exact_pow10l[-exp10] : v * exact_pow10l[exp10];
+  unsigned long mant;
+  memcpy(&mant, &v, sizeof(mant));    // the 64-bit significand of the x87 format
+  unsigned long extra = mant & 0x7FF;
+  if(extra >= 0x3FF && extra <= 0x401){
+    return 1;
+  }
+  *x = (double) v;
+  return 0;
+}
+
+// Parse the number starting at p, which must end before end at a
+// whitespace character or end. Decimal numbers with at most 19
+// significant digits whose value is m * 10^e for an integer m < 2^53
+// and |e| <= 22 are converted exactly with a single multiply or
+// divide; longer mantissas such as the 17 digits printed for lossless
+// output go through pow10_long_double(). Anything else, such as large
+// exponents, inf and nan, is handed to strtod(). Sets *x and returns
+// the position after the number or NULL if it is malformed.
+static const char *parse_double(const char *p, const char *end, double *x){
+  const char *start = p;
+  int neg = 0;
+  if(p < end && (*p == '-' || *p == '+')){
+    neg = *p == '-';
+    p++;
+  }
+  unsigned long m = 0;
+  int digits = 0;               // significant digits in m
+  int any = 0;                  // any digit seen at all
+  int exp10 = 0;
+  for(; p < end && *p >= '0' && *p <= '9'; p++){
+    any = 1;
+    if(m != 0 || *p != '0'){
+      m = m*10 + (*p - '0');
+      digits++;
+    }
+  }
+  if(p < end && *p == '.'){
+    for(p++; p < end && *p >= '0' && *p <= '9'; p++){
+      any = 1;
+      if(m != 0 || *p != '0'){
+        m = m*10 + (*p - '0');
+        digits++;
+      }
+      exp10--;
+    }
+  }
+  if(any && p < end && (*p == 'e' || *p == 'E')){
+    const char *q = p+1;
+    int eneg = 0;
+    if(q < end && (*q == '-' || *q == '+')){
+      eneg = *q == '-';
+      q++;
+    }
+    if(q < end && *q >= '0' && *q <= '9'){
+      int e = 0;
+      for(; q < end && *q >= '0' && *q <= '9'; q++){
+        e = e < 10000 ? e*10 + (*q - '0') : e;      // saturate; strtod() gets these
+      }
+      exp10 += eneg ? -e : e;
+      p = q;
+    }
+  }
+  if(any && (p == end || is_space(*p)) && digits <= 19){
+    if(m <= (1UL << 53) && exp10 >= -22 && exp10 <= 22){
+      double v = (double) m;
+      v = exp10 < 0 ? v / exact_pow10[-exp10] : v * exact_pow10[exp10];
+      *x = neg ? -v : v;
+      return p;
+    }
+    double v;
+    if(exp10 >= -27 && exp10 <= 27 && pow10_long_double(m, exp10, &v) == 0){
+      *x = neg ? -v : v;
+      return p;
+    }
+  }
+
+  // slow path: copy the token so strtod() sees a terminated string
+  const char *tok_end = start;
+  while(tok_end < end && !is_space(*tok_end)){
+    tok_end++;
+  }
+  char buf[PARSE_MAX_TOKEN];
+  long len = tok_end - start;
+  if(len == 0 || len >= PARSE_MAX_TOKEN){
+    return NULL;
+  }
+  memcpy(buf, start, len);
+  buf[len] = '\0';
+  char *stop;
+  *x = strtod(buf, &stop);
+  return stop == buf + len ? tok_end : NULL;
+}
+
+// context shared by the threads parsing a mapped text file
+typedef struct {
+  const char *text;             // start of the mapping
+  long size;                    // bytes in the file
+  matrix_t mat;
+  long *bounds;                 // chunk t covers [bounds[t], bounds[t+1])
+  long *first;                  // index of the first element in each chunk
+  long *err;                    // offset of the first error in each chunk or -1
+  const char **why;             // description of each chunk's error
+  int pass;                     // 0 counts numbers, 1 parses them
+} parse_ctx_t;
+
+// Pass 0 counts the numbers that start in this thread's chunk. Pass 1
+// parses them into the matrix starting at element first[thread_id],
+// noting the offset of the first malformed or surplus number.
+static void parse_worker(int thread_id, int thread_count, void *arg){
+  parse_ctx_t *ctx = (parse_ctx_t *) arg;
+  const char *p = ctx->text + ctx->bounds[thread_id];
+  const char *end = ctx->text + ctx->bounds[thread_id+1];
+  const char *file_end = ctx->text + ctx->size;
+  if(ctx->pass == 0){
+    long count = 0;
+    while(p < end){
+      while(p < end && is_space(*p)){
+        p++;
+      }
+      if(p == end){
+        break;
+      }
+      count++;
+      while(p < end && !is_space(*p)){
+        p++;
+      }
+    }
+    ctx->first[thread_id] = count;
+    return;
+  }
+
+  long k = ctx->first[thread_id];
+  long total = ctx->mat.rows * ctx->mat.cols;
+  long i = k / ctx->mat.cols;
+  long j = k % ctx->mat.cols;
+  ctx->err[thread_id] = -1;
+  while(p < end){
+    while(p < end && is_space(*p)){
+      p++;
+    }
+    if(p == end){
+      break;
+    }
+    double x;
+    if(k >= total){
+      ctx->err[thread_id] = p - ctx->text;
+      ctx->why[thread_id] = "more numbers than rows*cols";
+      return;
+    }
+    const char *next = parse_double(p, file_end, &x);
+    if(next == NULL){
+      ctx->err[thread_id] = p - ctx->text;
+      ctx->why[thread_id] = "malformed number";
+      return;
+    }
+    MSET(ctx->mat, i, j, x);
+    k++;
+    if(++j == ctx->mat.cols){
+      j = 0;
+      i++;
+    }
+    p = next;
+  }
+}
+
+// Read a non-negative integer for the header at text[*pos], skipping
+// whitespace before it. Returns 0 on success and nonzero if there is
+// no integer there.
+static int parse_header_long(const char *text, long size, long *pos, long *x){
+  long p = *pos;
+  while(p < size && is_space(text[p])){
+    p++;
+  }
+  if(p == size || text[p] < '0' || text[p] > '9'){
+    *pos = p;
+    return 1;
+  }
+  long v = 0;
+  for(; p < size && text[p] >= '0' && text[p] <= '9'; p++){
+    v = v < LONG_MAX/10 ? v*10 + (text[p] - '0') : LONG_MAX;
+  }
+  *pos = p;
+  *x = v;
+  return p < size && !is_space(text[p]);
+}
+
+// Load a matrix in the text format of matrix_read_from_file() using
+// thread_count threads. The file is mapped and split into one chunk
+// per thread at whitespace. Each thread counts the numbers in its
+// chunk, and a prefix sum of the counts tells it the element index its
+// chunk starts at. It then parses its numbers straight into their
+// slots. Malformed input is reported with the byte offset of the
+// offending text rather than aborting. Returns 0 on success and
+// nonzero on error, in which case *mat_ref is untouched.
+int matrix_load_text(char *fname, matrix_t *mat_ref, int thread_count){
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+  int fd = open(fname, O_RDONLY);
+  if(fd < 0){
+    perror("couldn't open matrix file");
+    return 1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0){
+    printf("%s: empty matrix file\n",fname);
+    close(fd);
+    return 1;
+  }
+  long size = st.st_size;
+  const char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(text == MAP_FAILED){
+    perror("couldn't map matrix file");
+    return 1;
+  }
+  madvise((void *) text, size, MADV_SEQUENTIAL);
+
+  int ret = 0;
+  long pos = 0, rows = 0, cols = 0;
+  matrix_t mat;
+  if(parse_header_long(text, size, &pos, &rows) || parse_header_long(text, size, &pos, &cols) ||
+     rows <= 0 || cols <= 0){
+    printf("%s: byte %ld: expected positive rows and cols\n",fname,pos);
+    munmap((void *) text, size);
+    return 1;
+  }
+  if(matrix_init(&mat, rows, cols)){
+    munmap((void *) text, size);
+    return 1;
+  }
+
+  // chunk boundaries are moved forward to whitespace so no number is
+  // split between two threads
+  long bounds[thread_count+1], first[thread_count], err[thread_count];
+  const char *why[thread_count];
+  for(int t=0; t<=thread_count; t++){
+    long b = pos + (size - pos) / thread_count * t;
+    if(t == thread_count){
+      b = size;
+    }
+    while(b < size && !is_space(text[b])){
+      b++;
+    }
+    bounds[t] = t > 0 && b < bounds[t-1] ? bounds[t-1] : b;
+  }
+  parse_ctx_t ctx = {
+    .text = text, .size = size, .mat = mat,
+    .bounds = bounds, .first = first, .err = err, .why = why, .pass = 0,
+  };
+  colnorm_team_run(parse_worker, &ctx, thread_count);
+  long total = 0;
+  for(int t=0; t<thread_count; t++){
+    long count = first[t];
+    first[t] = total;
+    total += count;
+  }
+  ctx.pass = 1;
+  colnorm_team_run(parse_worker, &ctx, thread_count);
+
+  for(int t=0; t<thread_count; t++){            // chunks are in file order so
+    if(err[t] >= 0){                            // the first error found is earliest
+      printf("%s: byte %ld: %s\n",fname,err[t],why[t]);
+      ret = 1;
+      break;
+    }
+  }
+  if(ret == 0 && total < rows*cols){
+    printf("%s: byte %ld: expected %ld numbers, found %ld\n",fname,size,rows*cols,total);
+    ret = 1;
+  }
+  munmap((void *) text, size);
+  if(ret){
+    matrix_free_data(&mat);
+    return ret;
+  }
+  *mat_ref = mat;
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Bulk text writing
+
+#define WRITE_BLOCK_BYTES (4L*1024*1024)        // formatted bytes per thread per round
+
+// growable buffer that one thread formats rows into
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} fmt_buf_t;
+
+// make room for at least n more bytes
+static void buf_reserve(fmt_buf_t *b, size_t n){
+  if(b->len + n > b->cap){
+    b->cap = (b->len + n) * 2;
+    b->data = realloc(b->data, b->cap);
+  }
+}
+
+// append the decimal digits of v, padded on the left with spaces to
+// at least width characters
+static void buf_long(fmt_buf_t *b, long v, int width){
+  char digits[24];
+  int n = 0;
+  unsigned long u = v < 0 ? -(unsigned long) v : (unsigned long) v;
+  do{
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  }while(u != 0);
+  if(v < 0){
+    digits[n++] = '-';
+  }
+  buf_reserve(b, n + width);
+  for(int k=n; k<width; k++){
+    b->data[b->len++] = ' ';
+  }
+  while(n > 0){
+    b->data[b->len++] = digits[--n];
+  }
+}
+
+// append x as printf("%6.2f") would. Elements of typical magnitude
+// whose hundredths aren't within rounding error of a tie are
+// formatted with integer arithmetic; the rest go through snprintf().
+static void buf_fixed(fmt_buf_t *b, double x){
+  double ax = fabs(x);
+  if(ax < 1e7){                                 // false for nan too
+    double r = ax * 100.0;                      // off by at most 1.1e-7
+    long n = (long) r;
+    double frac = r - n;
+    if(fabs(frac - 0.5) > 1e-6){
+      n += frac > 0.5;
+      char digits[16];
+      int len = 0;
+      digits[len++] = '0' + n % 10;
+      digits[len++] = '0' + (n / 10) % 10;
+      digits[len++] = '.';
+      n /= 100;
+      do{
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+      }while(n != 0);
+      if(signbit(x)){                           // printf keeps the sign of -0.001 and -0.0
+        digits[len++] = '-';
+      }
+      buf_reserve(b, len + 6);
+      for(int k=len; k<6; k++){
+        b->data[b->len++] = ' ';
+      }
+      while(len > 0){
+        b->data[b->len++] = digits[--len];
+      }
+      return;
+    }
+  }
+  buf_reserve(b, 400);                          // enough for %f of any double
+  b->len += snprintf(b->data + b->len, 400, "%6.2f", x);
+}
+
+// append x written with the first prec significant digits in
+// digits[], rounded to nearest by digits[prec], in the style of printf("%g"):
+// exponent notation outside 1e-4 <= |x| < 10^prec and no trailing
+// zeros. exp10 is the decimal exponent of the first digit.
+static void buf_digits(fmt_buf_t *b, int neg, const char *digits, int exp10, int prec){
+  char d[26];
+  memcpy(d, digits, prec);
+  if(digits[prec] >= '5'){                      // round up, carrying leftwards
+    int k = prec-1;
+    while(k >= 0 && d[k] == '9'){
+      d[k--] = '0';
+    }
+    if(k >= 0){
+      d[k]++;
+    }
+    else{                                       // 9.99.. became 10.0..
+      d[0] = '1';
+      exp10++;
+    }
+  }
+  int nd = prec;
+  while(nd > 1 && d[nd-1] == '0'){
+    nd--;
+  }
+  buf_reserve(b, prec + 32);
+  char *p = b->data + b->len;
+  if(neg){
+    *p++ = '-';
+  }
+  if(exp10 < -4 || exp10 >= prec){              // d.ddde+XX
+    *p++ = d[0];
+    if(nd > 1){
+      *p++ = '.';
+      memcpy(p, d+1, nd-1);
+      p += nd-1;
+    }
+    p += sprintf(p, "e%c%02d", exp10 < 0 ? '-' : '+', exp10 < 0 ? -exp10 : exp10);
+  }
+  else if(exp10 < 0){                           // 0.000ddd
+    *p++ = '0';
+    *p++ = '.';
+    for(int k=-1; k>exp10; k--){
+      *p++ = '0';
+    }
+    memcpy(p, d, nd);
+    p += nd;
+  }
+  else{                                         // ddd.ddd
+    for(int k=0; k<nd || k<=exp10; k++){
+      if(k == exp10+1){
+        *p++ = '.';
+      }
+      *p++ = k < nd ? d[k] : '0';
+    }
+  }
+  b->len = p - b->data;
+}
+
+// append the shortest of x rounded to 15, 16 or 17 significant digits
+// that reads back as exactly x; correctly rounded 17 digits always
+// do. The digits come from scaling x by a power of ten in long double
+// and rounding to an integer, which is almost always the correctly
+// rounded decimal; every candidate is checked by converting it back
+// with pow10_long_double(), or parse_double() when that is unsure, so
+// a rare miss only costs a longer candidate or a final snprintf().
+// Integers are formatted directly. Outside 1e-280 < |x| < 1e280 the
+// scaling would leave long double's exact range, so the candidates
+// come from snprintf() and are checked with strtod() instead; there
+// subnormals, which hold fewer than 15 significant digits, try every
+// precision from 1 up so that 5e-324 is written as such.
+static void buf_lossless(fmt_buf_t *b, double x){
+  // the range test comes first: converting nan, inf or anything
+  // beyond a long to long is undefined
+  if(fabs(x) < 1e15 && x == (double) (long) x && !(x == 0 && signbit(x))){
+    buf_long(b, (long) x, 0);
+    return;
+  }
+  buf_reserve(b, 32);
+  double ax = fabs(x);
+  int exp2 = 0;
+  if(isfinite(x)){
+    frexp(ax, &exp2);                           // ax in [2^(exp2-1), 2^exp2)
+  }
+  int exp10 = (int) floor((exp2-1) * 0.30102999566398120);      // at most one low; log10() is slow
+  int up = exp10 + 1;                           // is ax >= 10^up after all?
+  if(up >= 0 && up <= 27 ? ax >= exact_pow10l[up] : (up < 0 && up >= -27 && ax * exact_pow10l[-up] >= 1)){
+    exp10 = up;
+  }
+  for(int prec=15; prec<=17 && ax != 0 && exp10 > -280 && exp10 < 280; prec++){
+    int scale = prec - 1 - exp10;               // digits = round(ax * 10^scale)
+    if(scale < -27 || scale > 27){
+      break;
+    }
+    long double v = ax;
+    v = scale < 0 ? v / exact_pow10l[-scale] : v * exact_pow10l[scale];
+    unsigned long n = (unsigned long) (v + 0.5L);
+    int e = exp10;
+    if(n >= (unsigned long) exact_pow10[prec]){ // exp10 was one low or rounding carried
+      n = (unsigned long) (v / 10 + 0.5L);
+      e++;
+    }
+    double back;
+    int unsure = pow10_long_double(n, e - (prec-1), &back);
+    if(!unsure && back != ax){
+      continue;
+    }
+    char digits[26];
+    for(int k=prec-1; k>=0; k--){
+      digits[k] = '0' + n % 10;
+      n /= 10;
+    }
+    digits[prec] = '0';                         // nothing more to round
+    size_t start = b->len;
+    buf_digits(b, x < 0, digits, e, prec);
+    const char *end = b->data + b->len;
+    if(unsure && (parse_double(b->data + start, end, &back) != end || back != x)){
+      b->len = start;                           // near a tie; strtod() said no
+      continue;
+    }
+    return;
+  }
+  int first = (ax != 0 && ax < DBL_MIN) ? 1 : 15;
+  for(int prec=first; prec<=17; prec++){        // nan and inf end up at 17 too
+    buf_reserve(b, 32);
+    int len = snprintf(b->data + b->len, 32, "%.*g", prec, x);
+    if(prec == 17 || strtod(b->data + b->len, NULL) == x){
+      b->len += len;
+      return;
+    }
+  }
+}
+
+// context shared by the threads formatting a block of rows
+typedef struct {
+  matrix_t mat;
+  int fmt;
+  long row_beg;                 // rows of this round
+  long row_end;
+  fmt_buf_t *bufs;              // one per thread
+} write_ctx_t;
+
+static void write_worker(int thread_id, int thread_count, void *arg){
+  write_ctx_t *ctx = (write_ctx_t *) arg;
+  fmt_buf_t *b = &ctx->bufs[thread_id];
+  long beg, end;
+  colnorm_split(ctx->row_end - ctx->row_beg, thread_count, thread_id, &beg, &end);
+  b->len = 0;
+  for(long i=ctx->row_beg+beg; i<ctx->row_beg+end; i++){
+    if(ctx->fmt == COLNORM_FMT_FIXED){
+      buf_long(b, i, 4);
+      buf_reserve(b, 2);
+      b->data[b->len++] = ':';
+      b->data[b->len++] = ' ';
+      for(long j=0; j<ctx->mat.cols; j++){
+        buf_fixed(b, MGET(ctx->mat,i,j));
+        b->data[b->len++] = ' ';                // buf_fixed() leaves room
+      }
+      buf_reserve(b, 1);
+      b->data[b->len++] = '\n';
+    }
+    else{
+      for(long j=0; j<ctx->mat.cols; j++){
+        buf_lossless(b, MGET(ctx->mat,i,j));
+        buf_reserve(b, 1);
+        b->data[b->len++] = j == ctx->mat.cols-1 ? '\n' : ' ';
+      }
+    }
+  }
+}
+
+// Write mat to file in one of two formats:
+//   COLNORM_FMT_FIXED     byte for byte what matrix_write() printed
+//                         with one fprintf("%6.2f ") per element
+//   COLNORM_FMT_LOSSLESS  the format read by matrix_read_from_file()
+//                         with each element in the fewest digits that
+//                         read back exactly
+// Rows are formatted into per-thread buffers by thread_count threads
+// a few MB at a time and each round is written with one fwrite() per
+// thread. Returns 0 on success and nonzero on a write error.
+int matrix_write_fmt(FILE *file, matrix_t *mat, int fmt, int thread_count){
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+  if(fmt == COLNORM_FMT_FIXED){
+    fprintf(file,"%ld x %ld matrix\n",mat->rows,mat->cols);
+  }
+  else{
+    fprintf(file,"%ld %ld\n",mat->rows,mat->cols);
+  }
+  fmt_buf_t bufs[thread_count];
+  memset(bufs, 0, sizeof(bufs));
+  write_ctx_t ctx = { .mat = *mat, .fmt = fmt, .bufs = bufs };
+  long row_bytes = 12 + 10 * mat->cols;         // typical, buffers grow if needed
+  long round_rows = thread_count * (WRITE_BLOCK_BYTES / row_bytes + 1);
+  int ret = 0;
+  for(long r0=0; r0<mat->rows && ret==0; r0+=round_rows){
+    ctx.row_beg = r0;
+    ctx.row_end = r0 + round_rows < mat->rows ? r0 + round_rows : mat->rows;
+    colnorm_team_run(write_worker, &ctx, thread_count);
+    for(int t=0; t<thread_count; t++){
+      if(bufs[t].len > 0 && fwrite(bufs[t].data, 1, bufs[t].len, file) != bufs[t].len){
+        ret = 1;
+        break;
+      }
+    }
+  }
+  for(int t=0; t<thread_count; t++){
+    free(bufs[t].data);
+  }
+  return ret;
+}
+
+// Write vec to file in the format of vector_write() for
+// COLNORM_FMT_FIXED or that of vector_read_from_file() for
+// COLNORM_FMT_LOSSLESS. Returns 0 on success and nonzero on error.
+int vector_write_fmt(FILE *file, vector_t *vec, int fmt){
+  fmt_buf_t b = {NULL, 0, 0};
+  if(fmt == COLNORM_FMT_FIXED){
+    fprintf(file,"%ld x 1 vector\n",vec->len);
+    for(long i=0; i<vec->len; i++){
+      buf_long(&b, i, 4);
+      buf_reserve(&b, 2);
+      b.data[b.len++] = ':';
+      b.data[b.len++] = ' ';
+      buf_fixed(&b, VGET(*vec,i));
+      b.data[b.len++] = '\n';
+    }
+  }
+  else{
+    fprintf(file,"%ld\n",vec->len);
+    for(long i=0; i<vec->len; i++){
+      buf_lossless(&b, VGET(*vec,i));
+      buf_reserve(&b, 1);
+      b.data[b.len++] = '\n';
+    }
+  }
+  int ret = b.len > 0 && fwrite(b.data, 1, b.len, file) != b.len;
+  free(b.data);
+  return ret;
+}
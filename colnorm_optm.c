@@ -1,5 +1,6 @@
 // optimized version of matrix column normalization
 #include "colnorm.h"
+#include <immintrin.h>          // _mm_sfence() after non-temporal stores
 
 ////////////////////////////////////////////////////////////////////////////////
 // REQUIRED: Paste a copy of your sumdiag_benchmark from an ODD grace
@@ -36,141 +37,624 @@
 // You can write several different versions of your optimized function
 // in this file and call one of them in the last function.
 
-int cn_verA(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count) {
-  // locally defined struct that contains the context
-  // for the normalization including a thread id, param thread count,
-  // a matrix struct, shared avg and std, and a shared lock
+#define CN_MIN_BAND_ROWS 32     // fewer rows per thread than this and partial reduction dominates
+#define CN_MIN_GROUP_COLS 512   // narrower column groups give rows segments too short to stream
+
+// Split n items into parts nearly equal pieces and set [*beg,*end)
+// to the range of piece idx. The first n % parts pieces get one extra
+// item so no piece is more than one item larger than another.
+void colnorm_split(long n, int parts, int idx, long *beg, long *end){
+  long base = n / parts;
+  long extra = n % parts;
+  *beg = idx * base + (idx < extra ? idx : extra);
+  *end = *beg + base + (idx < extra ? 1 : 0);
+}
+
+// Like colnorm_split() for a range of columns [lo,hi) but splits on
+// whole cache lines of doubles so neighbouring pieces never share a
+// line. Line boundaries are taken relative to the start of the row.
+static void split_lines(long lo, long hi, int parts, int idx, long *beg, long *end){
+  long first = lo / CN_LINE_DOUBLES;
+  long lines = (hi + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES - first;
+  long lb, le;
+  colnorm_split(lines, parts, idx, &lb, &le);
+  *beg = (first + lb) * CN_LINE_DOUBLES;
+  *end = (first + le) * CN_LINE_DOUBLES;
+  *beg = *beg < lo ? lo : (*beg > hi ? hi : *beg);
+  *end = *end > hi ? hi : *end;
+}
+
+// Decide how thread_count threads divide a rows x cols matrix. Thread
+// t works on row band t / col_parts and column group t % col_parts.
+//   - row partitioning (col_parts == 1) suits tall and narrow matrices;
+//     threads keep partial sums for all columns which are reduced
+//   - column partitioning (row_parts == 1) suits short and wide matrices;
+//     each thread owns whole columns so nothing needs reducing
+//   - 2D partitioning splits both ways when the partials of every
+//     thread covering every column would no longer fit in L2
+colnorm_plan_t colnorm_plan(long rows, long cols, long col_space, int thread_count){
+  colnorm_plan_t plan = { .row_parts = thread_count, .col_parts = 1 };
+  if (thread_count <= 1) {
+    return plan;
+  }
+  long max_groups = cols / CN_MIN_GROUP_COLS;    // groups wide enough to stream
+  if (max_groups < 2) {                          // narrow: rows only
+    return plan;
+  }
+  if (rows < (long) thread_count * CN_MIN_BAND_ROWS && max_groups >= thread_count) {
+    plan.row_parts = 1;                          // short and wide: columns only
+    plan.col_parts = thread_count;
+    return plan;
+  }
+  // use the fewest column groups for which one thread's partial sums
+  // over its group, two doubles per column of row stride, fit in half
+  // of L2; stick with row partitioning if they already fit
+  long l2 = colnorm_cache_bytes(2);
+  for (int pc = 1; pc <= thread_count && pc <= max_groups; pc++) {
+    if (thread_count % pc != 0) {
+      continue;
+    }
+    long group_bytes = 2 * sizeof(double) * (col_space / pc);
+    if (group_bytes <= l2 / 2 || pc == thread_count || pc == max_groups) {
+      plan.col_parts = pc;
+      plan.row_parts = thread_count / pc;
+      if (group_bytes <= l2 / 2) {
+        break;
+      }
+    }
+  }
+  return plan;
+}
+
+// Set the rows [*row_beg,*row_end) and columns [*col_beg,*col_end)
+// of a rows x cols matrix that thread thread_id covers under plan.
+void colnorm_plan_block(colnorm_plan_t plan, long rows, long cols, int thread_id,
+                        long *row_beg, long *row_end, long *col_beg, long *col_end){
+  colnorm_split(rows, plan.row_parts, thread_id / plan.col_parts, row_beg, row_end);
+  split_lines(0, cols, plan.col_parts, thread_id % plan.col_parts, col_beg, col_end);
+}
+
+// Element type independent view of a matrix_t or fmatrix_t so one
+// version of the algorithm serves both; statistics are always double
+typedef struct {
+  char *data;                   // start of row 0
+  long rows;
+  long cols;
+  long col_space;               // elements between row starts
+  int dtype;                    // one of COLNORM_F64, F32, F16, BF16
+  long elem_bytes;              // size of one element
+} cn_view_t;
+
+static cn_view_t view_f64(const matrix_t *mat){
+  cn_view_t v = { (char *) mat->data, mat->rows, mat->cols, mat->col_space,
+                  COLNORM_F64, sizeof(double) };
+  return v;
+}
+
+static cn_view_t view_f32(const fmatrix_t *mat){
+  cn_view_t v = { (char *) mat->data, mat->rows, mat->cols, mat->col_space,
+                  COLNORM_F32, sizeof(float) };
+  return v;
+}
+
+static cn_view_t view_half(const hmatrix_t *mat){
+  cn_view_t v = { (char *) mat->data, mat->rows, mat->cols, mat->col_space,
+                  mat->dtype, sizeof(uint16_t) };
+  return v;
+}
+
+// address of element (i,j) of a view
+#define VIEW_AT(v,i,j) ((v).data + ((i)*(v).col_space + (j)) * (v).elem_bytes)
+
+// Widen a segment of 16-bit elements into the double scratch buffer
+static const double *seg_widen(const colnorm_kernels_t *kern, int dtype, const char *row,
+                               double *scratch, long n){
+  if (dtype == COLNORM_BF16) {
+    kern->widen_bf16((const uint16_t *) row, scratch, n);
+  }
+  else {
+    kern->widen_f16((const uint16_t *) row, scratch, n);
+  }
+  return scratch;
+}
+
+// Row segment kernels dispatching on the element type. 16-bit
+// segments are widened into scratch, at least n doubles which stay in
+// L1, and handed to the double kernels.
+static void seg_accum(const colnorm_kernels_t *kern, int dtype, const char *row,
+                      double *sum, double *sumsq, long n, double *scratch){
+  if (dtype == COLNORM_F16 || dtype == COLNORM_BF16) {
+    kern->accum(seg_widen(kern, dtype, row, scratch, n), sum, sumsq, n);
+  }
+  else if (dtype == COLNORM_F32) {
+    kern->accum_f32((const float *) row, sum, sumsq, n);
+  }
+  else {
+    kern->accum((const double *) row, sum, sumsq, n);
+  }
+}
+
+static void seg_welford(const colnorm_kernels_t *kern, int dtype, const char *row,
+                        double *mean, double *m2, double inv_count, long n, double *scratch){
+  if (dtype == COLNORM_F16 || dtype == COLNORM_BF16) {
+    kern->welford(seg_widen(kern, dtype, row, scratch, n), mean, m2, inv_count, n);
+  }
+  else if (dtype == COLNORM_F32) {
+    kern->welford_f32((const float *) row, mean, m2, inv_count, n);
+  }
+  else {
+    kern->welford((const double *) row, mean, m2, inv_count, n);
+  }
+}
+
+// 16-bit sources may be written either as the same 16-bit type or
+// as double; other types are written as the type they are read as.
+static void seg_normalize(const colnorm_kernels_t *kern, int dtype, int dst_dtype, int stream,
+                          const char *src, char *dst, const double *avg, const double *inv_std,
+                          long n, double *scratch){
+  if (dtype == COLNORM_F16 || dtype == COLNORM_BF16) {
+    const double *wide = seg_widen(kern, dtype, src, scratch, n);
+    if (dst_dtype == COLNORM_F64) {
+      (stream ? kern->normalize_nt : kern->normalize)(wide, (double *) dst, avg, inv_std, n);
+    }
+    else {
+      kern->normalize(wide, scratch, avg, inv_std, n);
+      (dtype == COLNORM_BF16 ? kern->narrow_bf16 : kern->narrow_f16)(scratch, (uint16_t *) dst, n);
+    }
+  }
+  else if (dtype == COLNORM_F32) {
+    (stream ? kern->normalize_nt_f32 : kern->normalize_f32)
+      ((const float *) src, (float *) dst, avg, inv_std, n);
+  }
+  else {
+    (stream ? kern->normalize_nt : kern->normalize)
+      ((const double *) src, (double *) dst, avg, inv_std, n);
+  }
+}
+
+// Context of a work-stealing colnorm run. The matrix is cut into
+// chunks of chunk_rows rows by block_cols columns, numbered row block
+// by row block, and each phase is a colnorm_steal_run() over them, the
+// end of one run acting as the barrier before the next.
+typedef struct {
+  cn_view_t mat;
+  cn_view_t out;
+  int stream;                   // write out with non-temporal stores
+  vector_t *avg;
+  vector_t *std;
+  int flags;
+  int threads;
+  double *partials;             // thread t owns sum at 2*t*stride, sumsq at (2*t+1)*stride
+  long stride;                  // cols rounded up to a whole cache line
+  long *counts;                 // rows thread t summed in column block b at t*col_blocks + b
+  long chunk_rows;
+  long block_cols;              // a multiple of a cache line unless it is all of cols
+  long row_blocks;
+  long col_blocks;
+  double *inv_std;
+  double *scratch;              // block_cols doubles per thread for widening 16-bit rows
+  long scratch_stride;
+  const colnorm_kernels_t *kern;
+} cn_steal_norm_t;
+
+// rows [*r0,*r1) and columns [*c0,*c1) of a chunk
+static void steal_chunk_block(cn_steal_norm_t *ctx, long chunk, long *r0, long *r1, long *c0, long *c1){
+  long rb = chunk / ctx->col_blocks;
+  long cb = chunk % ctx->col_blocks;
+  *r0 = rb * ctx->chunk_rows;
+  *r1 = *r0 + ctx->chunk_rows < ctx->mat.rows ? *r0 + ctx->chunk_rows : ctx->mat.rows;
+  *c0 = cb * ctx->block_cols;
+  *c1 = *c0 + ctx->block_cols < ctx->mat.cols ? *c0 + ctx->block_cols : ctx->mat.cols;
+}
+
+// Fold a chunk into the partials of whichever thread runs it; in
+// stable mode each thread's running mean/M2 for a column block covers
+// every row of that block it has been handed so far
+static void steal_stats_chunk(int thread_id, long chunk, void *arg){
+  cn_steal_norm_t *ctx = (cn_steal_norm_t *) arg;
+  long r0, r1, c0, c1;
+  steal_chunk_block(ctx, chunk, &r0, &r1, &c0, &c1);
+  double *local_sum = ctx->partials + (2*thread_id)*ctx->stride;
+  double *local_sumsq = ctx->partials + (2*thread_id+1)*ctx->stride;
+  double *scratch = ctx->scratch + thread_id*ctx->scratch_stride;
+  long *count = &ctx->counts[thread_id*ctx->col_blocks + chunk % ctx->col_blocks];
+  for (long i = r0; i < r1; i++) {
+    if (ctx->flags & COLNORM_STABLE) {
+      (*count)++;
+      seg_welford(ctx->kern, ctx->mat.dtype, VIEW_AT(ctx->mat, i, c0),
+                  local_sum + c0, local_sumsq + c0, 1.0 / *count, c1 - c0, scratch);
+    }
+    else {
+      seg_accum(ctx->kern, ctx->mat.dtype, VIEW_AT(ctx->mat, i, c0),
+                local_sum + c0, local_sumsq + c0, c1 - c0, scratch);
+    }
+  }
+  if (!(ctx->flags & COLNORM_STABLE)) {
+    *count += r1 - r0;
+  }
+}
+
+// Reduce the partials of every thread for column block chunk into avg,
+// std and inv_std, as the static version does for its column ranges
+static void steal_reduce_chunk(int thread_id, long chunk, void *arg){
+  cn_steal_norm_t *ctx = (cn_steal_norm_t *) arg;
+  long c0 = chunk * ctx->block_cols;
+  long c1 = c0 + ctx->block_cols < ctx->mat.cols ? c0 + ctx->block_cols : ctx->mat.cols;
+  long rows = ctx->mat.rows;
+  for (long j = c0; j < c1; j++) {
+    if (ctx->flags & COLNORM_APPLY_ONLY) {
+      ctx->inv_std[j] = 1.0 / VGET(*ctx->std, j);
+      continue;
+    }
+    double mean, variance;
+    if (ctx->flags & COLNORM_STABLE) {
+      double n_a = 0.0, mean_a = 0.0, m2_a = 0.0;
+      for (int t = 0; t < ctx->threads; t++) {
+        double n_b = ctx->counts[t*ctx->col_blocks + chunk];
+        if (n_b == 0) {
+          continue;
+        }
+        double mean_b = ctx->partials[(2*t)*ctx->stride + j];
+        double m2_b = ctx->partials[(2*t+1)*ctx->stride + j];
+        double n_ab = n_a + n_b;
+        double delta = mean_b - mean_a;
+        mean_a += delta * (n_b / n_ab);
+        m2_a += m2_b + delta * delta * (n_a * n_b / n_ab);
+        n_a = n_ab;
+      }
+      mean = mean_a;
+      variance = m2_a / rows;
+    }
+    else {
+      double sum = 0.0;
+      double sumsq = 0.0;
+      for (int t = 0; t < ctx->threads; t++) {
+        sum += ctx->partials[(2*t)*ctx->stride + j];
+        sumsq += ctx->partials[(2*t+1)*ctx->stride + j];
+      }
+      mean = sum / rows;
+      variance = (sumsq / rows) - (mean * mean);
+    }
+    double stddev = sqrt(variance);
+    VSET(*ctx->avg, j, mean);
+    VSET(*ctx->std, j, stddev);
+    ctx->inv_std[j] = 1.0 / stddev;
+  }
+}
+
+static void steal_normalize_chunk(int thread_id, long chunk, void *arg){
+  cn_steal_norm_t *ctx = (cn_steal_norm_t *) arg;
+  long r0, r1, c0, c1;
+  steal_chunk_block(ctx, chunk, &r0, &r1, &c0, &c1);
+  double *scratch = ctx->scratch + thread_id*ctx->scratch_stride;
+  for (long i = r0; i < r1; i++) {
+    seg_normalize(ctx->kern, ctx->mat.dtype, ctx->out.dtype, ctx->stream, VIEW_AT(ctx->mat, i, c0),
+                  VIEW_AT(ctx->out, i, c0), ctx->avg->data + c0, ctx->inv_std + c0, c1 - c0, scratch);
+  }
+  if (ctx->stream) {
+    _mm_sfence();               // the next chunk may run on another thread
+  }
+}
+
+// Version of cn_verA() for COLNORM_SCHED_STEAL: the same statistics,
+// reduction and normalizing steps but run chunk by chunk with work
+// stealing rather than as one fixed block per thread, so a thread
+// that falls behind doesn't hold up the others. Chunks are tiles of
+// the cache-sized tile width and colnorm_sched_set() rows; by default
+// enough rows for about 8 chunks per thread.
+static int cn_steal(const cn_view_t *src_ptr, const cn_view_t *dst_ptr, vector_t *avg_ptr,
+                    vector_t *std_ptr, int thread_count, int flags, long chunk_rows){
+  long tile_rows, tile_cols;
+  colnorm_tile_size(src_ptr->cols, &tile_rows, &tile_cols);
+  if (chunk_rows <= 0) {
+    chunk_rows = src_ptr->rows / (8 * thread_count);
+    if (chunk_rows > tile_rows) {
+      chunk_rows = tile_rows;
+    }
+    if (chunk_rows < 1) {
+      chunk_rows = 1;
+    }
+  }
+  long stride = (src_ptr->cols + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES * CN_LINE_DOUBLES;
+  long scratch_stride = (tile_cols + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES * CN_LINE_DOUBLES;
+  cn_steal_norm_t ctx = {
+    .mat = *src_ptr,
+    .out = *dst_ptr,
+    .stream = (src_ptr->data != dst_ptr->data) &&
+      (dst_ptr->elem_bytes * dst_ptr->rows * dst_ptr->col_space > colnorm_cache_bytes(3)),
+    .avg = avg_ptr,
+    .std = std_ptr,
+    .flags = flags,
+    .threads = thread_count,
+    .partials = calloc(2 * thread_count * stride, sizeof(double)),
+    .stride = stride,
+    .chunk_rows = chunk_rows,
+    .block_cols = tile_cols,
+    .row_blocks = (src_ptr->rows + chunk_rows - 1) / chunk_rows,
+    .col_blocks = (src_ptr->cols + tile_cols - 1) / tile_cols,
+    .inv_std = malloc(src_ptr->cols * sizeof(double)),
+    .scratch = NULL,
+    .scratch_stride = scratch_stride,
+    .kern = colnorm_kernels,
+  };
+  ctx.counts = calloc(thread_count * ctx.col_blocks, sizeof(long));
+  if (src_ptr->elem_bytes == sizeof(uint16_t)) {
+    ctx.scratch = aligned_alloc(64, sizeof(double) * thread_count * scratch_stride);
+  }
+  if (ctx.partials == NULL || ctx.inv_std == NULL || ctx.counts == NULL ||
+      (src_ptr->elem_bytes == sizeof(uint16_t) && ctx.scratch == NULL)) {
+    printf("colnorm_OPTM: couldn't allocate work stealing buffers for %d threads\n", thread_count);
+    free(ctx.partials);
+    free(ctx.counts);
+    free(ctx.inv_std);
+    free(ctx.scratch);
+    return 1;
+  }
+
+  long chunks = ctx.row_blocks * ctx.col_blocks;
+  if (!(flags & COLNORM_APPLY_ONLY)) {
+    colnorm_steal_run(steal_stats_chunk, &ctx, chunks, thread_count);
+  }
+  colnorm_steal_run(steal_reduce_chunk, &ctx, ctx.col_blocks, thread_count);
+  if (!(flags & COLNORM_STATS_ONLY)) {
+    colnorm_steal_run(steal_normalize_chunk, &ctx, chunks, thread_count);
+  }
+
+  free(ctx.partials);
+  free(ctx.counts);
+  free(ctx.inv_std);
+  free(ctx.scratch);
+  return 0;
+}
+
+// Statistics are computed from src and the normalized matrix is
+// written to dst which may be the same matrix to normalize in place.
+// Both must hold the same element type except that 16-bit sources
+// may be written to a double destination.
+int cn_verA(const cn_view_t *src_ptr, const cn_view_t *dst_ptr, vector_t *avg_ptr, vector_t *std_ptr,
+            int thread_count, int flags) {
+  // teams run on the work-stealing scheduler when it has been chosen
+  long chunk_rows;
+  if (thread_count > 1 && colnorm_sched_get(&chunk_rows) == COLNORM_SCHED_STEAL) {
+    return cn_steal(src_ptr, dst_ptr, avg_ptr, std_ptr, thread_count, flags, chunk_rows);
+  }
+
+  // locally defined struct that contains the context shared by all
+  // threads of the team: source and destination matrix structs, shared
+  // avg and std, the per-thread partial sums, and a barrier separating
+  // the phases. Each thread learns its id from the team runner.
   typedef struct {
-    int thread_id;
-    int thread_count;
-    matrix_t mat;
+    cn_view_t mat;
+    cn_view_t out;
+    int stream;                 // write out with non-temporal stores
     vector_t *avg;
     vector_t *std;
-    pthread_mutex_t *lock;  
+    colnorm_plan_t plan;        // how rows and columns are divided among threads
+    double *partials;           // thread t owns sum at 2*t*stride, sumsq at (2*t+1)*stride
+    long stride;                // cols rounded up to a whole cache line
+    long *counts;               // rows summed by each thread
+    int flags;                  // COLNORM_STABLE selects mean/M2 partials
+    long tile_rows;             // rows in a cache-sized tile
+    long tile_cols;             // columns in a tile; accumulators for them stay in L1
+    pthread_barrier_t *barrier;
+    double *inv_std;
+    double *scratch;            // tile_cols doubles per thread for widening 16-bit rows
+    long scratch_stride;        // tile_cols rounded up to a whole cache line
+    const colnorm_kernels_t *kern;
   } norm_ctx_t;
 
   // worker function that is locally defined
-  void *norm_worker(void *arg) {
+  void norm_worker(int thread_id, int thread_count, void *arg) {
     
     // extract the parameters / "context" via a caste
     // convert back from pointer into the struct
     norm_ctx_t *ctx = (norm_ctx_t *)arg;
     
     // initialize the matrix, cols, and row vars
-    matrix_t mat = ctx->mat;
+    cn_view_t mat = ctx->mat;
     long cols = mat.cols;
     long rows = mat.rows;
+    int row_parts = ctx->plan.row_parts;
+    int col_parts = ctx->plan.col_parts;
+    int band = thread_id / col_parts;
+    int group = thread_id % col_parts;
 
-    // calculate how much work this thread should do and where its
-    // begin/end rows are located. Leftover rows are handled by the last
-    // thread.
-    long rows_per_thread = rows / ctx->thread_count;
-    long start_row = ctx->thread_id * rows_per_thread;
-    long end_row = (ctx->thread_id == ctx->thread_count - 1) ? rows : start_row + rows_per_thread;
+    // calculate which rows and columns this thread covers; leftovers
+    // are spread one each over the first threads rather than all
+    // being handed to the last thread
+    long start_row, end_row, group_beg, group_end;
+    colnorm_plan_block(ctx->plan, rows, cols, thread_id,
+                       &start_row, &end_row, &group_beg, &group_end);
 
-    // allocate memory for the thread to locally compute its results
-    // avoiding the need to lock a mutex every time a computation is done
-    // local_sum and then local_sumsq for the sum of the squares
-    double *local_sum = malloc(cols * sizeof(double));
-    double *local_sumsq = malloc(cols * sizeof(double));
+    // each thread accumulates into its own cache-line-aligned slice
+    // of the partials so no lock is needed and no two threads write
+    // to the same cache line; local_sum and then local_sumsq for the
+    // sum of the squares. In stable mode these hold the running mean
+    // and sum of squared deviations (M2) instead.
+    double *local_sum = ctx->partials + (2*thread_id)*ctx->stride;
+    double *local_sumsq = ctx->partials + (2*thread_id+1)*ctx->stride;
+    double *scratch = ctx->scratch + thread_id*ctx->scratch_stride;
 
     // initialize the arrays to 0
-    for(int i = 0; i < cols; i++){
-      local_sum[i] = 0;
-      local_sumsq[i] = 0;
+    for(long j = group_beg; j < group_end; j++){
+      local_sum[j] = 0;
+      local_sumsq[j] = 0;
     }
 
     // iterate over the matrix using row-wise traversal since C is
-    // a row-major language to optimize cache usage
-    for (long i = start_row; i < end_row; i++) {
-      for (long j = 0; j < cols; j++) {
-        double val = MGET(mat, i, j);
-        local_sum[j] += val;
-        local_sumsq[j] += val * val;
+    // a row-major language to optimize cache usage. Wide matrices are
+    // swept one tile at a time so the accumulators for a block of
+    // columns stay in cache for all rows of the tile; the vectorized
+    // kernel handles a row segment at a time. Nothing is summed when
+    // the caller supplies the statistics.
+    long sum_end = (ctx->flags & COLNORM_APPLY_ONLY) ? start_row : end_row;
+    for (long r0 = start_row; r0 < sum_end; r0 += ctx->tile_rows) {
+      long r1 = (r0 + ctx->tile_rows < sum_end) ? r0 + ctx->tile_rows : sum_end;
+      for (long c0 = group_beg; c0 < group_end; c0 += ctx->tile_cols) {
+        long nc = (c0 + ctx->tile_cols < group_end) ? ctx->tile_cols : group_end - c0;
+        if (ctx->flags & COLNORM_STABLE) {
+          for (long i = r0; i < r1; i++) {
+            double inv_count = 1.0 / (i - start_row + 1);
+            seg_welford(ctx->kern, mat.dtype, VIEW_AT(mat, i, c0),
+                        local_sum + c0, local_sumsq + c0, inv_count, nc, scratch);
+          }
+        }
+        else {
+          for (long i = r0; i < r1; i++) {
+            seg_accum(ctx->kern, mat.dtype, VIEW_AT(mat, i, c0), local_sum + c0, local_sumsq + c0,
+                      nc, scratch);
+          }
+        }
       }
     }
+    ctx->counts[thread_id] = end_row - start_row;
 
-    // lock the mutex to get controlled access to the shared
-    // results in order to prevent potential corruption
-    pthread_mutex_lock(ctx->lock);
+    // wait until every thread has its partial sums before reducing;
+    // with column partitioning each thread already has whole columns
+    if (row_parts > 1) {
+      pthread_barrier_wait(ctx->barrier);
+    }
 
-    // begin computations
-    for (long j = 0; j < cols; j++) {
-      double prev_sum = VGET(*ctx->avg, j);
-      double prev_sumsq = VGET(*ctx->std, j);  
-      VSET(*ctx->avg, j, prev_sum + local_sum[j]);
-      VSET(*ctx->std, j, prev_sumsq + local_sumsq[j]);
+    // reduce and finalize; the columns of a group are divided among
+    // the threads sharing that group, each of which adds up the
+    // partials of every band for its columns and converts sum/sumsq
+    // to mean/stddev. Ranges are whole cache lines so threads don't
+    // write into the same line of avg/std.
+    long start_col, end_col;
+    split_lines(group_beg, group_end, row_parts, band, &start_col, &end_col);
+    for (long j = start_col; j < end_col; j++) {
+      double mean, variance;
+      if (ctx->flags & COLNORM_APPLY_ONLY) {
+        ctx->inv_std[j] = 1.0 / VGET(*ctx->std, j);
+        continue;
+      }
+      if (ctx->flags & COLNORM_STABLE) {
+        // merge the per-thread mean/M2 pairs with Chan's pairwise
+        // formula which avoids the cancellation in sumsq/n - mean^2
+        double n_a = 0.0, mean_a = 0.0, m2_a = 0.0;
+        for (int b = 0; b < row_parts; b++) {
+          int t = b * col_parts + group;
+          double n_b = ctx->counts[t];
+          if (n_b == 0) {
+            continue;
+          }
+          double mean_b = ctx->partials[(2*t)*ctx->stride + j];
+          double m2_b = ctx->partials[(2*t+1)*ctx->stride + j];
+          double n_ab = n_a + n_b;
+          double delta = mean_b - mean_a;
+          mean_a += delta * (n_b / n_ab);
+          m2_a += m2_b + delta * delta * (n_a * n_b / n_ab);
+          n_a = n_ab;
+        }
+        mean = mean_a;
+        variance = m2_a / rows;
+      }
+      else {
+        double sum = 0.0;
+        double sumsq = 0.0;
+        for (int b = 0; b < row_parts; b++) {
+          int t = b * col_parts + group;
+          sum += ctx->partials[(2*t)*ctx->stride + j];
+          sumsq += ctx->partials[(2*t+1)*ctx->stride + j];
+        }
+        mean = sum / rows;
+        variance = (sumsq / rows) - (mean * mean);
+      }
+      double stddev = sqrt(variance);
+      VSET(*ctx->avg, j, mean);
+      VSET(*ctx->std, j, stddev);
+      ctx->inv_std[j] = 1.0 / stddev;
     }
-    
-    // unlock the mutex before exiting the worker
-    pthread_mutex_unlock(ctx->lock);
-
-    // free the allocated memory for the shared results
-    // before exiting the worker and return NULL
-    free(local_sum);
-    free(local_sumsq);
-    return NULL;
-  }
-
-  // initialize both the avg and std vectors using macro VSET
-  for (long i = 0; i < mat_ptr->cols; i++) {
-    VSET(*avg_ptr, i, 0.0);
-    VSET(*std_ptr, i, 0.0);
-  }
-
-  // define the lock and initialize it with NULL values
-  pthread_mutex_t vec_lock;
-  pthread_mutex_init(&vec_lock, NULL);
-
-  // track each thread and create a context struct for each thread
-  // which will hold information dependent upon the thread and the 
-  // work that it is assigned via the worker function
-  pthread_t threads[thread_count];
-  norm_ctx_t ctxs[thread_count];
-
-  // loop to create threads
-  // initialize the contexts and ensure that each thread has
-  // a unique id
-  for (int i = 0; i < thread_count; i++) {
-    ctxs[i].thread_id = i;
-    ctxs[i].thread_count = thread_count;
-    ctxs[i].mat = *mat_ptr;
-    ctxs[i].avg = avg_ptr;
-    ctxs[i].std = std_ptr;
-    ctxs[i].lock = &vec_lock;
-
-    pthread_create(&threads[i], NULL, norm_worker, &ctxs[i]);
-  }
-  
-  // loop to join the threads
-  for (int i = 0; i < thread_count; i++) {
-    pthread_join(threads[i], NULL);
-  }
-
-  // get rid of the lock to avoid a memory leak
-  pthread_mutex_destroy(&vec_lock);
-
-  // finalize computations
-  for (long j = 0; j < mat_ptr->cols; j++) {
-    double sum = VGET(*avg_ptr, j);
-    double sumsq = VGET(*std_ptr, j);
-    double mean = sum / mat_ptr->rows;
-    double variance = (sumsq / mat_ptr->rows) - (mean * mean);
-    double stddev = sqrt(variance);
-    VSET(*avg_ptr, j, mean);
-    VSET(*std_ptr, j, stddev);
-  }
 
-  // finaly normalize the matrix via row-wise traversal for efficiency 
-  for (long i = 0; i < mat_ptr->rows; i++) {
-    for (long j = 0; j < mat_ptr->cols; j++) {
-      double val = MGET(*mat_ptr, i, j);
-      double mean = VGET(*avg_ptr, j);
-      double stddev = VGET(*std_ptr, j);
-      MSET(*mat_ptr, i, j, (val - mean) / stddev);
+    if (ctx->flags & COLNORM_STATS_ONLY) {
+      return;
     }
+
+    // all columns must be finalized before any row is normalized
+    if (row_parts > 1) {
+      pthread_barrier_wait(ctx->barrier);
+    }
+
+    // finaly normalize this thread's rows via row-wise traversal;
+    // the same rows were just summed so they may still be in cache.
+    // A large separate destination is written with streaming stores
+    // so it doesn't have to be read into cache first.
+    cn_view_t out = ctx->out;
+    for (long r0 = start_row; r0 < end_row; r0 += ctx->tile_rows) {
+      long r1 = (r0 + ctx->tile_rows < end_row) ? r0 + ctx->tile_rows : end_row;
+      for (long c0 = group_beg; c0 < group_end; c0 += ctx->tile_cols) {
+        long nc = (c0 + ctx->tile_cols < group_end) ? ctx->tile_cols : group_end - c0;
+        for (long i = r0; i < r1; i++) {
+          seg_normalize(ctx->kern, mat.dtype, out.dtype, ctx->stream, VIEW_AT(mat, i, c0),
+                        VIEW_AT(out, i, c0), ctx->avg->data + c0, ctx->inv_std + c0, nc, scratch);
+        }
+      }
+    }
+    if (ctx->stream) {
+      _mm_sfence();             // make streamed stores visible before the join
+    }
+  }
+
+  // the barrier below needs a count of at least one thread
+  if (thread_count < 1) {
+    thread_count = 1;
   }
 
+  // the barrier must count every member of the team
+  pthread_barrier_t phase_barrier;
+  pthread_barrier_init(&phase_barrier, NULL, thread_count);
+
+  // space for every thread's partial sums, each row of the partials
+  // starting on its own cache line
+  long stride = (src_ptr->cols + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES * CN_LINE_DOUBLES;
+  double *partials = aligned_alloc(64, sizeof(double) * 2 * thread_count * stride);
+  if (partials == NULL) {
+    printf("colnorm_OPTM: couldn't allocate partial sums for %d threads\n", thread_count);
+    pthread_barrier_destroy(&phase_barrier);
+    return 1;
+  }
+  long counts[thread_count];
+
+  // a single context is shared by the whole team which runs on the
+  // persistent pool if one has been started with colnorm_pool_init()
+  // and on freshly created threads otherwise
+  long tile_rows, tile_cols;
+  colnorm_tile_size(src_ptr->cols, &tile_rows, &tile_cols);
+  int stream = (src_ptr->data != dst_ptr->data) &&
+    (dst_ptr->elem_bytes * dst_ptr->rows * dst_ptr->col_space > colnorm_cache_bytes(3));
+  long scratch_stride = 0;
+  double *scratch = NULL;
+  if (src_ptr->elem_bytes == sizeof(uint16_t)) {
+    scratch_stride = (tile_cols + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES * CN_LINE_DOUBLES;
+    scratch = aligned_alloc(64, sizeof(double) * thread_count * scratch_stride);
+  }
+  norm_ctx_t ctx = {
+    .mat = *src_ptr,
+    .out = *dst_ptr,
+    .stream = stream,
+    .avg = avg_ptr,
+    .std = std_ptr,
+    .plan = colnorm_plan(src_ptr->rows, src_ptr->cols, src_ptr->col_space, thread_count),
+    .partials = partials,
+    .stride = stride,
+    .counts = counts,
+    .flags = flags,
+    .tile_rows = tile_rows,
+    .tile_cols = tile_cols,
+    .barrier = &phase_barrier,
+    .inv_std = malloc(src_ptr->cols * sizeof(double)),
+    .scratch = scratch,
+    .scratch_stride = scratch_stride,
+    .kern = colnorm_kernels,
+  };
+  colnorm_team_run(norm_worker, &ctx, thread_count);
+
+  // get rid of the barrier, partials, and reciprocals to avoid a memory leak
+  pthread_barrier_destroy(&phase_barrier);
+  free(partials);
+  free(ctx.inv_std);
+  free(scratch);
+
   // now the matrix should be normalized via concurrency
   // so return 0
   return 0;
@@ -184,7 +668,107 @@ int cn_verB(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_
 
 int colnorm_OPTM(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count){
   // call version A of the function
-  return cn_verA(mat_ptr, avg_ptr, std_ptr, thread_count);
+  cn_view_t mat = view_f64(mat_ptr);
+  return cn_verA(&mat, &mat, avg_ptr, std_ptr, thread_count, COLNORM_DEFAULT);
+}
+
+// Same as colnorm_OPTM() but flags may be COLNORM_STABLE to compute
+// the statistics with a single Welford pass per thread merged with
+// Chan's formula. This is slightly slower than the default sums but
+// stays accurate for columns with large offsets where sumsq/n - mean^2
+// cancels catastrophically. The statistics and normalizing steps can
+// be run on their own with COLNORM_STATS_ONLY, which leaves the matrix
+// untouched, and COLNORM_APPLY_ONLY, which normalizes with the avg and
+// std passed in; these flags work with every colnorm_OPTM_*() call.
+int colnorm_OPTM_flags(matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count, int flags){
+  cn_view_t mat = view_f64(mat_ptr);
+  return cn_verA(&mat, &mat, avg_ptr, std_ptr, thread_count, flags);
+}
+
+// Out-of-place version of colnorm_OPTM_flags(): reads src for the
+// statistics and writes the normalized values straight into dst,
+// leaving src untouched. This saves the copy callers would otherwise
+// make before normalizing in place. dst must have the same rows and
+// cols as src though its padding may differ; when it is larger than
+// the last level cache it is written with non-temporal stores.
+int colnorm_OPTM_into(const matrix_t *src, matrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                      int thread_count, int flags){
+  if(src->rows != dst->rows || src->cols != dst->cols){
+    printf("colnorm_OPTM_into: bad sizes\n");
+    return 1;
+  }
+  cn_view_t src_view = view_f64(src);
+  cn_view_t dst_view = view_f64(dst);
+  return cn_verA(&src_view, &dst_view, avg_ptr, std_ptr, thread_count, flags);
+}
+
+// Compute only the column averages and standard deviations of mat
+// into avg_ptr and std_ptr, leaving mat untouched, for callers that
+// apply them later, e.g. through a colnorm_view_t. Saves the write
+// sweep of normalizing in place. flags may add COLNORM_STABLE.
+int colnorm_OPTM_stats(const matrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr,
+                       int thread_count, int flags){
+  cn_view_t mat = view_f64(mat_ptr);
+  return cn_verA(&mat, &mat, avg_ptr, std_ptr, thread_count,
+                 (flags & ~COLNORM_APPLY_ONLY) | COLNORM_STATS_ONLY);
+}
+
+// Single precision version of colnorm_OPTM_flags(). Rows are widened
+// to double as they are loaded so the sums, and so avg/std, are as
+// accurate as for a matrix_t, but only half the bytes are read and
+// written. Normalized values are rounded back to float.
+int colnorm_OPTM_f32(fmatrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count, int flags){
+  cn_view_t mat = view_f32(mat_ptr);
+  return cn_verA(&mat, &mat, avg_ptr, std_ptr, thread_count, flags);
+}
+
+// Single precision version of colnorm_OPTM_into()
+int colnorm_OPTM_f32_into(const fmatrix_t *src, fmatrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                          int thread_count, int flags){
+  if(src->rows != dst->rows || src->cols != dst->cols){
+    printf("colnorm_OPTM_f32_into: bad sizes\n");
+    return 1;
+  }
+  cn_view_t src_view = view_f32(src);
+  cn_view_t dst_view = view_f32(dst);
+  return cn_verA(&src_view, &dst_view, avg_ptr, std_ptr, thread_count, flags);
+}
+
+// Version of colnorm_OPTM_flags() for compact half precision or
+// bfloat16 matrices. Each row segment is widened to double in an L1
+// sized buffer for the sums and the normalize step, so a quarter of
+// the bytes of a matrix_t cross the memory bus. Normalized values are
+// rounded back to the matrix's 16-bit type.
+int colnorm_OPTM_half(hmatrix_t *mat_ptr, vector_t *avg_ptr, vector_t *std_ptr, int thread_count, int flags){
+  cn_view_t mat = view_half(mat_ptr);
+  return cn_verA(&mat, &mat, avg_ptr, std_ptr, thread_count, flags);
+}
+
+// Out-of-place version of colnorm_OPTM_half(); dst must have the same
+// 16-bit type as src.
+int colnorm_OPTM_half_into(const hmatrix_t *src, hmatrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                           int thread_count, int flags){
+  if(src->rows != dst->rows || src->cols != dst->cols || src->dtype != dst->dtype){
+    printf("colnorm_OPTM_half_into: bad sizes\n");
+    return 1;
+  }
+  cn_view_t src_view = view_half(src);
+  cn_view_t dst_view = view_half(dst);
+  return cn_verA(&src_view, &dst_view, avg_ptr, std_ptr, thread_count, flags);
+}
+
+// Normalize a compact matrix into a full precision matrix_t, e.g. to
+// feed archived 16-bit data to code expecting doubles. Large
+// destinations are written with non-temporal stores.
+int colnorm_OPTM_half_f64(const hmatrix_t *src, matrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                          int thread_count, int flags){
+  if(src->rows != dst->rows || src->cols != dst->cols){
+    printf("colnorm_OPTM_half_f64: bad sizes\n");
+    return 1;
+  }
+  cn_view_t src_view = view_half(src);
+  cn_view_t dst_view = view_f64(dst);
+  return cn_verA(&src_view, &dst_view, avg_ptr, std_ptr, thread_count, flags);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,410 @@
+// colnorm_pool.c: persistent worker pool used by the optimized column
+// normalization routines. Creating and joining threads on every call
+// to colnorm_OPTM() dominates the run time for small matrices so the
+// pool keeps workers parked on a condition variable between jobs.
+#include "colnorm.h"
+#include <sched.h>
+
+// State of the single global pool. Worker i serves team member i+1
+// as the calling thread always acts as member 0 of a team.
+typedef struct {
+  int nworkers;                 // number of parked worker threads
+  pthread_t *threads;           // handles for the workers
+  pthread_mutex_t lock;         // protects all fields below
+  pthread_cond_t wake;          // broadcast when a job is posted or on shutdown
+  pthread_cond_t done;          // signalled when the last worker of a job finishes
+  pthread_mutex_t run_lock;     // serializes callers of colnorm_team_run()
+  long generation;              // incremented each time a job is posted
+  int shutdown;                 // set to make workers exit
+  int pinned;                   // workers are pinned to cpus
+  colnorm_task_t task;          // current job function
+  void *arg;                    // current job argument
+  int team_size;                // number of members in the current job
+  int pending;                  // workers of the current job still running
+} cn_pool_t;
+
+static cn_pool_t pool;
+static int pool_active = 0;
+
+// Main loop for a pool worker. Sleeps until the generation changes,
+// runs its share of the job if the team is large enough to include
+// it, and reports completion.
+static void *pool_worker(void *arg){
+  int member = (int) (long) arg;
+  long seen = 0;
+  if(pool.pinned){
+    colnorm_topo_pin(member, pool.nworkers+1);
+  }
+  pthread_mutex_lock(&pool.lock);
+  while(1){
+    while(!pool.shutdown && pool.generation == seen){
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    if(pool.shutdown){
+      break;
+    }
+    seen = pool.generation;
+    if(member < pool.team_size){
+      colnorm_task_t task = pool.task;
+      void *task_arg = pool.arg;
+      int team_size = pool.team_size;
+      pthread_mutex_unlock(&pool.lock);
+      task(member, team_size, task_arg);
+      pthread_mutex_lock(&pool.lock);
+      pool.pending--;
+      if(pool.pending == 0){
+        pthread_cond_signal(&pool.done);
+      }
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+// Start a pool which can run teams of up to thread_count threads
+// (thread_count-1 workers plus the caller). An existing pool is shut
+// down first. Returns 0 on success and nonzero on error.
+int colnorm_pool_init(int thread_count){
+  return colnorm_pool_init_flags(thread_count, 0);
+}
+
+// Like colnorm_pool_init(). With COLNORM_POOL_PIN in flags each worker
+// is pinned to the cpu colnorm_topo_slot() picks for it, spreading the
+// team over the NUMA nodes, and the calling thread, which acts as
+// member 0, is pinned as well.
+int colnorm_pool_init_flags(int thread_count, int flags){
+  if(thread_count < 1){
+    printf("colnorm_pool_init: invalid thread_count %d\n",thread_count);
+    return 1;
+  }
+  if(pool_active){
+    colnorm_pool_shutdown();
+  }
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_mutex_init(&pool.run_lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pool.nworkers = thread_count-1;
+  pool.pinned = (flags & COLNORM_POOL_PIN) != 0;
+  if(pool.pinned && colnorm_topo_pin(0, thread_count) != 0){
+    printf("colnorm_pool_init: couldn't pin calling thread\n");
+  }
+  pool.threads = malloc(sizeof(pthread_t) * (pool.nworkers+1));
+  for(int i=0; i<pool.nworkers; i++){
+    if(pthread_create(&pool.threads[i], NULL, pool_worker, (void *) (long) (i+1)) != 0){
+      perror("colnorm_pool_init: couldn't create worker");
+      pool.nworkers = i;          // shut down the ones that did start
+      pool_active = 1;
+      colnorm_pool_shutdown();
+      return 1;
+    }
+  }
+  pool_active = 1;
+  return 0;
+}
+
+// Wake all workers, tell them to exit, and join them. A calling
+// thread pinned by colnorm_pool_init_flags() is unpinned. Safe to
+// call when no pool is active.
+void colnorm_pool_shutdown(){
+  if(!pool_active){
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+  for(int i=0; i<pool.nworkers; i++){
+    pthread_join(pool.threads[i], NULL);
+  }
+  free(pool.threads);
+  pthread_cond_destroy(&pool.wake);
+  pthread_cond_destroy(&pool.done);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_mutex_destroy(&pool.run_lock);
+  if(pool.pinned){
+    colnorm_topo_unpin();
+  }
+  pool_active = 0;
+}
+
+// Returns nonzero if the active pool pins its threads
+int colnorm_pool_pinned(){
+  return pool_active && pool.pinned;
+}
+
+// Returns the largest team the pool can run or 0 if no pool is
+// active.
+int colnorm_pool_size(){
+  return pool_active ? pool.nworkers+1 : 0;
+}
+
+// context for a thread created on demand when no pool is available
+typedef struct {
+  colnorm_task_t task;
+  void *arg;
+  int member;
+  int team_size;
+} cn_spawn_ctx_t;
+
+static void *spawn_worker(void *arg){
+  cn_spawn_ctx_t *ctx = (cn_spawn_ctx_t *) arg;
+  ctx->task(ctx->member, ctx->team_size, ctx->arg);
+  return NULL;
+}
+
+// Run task(i, thread_count, arg) for i in 0..thread_count-1 on
+// separate threads and return once all have finished. The calling
+// thread runs member 0. Uses the pool when one is active and large
+// enough, otherwise threads are created and joined for this call.
+int colnorm_team_run(colnorm_task_t task, void *arg, int thread_count){
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+  if(thread_count == 1){        // nothing to hand off
+    task(0, 1, arg);
+    return 0;
+  }
+
+  if(pool_active && thread_count <= pool.nworkers+1){
+    pthread_mutex_lock(&pool.run_lock);
+    pthread_mutex_lock(&pool.lock);
+    pool.task = task;
+    pool.arg = arg;
+    pool.team_size = thread_count;
+    pool.pending = thread_count-1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    task(0, thread_count, arg);
+
+    pthread_mutex_lock(&pool.lock);
+    while(pool.pending > 0){
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.run_lock);
+    return 0;
+  }
+
+  pthread_t threads[thread_count];
+  cn_spawn_ctx_t ctxs[thread_count];
+  for(int i=1; i<thread_count; i++){
+    ctxs[i].task = task;
+    ctxs[i].arg = arg;
+    ctxs[i].member = i;
+    ctxs[i].team_size = thread_count;
+    if(pthread_create(&threads[i], NULL, spawn_worker, &ctxs[i]) != 0){
+      perror("colnorm_team_run: couldn't create thread");
+      exit(1);
+    }
+  }
+  task(0, thread_count, arg);
+  for(int i=1; i<thread_count; i++){
+    pthread_join(threads[i], NULL);
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Work-stealing runs. A job is split into numbered chunks and each
+// member of the team starts with a deque holding a contiguous block of
+// them. Members take chunks from the bottom of their own deque and,
+// once it is empty, steal from the top of another's, so a member
+// slowed down by a busy SMT sibling or a noisy neighbour hands its
+// remaining work to the others instead of holding up the join.
+//
+// The deques are Chase-Lev deques: the owner moves bottom and only
+// contends with thieves, who advance top with a compare-and-swap, for
+// the last chunk. Every chunk is known before the run starts so a
+// deque's slots are implicit: slot s of the deque for chunks
+// [beg,end) holds chunk end-1-s, which makes the owner work through
+// its block in ascending order while thieves take the far end.
+
+#define STEAL_ROUNDS_BEFORE_YIELD 4     // failed sweeps over all victims before sched_yield()
+
+typedef struct {
+  long top;                     // next slot thieves take; only ever increases
+  char pad0[64 - sizeof(long)];
+  long bottom;                  // one past the owner's next slot
+  char pad1[64 - sizeof(long)];
+  long beg, end;                // chunks [beg,end) were dealt to this deque
+} __attribute__((aligned(64))) cn_deque_t;
+
+// Counters of every colnorm_steal_run() since the last reset, entry t
+// summing member t of every team. Runs may overlap, as when the async
+// dispatcher and a caller on spawned threads both steal, so members
+// add their counts under steal_stats_lock at the end of a run.
+static colnorm_steal_stats_t steal_stats[CN_MAX_CPUS];
+static int steal_stats_members = 0;     // largest team seen
+static pthread_mutex_t steal_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sched_mode = COLNORM_SCHED_STATIC;
+static long sched_chunk_rows = 0;       // 0 picks rows from the tile size
+
+// State of one work-stealing run
+typedef struct {
+  colnorm_chunk_t fn;
+  void *arg;
+  cn_deque_t *deques;
+} cn_steal_ctx_t;
+
+#define STEAL_EMPTY -1          // deque_steal() found the deque empty
+#define STEAL_LOST  -2          // deque_steal() lost a race for a chunk
+
+static double steal_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+// Owner takes the chunk in its bottom slot; returns -1 if the deque is empty
+static long deque_pop(cn_deque_t *dq){
+  long b = dq->bottom - 1;
+  __atomic_store_n(&dq->bottom, b, __ATOMIC_SEQ_CST);
+  long t = __atomic_load_n(&dq->top, __ATOMIC_SEQ_CST);
+  if(t > b){                    // already empty
+    __atomic_store_n(&dq->bottom, b+1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  if(t == b){                   // last chunk: race any thief for it
+    int won = __atomic_compare_exchange_n(&dq->top, &t, t+1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b+1, __ATOMIC_RELAXED);
+    if(!won){
+      return -1;
+    }
+  }
+  return dq->end - 1 - b;
+}
+
+// Thief takes the chunk in the top slot; returns STEAL_EMPTY if the
+// deque is empty or STEAL_LOST if another thread got there first
+static long deque_steal(cn_deque_t *dq){
+  long t = __atomic_load_n(&dq->top, __ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&dq->bottom, __ATOMIC_SEQ_CST);
+  if(t >= b){
+    return STEAL_EMPTY;
+  }
+  if(!__atomic_compare_exchange_n(&dq->top, &t, t+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+    return STEAL_LOST;
+  }
+  return dq->end - 1 - t;
+}
+
+static void steal_worker(int thread_id, int thread_count, void *arg){
+  cn_steal_ctx_t *ctx = (cn_steal_ctx_t *) arg;
+  colnorm_steal_stats_t local = {0, 0, 0, 0.0};
+  cn_deque_t *mine = &ctx->deques[thread_id];
+  unsigned seed = thread_id * 2654435761u + 1;
+  while(1){
+    long chunk = deque_pop(mine);
+    if(chunk < 0){              // out of work: sweep the others from a random start
+      double idle_start = steal_now();
+      int fails = 0, contended = 1;
+      // every chunk was dealt before the run and none is ever pushed,
+      // so once a sweep finds every deque empty there is nothing left
+      // to steal and the member leaves rather than spin beside the
+      // members finishing their last chunks
+      while(chunk < 0 && contended){
+        contended = 0;
+        seed = seed * 1103515245u + 12345u;
+        int first = (seed >> 16) % thread_count;
+        for(int v=0; v<thread_count && chunk < 0; v++){
+          int victim = (first + v) % thread_count;
+          if(victim == thread_id){
+            continue;
+          }
+          chunk = deque_steal(&ctx->deques[victim]);
+          local.failed += chunk < 0;
+          contended = contended || chunk == STEAL_LOST;
+        }
+        if(chunk < 0 && contended && ++fails % STEAL_ROUNDS_BEFORE_YIELD == 0){
+          sched_yield();        // let a preempted owner finish its chunk
+        }
+      }
+      local.idle += steal_now() - idle_start;
+      if(chunk < 0){
+        break;
+      }
+      local.stolen++;
+    }
+    ctx->fn(thread_id, chunk, ctx->arg);
+    local.chunks++;
+  }
+  pthread_mutex_lock(&steal_stats_lock);
+  steal_stats[thread_id].chunks += local.chunks;
+  steal_stats[thread_id].stolen += local.stolen;
+  steal_stats[thread_id].failed += local.failed;
+  steal_stats[thread_id].idle += local.idle;
+  pthread_mutex_unlock(&steal_stats_lock);
+}
+
+// Run fn(thread_id, chunk, arg) once for each chunk in 0..nchunks-1 on
+// a team of thread_count threads balanced by work stealing, returning
+// when all have run. Each member starts with the block of chunks
+// colnorm_split() gives it, so without stealing this is the same
+// division of work as a static split. Chunks may run in any order and
+// on any member, but each member runs its own in ascending order.
+int colnorm_steal_run(colnorm_chunk_t fn, void *arg, long nchunks, int thread_count){
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+  if(thread_count > CN_MAX_CPUS){
+    thread_count = CN_MAX_CPUS;
+  }
+  if(nchunks <= 0){
+    return 0;
+  }
+  cn_deque_t deques[thread_count];
+  for(int t=0; t<thread_count; t++){
+    colnorm_split(nchunks, thread_count, t, &deques[t].beg, &deques[t].end);
+    deques[t].top = 0;
+    deques[t].bottom = deques[t].end - deques[t].beg;
+  }
+  cn_steal_ctx_t ctx = { .fn = fn, .arg = arg, .deques = deques };
+  pthread_mutex_lock(&steal_stats_lock);
+  if(thread_count > steal_stats_members){
+    steal_stats_members = thread_count;
+  }
+  pthread_mutex_unlock(&steal_stats_lock);
+  return colnorm_team_run(steal_worker, &ctx, thread_count);
+}
+
+// Copy the per-member counters of work-stealing runs since the last
+// colnorm_steal_stats_reset() into stats[], which has room for max
+// entries. Returns the number of entries filled, the largest team
+// that has run.
+int colnorm_steal_stats(colnorm_steal_stats_t *stats, int max){
+  pthread_mutex_lock(&steal_stats_lock);
+  int n = steal_stats_members < max ? steal_stats_members : max;
+  memcpy(stats, steal_stats, sizeof(colnorm_steal_stats_t) * n);
+  pthread_mutex_unlock(&steal_stats_lock);
+  return n;
+}
+
+void colnorm_steal_stats_reset(){
+  pthread_mutex_lock(&steal_stats_lock);
+  memset(steal_stats, 0, sizeof(steal_stats));
+  steal_stats_members = 0;
+  pthread_mutex_unlock(&steal_stats_lock);
+}
+
+// Choose how colnorm_OPTM() spreads work over its threads:
+// COLNORM_SCHED_STATIC fixed blocks or COLNORM_SCHED_STEAL chunks
+// balanced by work stealing. chunk_rows sets the rows in a chunk of a
+// matrix; 0 sizes chunks automatically. colnorm_batch() always steals
+// and sizes its own chunks of matrices.
+void colnorm_sched_set(int mode, long chunk_rows){
+  sched_mode = mode;
+  sched_chunk_rows = chunk_rows > 0 ? chunk_rows : 0;
+}
+
+// Returns the current COLNORM_SCHED_* mode and sets *chunk_rows to the
+// chunk size given to colnorm_sched_set()
+int colnorm_sched_get(long *chunk_rows){
+  *chunk_rows = sched_chunk_rows;
+  return sched_mode;
+}
@@ -0,0 +1,935 @@
+// colnorm_simd.c: explicitly vectorized row kernels for column
+// normalization. Each kernel has an SSE2, AVX2+FMA, and AVX-512
+// variant compiled with per-function target attributes so the rest of
+// the project can keep building with the default flags. One set is
+// selected at startup based on what cpuid reports the CPU supports.
+#include "colnorm.h"
+#include <immintrin.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar conversions for half precision (IEEE binary16) and bfloat16
+// elements, used for tails and by CPUs without conversion instructions
+
+// Widen an IEEE half precision value to float; exact
+static float f16_to_float(uint16_t h){
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1F;
+  uint32_t man = h & 0x3FF;
+  uint32_t bits;
+  if(exp == 0x1F){                      // inf or nan
+    bits = sign | 0x7F800000 | (man << 13);
+  }
+  else if(exp != 0){                    // normal: rebias exponent from 15 to 127
+    bits = sign | ((exp + 112) << 23) | (man << 13);
+  }
+  else{                                 // zero or subnormal: man * 2^-24
+    float f = man * (1.0f / 16777216.0f);
+    return sign ? -f : f;
+  }
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Round a float to the nearest IEEE half precision value, ties to even
+static uint16_t float_to_f16(float f){
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t ax = x & 0x7FFFFFFF;
+  if(ax > 0x7F800000){                  // nan stays a quiet nan
+    return sign | 0x7E00;
+  }
+  if(ax >= 0x477FF000){                 // 65520 and up round to inf
+    return sign | 0x7C00;
+  }
+  if(ax < 0x38800000){                  // below 2^-14: subnormal in units of 2^-24
+    float a;
+    memcpy(&a, &ax, sizeof(a));
+    return sign | (uint16_t) nearbyintf(a * 16777216.0f);
+  }
+  // rebias the exponent by -112 and round off the low 13 mantissa bits;
+  // a carry out of the mantissa correctly bumps the exponent
+  ax += 0xC8000FFF + ((ax >> 13) & 1);
+  return sign | (ax >> 13);
+}
+
+// bfloat16 is the upper half of a float so widening is exact
+static float bf16_to_float(uint16_t h){
+  uint32_t bits = (uint32_t) h << 16;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Round a float to the nearest bfloat16, ties to even
+static uint16_t float_to_bf16(float f){
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  if((x & 0x7FFFFFFF) > 0x7F800000){    // nan stays a quiet nan
+    return (x >> 16) | 0x40;
+  }
+  x += 0x7FFF + ((x >> 16) & 1);
+  return x >> 16;
+}
+
+// Widen one COLNORM_F16 or COLNORM_BF16 element to double
+double colnorm_half_to_double(uint16_t h, int dtype){
+  return dtype == COLNORM_BF16 ? bf16_to_float(h) : f16_to_float(h);
+}
+
+// Round x to the nearest COLNORM_F16 or COLNORM_BF16 element
+uint16_t colnorm_double_to_half(double x, int dtype){
+  return dtype == COLNORM_BF16 ? float_to_bf16((float) x) : float_to_f16((float) x);
+}
+
+static void widen_f16_scalar(const uint16_t *src, double *dst, long n){
+  for(long j=0; j<n; j++){
+    dst[j] = f16_to_float(src[j]);
+  }
+}
+
+static void widen_bf16_scalar(const uint16_t *src, double *dst, long n){
+  for(long j=0; j<n; j++){
+    dst[j] = bf16_to_float(src[j]);
+  }
+}
+
+static void narrow_f16_scalar(const double *src, uint16_t *dst, long n){
+  for(long j=0; j<n; j++){
+    dst[j] = float_to_f16((float) src[j]);
+  }
+}
+
+static void narrow_bf16_scalar(const double *src, uint16_t *dst, long n){
+  for(long j=0; j<n; j++){
+    dst[j] = float_to_bf16((float) src[j]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar window updates, used for the tails of the vector kernels
+
+// Replace the oldest row y of a full sliding window of 1/inv_n rows
+// with x and normalize x against the updated window. The mean moves by
+// (x-y)/n and M2 by (x-y)*(x - new_mean + y - old_mean). A column with
+// no spread in the window normalizes to 0.
+static inline double window_step_one(double x, double *ring, double *mean, double *m2, double inv_n){
+  double y = *ring;
+  *ring = x;
+  double d = x - y;
+  double u = *mean + d * inv_n;
+  double m = *m2 + d * ((x - u) + (y - *mean));
+  if(m < 0.0){                          // cancellation can undershoot an all-equal window
+    m = 0.0;
+  }
+  *mean = u;
+  *m2 = m;
+  double s = sqrt(m * inv_n);
+  return s != 0.0 ? (x - u) / s : 0.0;
+}
+
+// Fold x into an exponentially weighted mean and variance with weight
+// alpha and normalize x against them, giving 0 while the variance is 0
+static inline double ewma_step_one(double x, double *mean, double *var, double alpha){
+  double d = x - *mean;
+  double u = *mean + alpha * d;
+  double v = (1.0 - alpha) * (*var + alpha * d * d);
+  *mean = u;
+  *var = v;
+  double s = sqrt(v);
+  return s != 0.0 ? (x - u) / s : 0.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE2: 2 doubles per register
+
+// Add each element of row[] to sum[] and its square to sumsq[]
+static void accum_sse2(const double *row, double *sum, double *sumsq, long n){
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = _mm_loadu_pd(row+j);
+    __m128d s = _mm_loadu_pd(sum+j);
+    __m128d q = _mm_loadu_pd(sumsq+j);
+    _mm_storeu_pd(sum+j,   _mm_add_pd(s, x));
+    _mm_storeu_pd(sumsq+j, _mm_add_pd(q, _mm_mul_pd(x,x)));
+  }
+  for(; j<n; j++){
+    sum[j]   += row[j];
+    sumsq[j] += row[j]*row[j];
+  }
+}
+
+// Set dst[j] to (src[j]-avg[j])*inv_std[j]; src and dst may be the
+// same row to normalize in place
+static void normalize_sse2(const double *src, double *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = _mm_loadu_pd(src+j);
+    __m128d a = _mm_loadu_pd(avg+j);
+    __m128d r = _mm_loadu_pd(inv_std+j);
+    _mm_storeu_pd(dst+j, _mm_mul_pd(_mm_sub_pd(x,a), r));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+// Same as normalize_sse2() but dst is written with non-temporal
+// stores which bypass the cache; src and dst must not overlap. Leading
+// elements are written normally until dst reaches a 16-byte boundary.
+static void normalize_nt_sse2(const double *src, double *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j<n && ((size_t) (dst+j) % 16) != 0; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+  for(; j+2 <= n; j+=2){
+    __m128d x = _mm_loadu_pd(src+j);
+    __m128d a = _mm_loadu_pd(avg+j);
+    __m128d r = _mm_loadu_pd(inv_std+j);
+    _mm_stream_pd(dst+j, _mm_mul_pd(_mm_sub_pd(x,a), r));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+// Welford update of a running mean[] and sum of squared deviations
+// m2[] with row[]; inv_count is 1/(rows seen including this one)
+static void welford_sse2(const double *row, double *mean, double *m2, double inv_count, long n){
+  __m128d r = _mm_set1_pd(inv_count);
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = _mm_loadu_pd(row+j);
+    __m128d u = _mm_loadu_pd(mean+j);
+    __m128d d = _mm_sub_pd(x, u);
+    u = _mm_add_pd(u, _mm_mul_pd(d, r));
+    _mm_storeu_pd(mean+j, u);
+    _mm_storeu_pd(m2+j, _mm_add_pd(_mm_loadu_pd(m2+j), _mm_mul_pd(d, _mm_sub_pd(x, u))));
+  }
+  for(; j<n; j++){
+    double d = row[j] - mean[j];
+    mean[j] += d * inv_count;
+    m2[j] += d * (row[j] - mean[j]);
+  }
+}
+
+// One row through a full sliding window: ring[] holds the oldest row
+// and is overwritten with in[]; mean[] and m2[] describe the window of
+// 1/inv_n rows and out[], which may be in[], gets in[] normalized
+// against the window after the swap
+static void window_step_sse2(const double *in, double *ring, double *mean, double *m2,
+                             double *out, double inv_n, long n){
+  __m128d r = _mm_set1_pd(inv_n);
+  __m128d z = _mm_setzero_pd();
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = _mm_loadu_pd(in+j);
+    __m128d y = _mm_loadu_pd(ring+j);
+    __m128d u = _mm_loadu_pd(mean+j);
+    _mm_storeu_pd(ring+j, x);
+    __m128d d = _mm_sub_pd(x, y);
+    __m128d v = _mm_add_pd(u, _mm_mul_pd(d, r));
+    __m128d m = _mm_add_pd(_mm_loadu_pd(m2+j),
+                           _mm_mul_pd(d, _mm_add_pd(_mm_sub_pd(x, v), _mm_sub_pd(y, u))));
+    m = _mm_max_pd(m, z);
+    _mm_storeu_pd(mean+j, v);
+    _mm_storeu_pd(m2+j, m);
+    __m128d s = _mm_sqrt_pd(_mm_mul_pd(m, r));
+    _mm_storeu_pd(out+j, _mm_and_pd(_mm_div_pd(_mm_sub_pd(x, v), s), _mm_cmpneq_pd(s, z)));
+  }
+  for(; j<n; j++){
+    out[j] = window_step_one(in[j], ring+j, mean+j, m2+j, inv_n);
+  }
+}
+
+// One row through an exponentially weighted window with weight alpha;
+// out[] may be in[]
+static void ewma_step_sse2(const double *in, double *mean, double *var, double *out, double alpha, long n){
+  __m128d a = _mm_set1_pd(alpha);
+  __m128d b = _mm_set1_pd(1.0 - alpha);
+  __m128d z = _mm_setzero_pd();
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = _mm_loadu_pd(in+j);
+    __m128d u = _mm_loadu_pd(mean+j);
+    __m128d d = _mm_sub_pd(x, u);
+    __m128d ad = _mm_mul_pd(a, d);
+    u = _mm_add_pd(u, ad);
+    __m128d v = _mm_mul_pd(b, _mm_add_pd(_mm_loadu_pd(var+j), _mm_mul_pd(ad, d)));
+    _mm_storeu_pd(mean+j, u);
+    _mm_storeu_pd(var+j, v);
+    __m128d s = _mm_sqrt_pd(v);
+    _mm_storeu_pd(out+j, _mm_and_pd(_mm_div_pd(_mm_sub_pd(x, u), s), _mm_cmpneq_pd(s, z)));
+  }
+  for(; j<n; j++){
+    out[j] = ewma_step_one(in[j], mean+j, var+j, alpha);
+  }
+}
+
+// Single precision rows: elements are widened to double so the
+// accumulators and the arithmetic keep double precision
+
+// load 2 floats from p widened to doubles
+#define LOAD2_F32(p) _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double *) (p))))
+
+static void accum_f32_sse2(const float *row, double *sum, double *sumsq, long n){
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = LOAD2_F32(row+j);
+    _mm_storeu_pd(sum+j,   _mm_add_pd(_mm_loadu_pd(sum+j), x));
+    _mm_storeu_pd(sumsq+j, _mm_add_pd(_mm_loadu_pd(sumsq+j), _mm_mul_pd(x,x)));
+  }
+  for(; j<n; j++){
+    double x = row[j];
+    sum[j]   += x;
+    sumsq[j] += x*x;
+  }
+}
+
+static void welford_f32_sse2(const float *row, double *mean, double *m2, double inv_count, long n){
+  __m128d r = _mm_set1_pd(inv_count);
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = LOAD2_F32(row+j);
+    __m128d u = _mm_loadu_pd(mean+j);
+    __m128d d = _mm_sub_pd(x, u);
+    u = _mm_add_pd(u, _mm_mul_pd(d, r));
+    _mm_storeu_pd(mean+j, u);
+    _mm_storeu_pd(m2+j, _mm_add_pd(_mm_loadu_pd(m2+j), _mm_mul_pd(d, _mm_sub_pd(x, u))));
+  }
+  for(; j<n; j++){
+    double x = row[j];
+    double d = x - mean[j];
+    mean[j] += d * inv_count;
+    m2[j] += d * (x - mean[j]);
+  }
+}
+
+static void normalize_f32_sse2(const float *src, float *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j+2 <= n; j+=2){
+    __m128d x = LOAD2_F32(src+j);
+    __m128d y = _mm_mul_pd(_mm_sub_pd(x, _mm_loadu_pd(avg+j)), _mm_loadu_pd(inv_std+j));
+    _mm_store_sd((double *) (dst+j), _mm_castps_pd(_mm_cvtpd_ps(y)));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+static void normalize_nt_f32_sse2(const float *src, float *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j<n && ((size_t) (dst+j) % 16) != 0; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+  for(; j+4 <= n; j+=4){
+    __m128d y0 = _mm_mul_pd(_mm_sub_pd(LOAD2_F32(src+j),   _mm_loadu_pd(avg+j)),   _mm_loadu_pd(inv_std+j));
+    __m128d y1 = _mm_mul_pd(_mm_sub_pd(LOAD2_F32(src+j+2), _mm_loadu_pd(avg+j+2)), _mm_loadu_pd(inv_std+j+2));
+    _mm_stream_ps(dst+j, _mm_movelh_ps(_mm_cvtpd_ps(y0), _mm_cvtpd_ps(y1)));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 + FMA: 4 doubles per register, two registers per iteration
+
+__attribute__((target("avx2,fma")))
+static void accum_avx2(const double *row, double *sum, double *sumsq, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m256d x0 = _mm256_loadu_pd(row+j);
+    __m256d x1 = _mm256_loadu_pd(row+j+4);
+    _mm256_storeu_pd(sum+j,     _mm256_add_pd(_mm256_loadu_pd(sum+j),   x0));
+    _mm256_storeu_pd(sum+j+4,   _mm256_add_pd(_mm256_loadu_pd(sum+j+4), x1));
+    _mm256_storeu_pd(sumsq+j,   _mm256_fmadd_pd(x0, x0, _mm256_loadu_pd(sumsq+j)));
+    _mm256_storeu_pd(sumsq+j+4, _mm256_fmadd_pd(x1, x1, _mm256_loadu_pd(sumsq+j+4)));
+  }
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_loadu_pd(row+j);
+    _mm256_storeu_pd(sum+j,   _mm256_add_pd(_mm256_loadu_pd(sum+j), x));
+    _mm256_storeu_pd(sumsq+j, _mm256_fmadd_pd(x, x, _mm256_loadu_pd(sumsq+j)));
+  }
+  for(; j<n; j++){
+    sum[j]   += row[j];
+    sumsq[j] += row[j]*row[j];
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void normalize_avx2(const double *src, double *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_loadu_pd(src+j);
+    __m256d a = _mm256_loadu_pd(avg+j);
+    __m256d r = _mm256_loadu_pd(inv_std+j);
+    _mm256_storeu_pd(dst+j, _mm256_mul_pd(_mm256_sub_pd(x,a), r));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void normalize_nt_avx2(const double *src, double *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j<n && ((size_t) (dst+j) % 32) != 0; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_loadu_pd(src+j);
+    __m256d a = _mm256_loadu_pd(avg+j);
+    __m256d r = _mm256_loadu_pd(inv_std+j);
+    _mm256_stream_pd(dst+j, _mm256_mul_pd(_mm256_sub_pd(x,a), r));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void welford_avx2(const double *row, double *mean, double *m2, double inv_count, long n){
+  __m256d r = _mm256_set1_pd(inv_count);
+  long j = 0;
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_loadu_pd(row+j);
+    __m256d u = _mm256_loadu_pd(mean+j);
+    __m256d d = _mm256_sub_pd(x, u);
+    u = _mm256_fmadd_pd(d, r, u);
+    _mm256_storeu_pd(mean+j, u);
+    _mm256_storeu_pd(m2+j, _mm256_fmadd_pd(d, _mm256_sub_pd(x, u), _mm256_loadu_pd(m2+j)));
+  }
+  for(; j<n; j++){
+    double d = row[j] - mean[j];
+    mean[j] += d * inv_count;
+    m2[j] += d * (row[j] - mean[j]);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void window_step_avx2(const double *in, double *ring, double *mean, double *m2,
+                             double *out, double inv_n, long n){
+  __m256d r = _mm256_set1_pd(inv_n);
+  __m256d z = _mm256_setzero_pd();
+  long j = 0;
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_loadu_pd(in+j);
+    __m256d y = _mm256_loadu_pd(ring+j);
+    __m256d u = _mm256_loadu_pd(mean+j);
+    _mm256_storeu_pd(ring+j, x);
+    __m256d d = _mm256_sub_pd(x, y);
+    __m256d v = _mm256_fmadd_pd(d, r, u);
+    __m256d m = _mm256_fmadd_pd(d, _mm256_add_pd(_mm256_sub_pd(x, v), _mm256_sub_pd(y, u)),
+                                _mm256_loadu_pd(m2+j));
+    m = _mm256_max_pd(m, z);
+    _mm256_storeu_pd(mean+j, v);
+    _mm256_storeu_pd(m2+j, m);
+    __m256d s = _mm256_sqrt_pd(_mm256_mul_pd(m, r));
+    _mm256_storeu_pd(out+j, _mm256_and_pd(_mm256_div_pd(_mm256_sub_pd(x, v), s),
+                                          _mm256_cmp_pd(s, z, _CMP_NEQ_UQ)));
+  }
+  for(; j<n; j++){
+    out[j] = window_step_one(in[j], ring+j, mean+j, m2+j, inv_n);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void ewma_step_avx2(const double *in, double *mean, double *var, double *out, double alpha, long n){
+  __m256d a = _mm256_set1_pd(alpha);
+  __m256d b = _mm256_set1_pd(1.0 - alpha);
+  __m256d z = _mm256_setzero_pd();
+  long j = 0;
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_loadu_pd(in+j);
+    __m256d u = _mm256_loadu_pd(mean+j);
+    __m256d d = _mm256_sub_pd(x, u);
+    __m256d ad = _mm256_mul_pd(a, d);
+    u = _mm256_add_pd(u, ad);
+    __m256d v = _mm256_mul_pd(b, _mm256_fmadd_pd(ad, d, _mm256_loadu_pd(var+j)));
+    _mm256_storeu_pd(mean+j, u);
+    _mm256_storeu_pd(var+j, v);
+    __m256d s = _mm256_sqrt_pd(v);
+    _mm256_storeu_pd(out+j, _mm256_and_pd(_mm256_div_pd(_mm256_sub_pd(x, u), s),
+                                          _mm256_cmp_pd(s, z, _CMP_NEQ_UQ)));
+  }
+  for(; j<n; j++){
+    out[j] = ewma_step_one(in[j], mean+j, var+j, alpha);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void accum_f32_avx2(const float *row, double *sum, double *sumsq, long n){
+  long j = 0;
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(row+j));
+    _mm256_storeu_pd(sum+j,   _mm256_add_pd(_mm256_loadu_pd(sum+j), x));
+    _mm256_storeu_pd(sumsq+j, _mm256_fmadd_pd(x, x, _mm256_loadu_pd(sumsq+j)));
+  }
+  for(; j<n; j++){
+    double x = row[j];
+    sum[j]   += x;
+    sumsq[j] += x*x;
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void welford_f32_avx2(const float *row, double *mean, double *m2, double inv_count, long n){
+  __m256d r = _mm256_set1_pd(inv_count);
+  long j = 0;
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(row+j));
+    __m256d u = _mm256_loadu_pd(mean+j);
+    __m256d d = _mm256_sub_pd(x, u);
+    u = _mm256_fmadd_pd(d, r, u);
+    _mm256_storeu_pd(mean+j, u);
+    _mm256_storeu_pd(m2+j, _mm256_fmadd_pd(d, _mm256_sub_pd(x, u), _mm256_loadu_pd(m2+j)));
+  }
+  for(; j<n; j++){
+    double x = row[j];
+    double d = x - mean[j];
+    mean[j] += d * inv_count;
+    m2[j] += d * (x - mean[j]);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void normalize_f32_avx2(const float *src, float *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j+4 <= n; j+=4){
+    __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(src+j));
+    __m256d y = _mm256_mul_pd(_mm256_sub_pd(x, _mm256_loadu_pd(avg+j)), _mm256_loadu_pd(inv_std+j));
+    _mm_storeu_ps(dst+j, _mm256_cvtpd_ps(y));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void normalize_nt_f32_avx2(const float *src, float *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j<n && ((size_t) (dst+j) % 32) != 0; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+  for(; j+8 <= n; j+=8){
+    __m256d x0 = _mm256_cvtps_pd(_mm_loadu_ps(src+j));
+    __m256d x1 = _mm256_cvtps_pd(_mm_loadu_ps(src+j+4));
+    __m256d y0 = _mm256_mul_pd(_mm256_sub_pd(x0, _mm256_loadu_pd(avg+j)),   _mm256_loadu_pd(inv_std+j));
+    __m256d y1 = _mm256_mul_pd(_mm256_sub_pd(x1, _mm256_loadu_pd(avg+j+4)), _mm256_loadu_pd(inv_std+j+4));
+    _mm256_stream_ps(dst+j, _mm256_set_m128(_mm256_cvtpd_ps(y1), _mm256_cvtpd_ps(y0)));
+  }
+  for(; j<n; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+}
+
+// Half precision conversions use F16C which every AVX2 CPU has;
+// bfloat16 is converted with integer shifts
+
+__attribute__((target("avx2,fma,f16c")))
+static void widen_f16_avx2(const uint16_t *src, double *dst, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m256 f = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (src+j)));
+    _mm256_storeu_pd(dst+j,   _mm256_cvtps_pd(_mm256_castps256_ps128(f)));
+    _mm256_storeu_pd(dst+j+4, _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)));
+  }
+  widen_f16_scalar(src+j, dst+j, n-j);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void widen_bf16_avx2(const uint16_t *src, double *dst, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m256i w = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (src+j))), 16);
+    __m256 f = _mm256_castsi256_ps(w);
+    _mm256_storeu_pd(dst+j,   _mm256_cvtps_pd(_mm256_castps256_ps128(f)));
+    _mm256_storeu_pd(dst+j+4, _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)));
+  }
+  widen_bf16_scalar(src+j, dst+j, n-j);
+}
+
+// load 8 doubles from p rounded to floats
+#define LOAD8_PD_AS_PS(p) _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd((p)+4)), \
+                                           _mm256_cvtpd_ps(_mm256_loadu_pd(p)))
+
+__attribute__((target("avx2,fma,f16c")))
+static void narrow_f16_avx2(const double *src, uint16_t *dst, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m256 f = LOAD8_PD_AS_PS(src+j);
+    _mm_storeu_si128((__m128i *) (dst+j), _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  }
+  narrow_f16_scalar(src+j, dst+j, n-j);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void narrow_bf16_avx2(const double *src, uint16_t *dst, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m256 f = LOAD8_PD_AS_PS(src+j);
+    __m256i x = _mm256_castps_si256(f);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(1));
+    __m256i r = _mm256_srli_epi32(_mm256_add_epi32(x, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF))), 16);
+    __m256i q = _mm256_or_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(0x40));
+    __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(f, f, _CMP_UNORD_Q));
+    r = _mm256_blendv_epi8(r, q, nan);
+    // pack within 128-bit lanes then gather the two low halves
+    r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0xD8);
+    _mm_storeu_si128((__m128i *) (dst+j), _mm256_castsi256_si128(r));
+  }
+  narrow_bf16_scalar(src+j, dst+j, n-j);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512: 8 doubles per register, masked loads/stores for the tail
+
+__attribute__((target("avx512f")))
+static void accum_avx512(const double *row, double *sum, double *sumsq, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m512d x = _mm512_loadu_pd(row+j);
+    _mm512_storeu_pd(sum+j,   _mm512_add_pd(_mm512_loadu_pd(sum+j), x));
+    _mm512_storeu_pd(sumsq+j, _mm512_fmadd_pd(x, x, _mm512_loadu_pd(sumsq+j)));
+  }
+  if(j < n){
+    __mmask8 m = (__mmask8) ((1u << (n-j)) - 1);
+    __m512d x = _mm512_maskz_loadu_pd(m, row+j);
+    _mm512_mask_storeu_pd(sum+j,   m, _mm512_add_pd(_mm512_maskz_loadu_pd(m, sum+j), x));
+    _mm512_mask_storeu_pd(sumsq+j, m, _mm512_fmadd_pd(x, x, _mm512_maskz_loadu_pd(m, sumsq+j)));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void normalize_avx512(const double *src, double *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m512d x = _mm512_loadu_pd(src+j);
+    __m512d a = _mm512_loadu_pd(avg+j);
+    __m512d r = _mm512_loadu_pd(inv_std+j);
+    _mm512_storeu_pd(dst+j, _mm512_mul_pd(_mm512_sub_pd(x,a), r));
+  }
+  if(j < n){
+    __mmask8 m = (__mmask8) ((1u << (n-j)) - 1);
+    __m512d x = _mm512_maskz_loadu_pd(m, src+j);
+    __m512d a = _mm512_maskz_loadu_pd(m, avg+j);
+    __m512d r = _mm512_maskz_loadu_pd(m, inv_std+j);
+    _mm512_mask_storeu_pd(dst+j, m, _mm512_mul_pd(_mm512_sub_pd(x,a), r));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void normalize_nt_avx512(const double *src, double *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j<n && ((size_t) (dst+j) % 64) != 0; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+  for(; j+8 <= n; j+=8){
+    __m512d x = _mm512_loadu_pd(src+j);
+    __m512d a = _mm512_loadu_pd(avg+j);
+    __m512d r = _mm512_loadu_pd(inv_std+j);
+    _mm512_stream_pd(dst+j, _mm512_mul_pd(_mm512_sub_pd(x,a), r));
+  }
+  if(j < n){
+    __mmask8 m = (__mmask8) ((1u << (n-j)) - 1);
+    __m512d x = _mm512_maskz_loadu_pd(m, src+j);
+    __m512d a = _mm512_maskz_loadu_pd(m, avg+j);
+    __m512d r = _mm512_maskz_loadu_pd(m, inv_std+j);
+    _mm512_mask_storeu_pd(dst+j, m, _mm512_mul_pd(_mm512_sub_pd(x,a), r));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void welford_avx512(const double *row, double *mean, double *m2, double inv_count, long n){
+  __m512d r = _mm512_set1_pd(inv_count);
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m512d x = _mm512_loadu_pd(row+j);
+    __m512d u = _mm512_loadu_pd(mean+j);
+    __m512d d = _mm512_sub_pd(x, u);
+    u = _mm512_fmadd_pd(d, r, u);
+    _mm512_storeu_pd(mean+j, u);
+    _mm512_storeu_pd(m2+j, _mm512_fmadd_pd(d, _mm512_sub_pd(x, u), _mm512_loadu_pd(m2+j)));
+  }
+  if(j < n){
+    __mmask8 m = (__mmask8) ((1u << (n-j)) - 1);
+    __m512d x = _mm512_maskz_loadu_pd(m, row+j);
+    __m512d u = _mm512_maskz_loadu_pd(m, mean+j);
+    __m512d d = _mm512_sub_pd(x, u);
+    u = _mm512_fmadd_pd(d, r, u);
+    _mm512_mask_storeu_pd(mean+j, m, u);
+    _mm512_mask_storeu_pd(m2+j, m, _mm512_fmadd_pd(d, _mm512_sub_pd(x, u), _mm512_maskz_loadu_pd(m, m2+j)));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void window_step_avx512(const double *in, double *ring, double *mean, double *m2,
+                               double *out, double inv_n, long n){
+  __m512d r = _mm512_set1_pd(inv_n);
+  __m512d z = _mm512_setzero_pd();
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m512d x = _mm512_loadu_pd(in+j);
+    __m512d y = _mm512_loadu_pd(ring+j);
+    __m512d u = _mm512_loadu_pd(mean+j);
+    _mm512_storeu_pd(ring+j, x);
+    __m512d d = _mm512_sub_pd(x, y);
+    __m512d v = _mm512_fmadd_pd(d, r, u);
+    __m512d m = _mm512_fmadd_pd(d, _mm512_add_pd(_mm512_sub_pd(x, v), _mm512_sub_pd(y, u)),
+                                _mm512_loadu_pd(m2+j));
+    m = _mm512_max_pd(m, z);
+    _mm512_storeu_pd(mean+j, v);
+    _mm512_storeu_pd(m2+j, m);
+    __m512d s = _mm512_sqrt_pd(_mm512_mul_pd(m, r));
+    _mm512_storeu_pd(out+j, _mm512_maskz_div_pd(_mm512_cmp_pd_mask(s, z, _CMP_NEQ_UQ),
+                                                _mm512_sub_pd(x, v), s));
+  }
+  for(; j<n; j++){
+    out[j] = window_step_one(in[j], ring+j, mean+j, m2+j, inv_n);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void ewma_step_avx512(const double *in, double *mean, double *var, double *out, double alpha, long n){
+  __m512d a = _mm512_set1_pd(alpha);
+  __m512d b = _mm512_set1_pd(1.0 - alpha);
+  __m512d z = _mm512_setzero_pd();
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m512d x = _mm512_loadu_pd(in+j);
+    __m512d u = _mm512_loadu_pd(mean+j);
+    __m512d d = _mm512_sub_pd(x, u);
+    __m512d ad = _mm512_mul_pd(a, d);
+    u = _mm512_add_pd(u, ad);
+    __m512d v = _mm512_mul_pd(b, _mm512_fmadd_pd(ad, d, _mm512_loadu_pd(var+j)));
+    _mm512_storeu_pd(mean+j, u);
+    _mm512_storeu_pd(var+j, v);
+    __m512d s = _mm512_sqrt_pd(v);
+    _mm512_storeu_pd(out+j, _mm512_maskz_div_pd(_mm512_cmp_pd_mask(s, z, _CMP_NEQ_UQ),
+                                                _mm512_sub_pd(x, u), s));
+  }
+  for(; j<n; j++){
+    out[j] = ewma_step_one(in[j], mean+j, var+j, alpha);
+  }
+}
+
+// load up to 8 floats from p widened to doubles; lanes outside m are 0
+#define LOAD8_F32(m,p) _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps((__mmask16) (m), (p))))
+
+__attribute__((target("avx512f")))
+static void accum_f32_avx512(const float *row, double *sum, double *sumsq, long n){
+  long j = 0;
+  for(; j+8 <= n; j+=8){
+    __m512d x = _mm512_cvtps_pd(_mm256_loadu_ps(row+j));
+    _mm512_storeu_pd(sum+j,   _mm512_add_pd(_mm512_loadu_pd(sum+j), x));
+    _mm512_storeu_pd(sumsq+j, _mm512_fmadd_pd(x, x, _mm512_loadu_pd(sumsq+j)));
+  }
+  if(j < n){
+    __mmask8 m = (__mmask8) ((1u << (n-j)) - 1);
+    __m512d x = LOAD8_F32(m, row+j);
+    _mm512_mask_storeu_pd(sum+j,   m, _mm512_add_pd(_mm512_maskz_loadu_pd(m, sum+j), x));
+    _mm512_mask_storeu_pd(sumsq+j, m, _mm512_fmadd_pd(x, x, _mm512_maskz_loadu_pd(m, sumsq+j)));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void welford_f32_avx512(const float *row, double *mean, double *m2, double inv_count, long n){
+  __m512d r = _mm512_set1_pd(inv_count);
+  long j = 0;
+  for(; j<n; j+=8){
+    __mmask8 m = (n-j >= 8) ? 0xFF : (__mmask8) ((1u << (n-j)) - 1);
+    __m512d x = LOAD8_F32(m, row+j);
+    __m512d u = _mm512_maskz_loadu_pd(m, mean+j);
+    __m512d d = _mm512_sub_pd(x, u);
+    u = _mm512_fmadd_pd(d, r, u);
+    _mm512_mask_storeu_pd(mean+j, m, u);
+    _mm512_mask_storeu_pd(m2+j, m, _mm512_fmadd_pd(d, _mm512_sub_pd(x, u), _mm512_maskz_loadu_pd(m, m2+j)));
+  }
+}
+
+// convert 8 doubles to floats and store the lanes in m to p
+#define STORE8_F32(m,p,y) _mm512_mask_storeu_ps((p), (__mmask16) (m), _mm512_castps256_ps512(_mm512_cvtpd_ps(y)))
+
+__attribute__((target("avx512f")))
+static void normalize_f32_avx512(const float *src, float *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j<n; j+=8){
+    __mmask8 m = (n-j >= 8) ? 0xFF : (__mmask8) ((1u << (n-j)) - 1);
+    __m512d x = LOAD8_F32(m, src+j);
+    __m512d y = _mm512_mul_pd(_mm512_sub_pd(x, _mm512_maskz_loadu_pd(m, avg+j)), _mm512_maskz_loadu_pd(m, inv_std+j));
+    STORE8_F32(m, dst+j, y);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void normalize_nt_f32_avx512(const float *src, float *dst, const double *avg, const double *inv_std, long n){
+  long j = 0;
+  for(; j<n && ((size_t) (dst+j) % 64) != 0; j++){
+    dst[j] = (src[j]-avg[j]) * inv_std[j];
+  }
+  for(; j+16 <= n; j+=16){
+    __m512d x0 = _mm512_cvtps_pd(_mm256_loadu_ps(src+j));
+    __m512d x1 = _mm512_cvtps_pd(_mm256_loadu_ps(src+j+8));
+    __m512d y0 = _mm512_mul_pd(_mm512_sub_pd(x0, _mm512_loadu_pd(avg+j)),   _mm512_loadu_pd(inv_std+j));
+    __m512d y1 = _mm512_mul_pd(_mm512_sub_pd(x1, _mm512_loadu_pd(avg+j+8)), _mm512_loadu_pd(inv_std+j+8));
+    __m512 y = _mm512_castps256_ps512(_mm512_cvtpd_ps(y0));
+    y = _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(y), _mm256_castps_pd(_mm512_cvtpd_ps(y1)), 1));
+    _mm512_stream_ps(dst+j, y);
+  }
+  if(j < n){
+    normalize_f32_avx512(src+j, dst+j, avg+j, inv_std+j, n-j);
+  }
+}
+
+// Half precision conversions; vcvtph2ps/vcvtps2ph on 512-bit
+// registers are part of AVX-512F
+
+__attribute__((target("avx512f")))
+static void widen_f16_avx512(const uint16_t *src, double *dst, long n){
+  long j = 0;
+  for(; j+16 <= n; j+=16){
+    __m512 f = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) (src+j)));
+    _mm512_storeu_pd(dst+j,   _mm512_cvtps_pd(_mm512_castps512_ps256(f)));
+    _mm512_storeu_pd(dst+j+8, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(f), 1))));
+  }
+  widen_f16_scalar(src+j, dst+j, n-j);
+}
+
+__attribute__((target("avx512f")))
+static void widen_bf16_avx512(const uint16_t *src, double *dst, long n){
+  long j = 0;
+  for(; j+16 <= n; j+=16){
+    __m512i w = _mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) (src+j))), 16);
+    __m512 f = _mm512_castsi512_ps(w);
+    _mm512_storeu_pd(dst+j,   _mm512_cvtps_pd(_mm512_castps512_ps256(f)));
+    _mm512_storeu_pd(dst+j+8, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(f), 1))));
+  }
+  widen_bf16_scalar(src+j, dst+j, n-j);
+}
+
+// load 16 doubles from p rounded to floats
+__attribute__((target("avx512f")))
+static inline __m512 load16_pd_as_ps(const double *p){
+  __m512 f = _mm512_castps256_ps512(_mm512_cvtpd_ps(_mm512_loadu_pd(p)));
+  __m256d hi = _mm256_castps_pd(_mm512_cvtpd_ps(_mm512_loadu_pd(p+8)));
+  return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(f), hi, 1));
+}
+
+__attribute__((target("avx512f")))
+static void narrow_f16_avx512(const double *src, uint16_t *dst, long n){
+  long j = 0;
+  for(; j+16 <= n; j+=16){
+    __m512 f = load16_pd_as_ps(src+j);
+    _mm256_storeu_si256((__m256i *) (dst+j), _mm512_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  }
+  narrow_f16_scalar(src+j, dst+j, n-j);
+}
+
+__attribute__((target("avx512f")))
+static void narrow_bf16_avx512(const double *src, uint16_t *dst, long n){
+  long j = 0;
+  for(; j+16 <= n; j+=16){
+    __m512 f = load16_pd_as_ps(src+j);
+    __m512i x = _mm512_castps_si512(f);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(x, 16), _mm512_set1_epi32(1));
+    __m512i r = _mm512_srli_epi32(_mm512_add_epi32(x, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7FFF))), 16);
+    __m512i q = _mm512_or_si512(_mm512_srli_epi32(x, 16), _mm512_set1_epi32(0x40));
+    r = _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(f, f, _CMP_UNORD_Q), r, q);
+    _mm256_storeu_si256((__m256i *) (dst+j), _mm512_cvtepi32_epi16(r));
+  }
+  narrow_bf16_scalar(src+j, dst+j, n-j);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Kernel tables and runtime selection
+
+static const colnorm_kernels_t kernels_sse2 = {
+  .name             = "sse2",
+  .accum            = accum_sse2,
+  .normalize        = normalize_sse2,
+  .normalize_nt     = normalize_nt_sse2,
+  .welford          = welford_sse2,
+  .accum_f32        = accum_f32_sse2,
+  .welford_f32      = welford_f32_sse2,
+  .normalize_f32    = normalize_f32_sse2,
+  .normalize_nt_f32 = normalize_nt_f32_sse2,
+  .widen_f16        = widen_f16_scalar,
+  .widen_bf16       = widen_bf16_scalar,
+  .narrow_f16       = narrow_f16_scalar,
+  .narrow_bf16      = narrow_bf16_scalar,
+  .window_step      = window_step_sse2,
+  .ewma_step        = ewma_step_sse2,
+};
+
+static const colnorm_kernels_t kernels_avx2 = {
+  .name             = "avx2",
+  .accum            = accum_avx2,
+  .normalize        = normalize_avx2,
+  .normalize_nt     = normalize_nt_avx2,
+  .welford          = welford_avx2,
+  .accum_f32        = accum_f32_avx2,
+  .welford_f32      = welford_f32_avx2,
+  .normalize_f32    = normalize_f32_avx2,
+  .normalize_nt_f32 = normalize_nt_f32_avx2,
+  .widen_f16        = widen_f16_avx2,
+  .widen_bf16       = widen_bf16_avx2,
+  .narrow_f16       = narrow_f16_avx2,
+  .narrow_bf16      = narrow_bf16_avx2,
+  .window_step      = window_step_avx2,
+  .ewma_step        = ewma_step_avx2,
+};
+
+static const colnorm_kernels_t kernels_avx512 = {
+  .name             = "avx512",
+  .accum            = accum_avx512,
+  .normalize        = normalize_avx512,
+  .normalize_nt     = normalize_nt_avx512,
+  .welford          = welford_avx512,
+  .accum_f32        = accum_f32_avx512,
+  .welford_f32      = welford_f32_avx512,
+  .normalize_f32    = normalize_f32_avx512,
+  .normalize_nt_f32 = normalize_nt_f32_avx512,
+  .widen_f16        = widen_f16_avx512,
+  .widen_bf16       = widen_bf16_avx512,
+  .narrow_f16       = narrow_f16_avx512,
+  .narrow_bf16      = narrow_bf16_avx512,
+  .window_step      = window_step_avx512,
+  .ewma_step        = ewma_step_avx512,
+};
+
+// Kernels used by colnorm_OPTM(); set before main() runs
+const colnorm_kernels_t *colnorm_kernels = &kernels_sse2;
+
+// Choose the widest kernel set the CPU supports. The environment
+// variable COLNORM_ISA may name a narrower set (sse2, avx2, avx512)
+// to force for testing; requests for unsupported sets are ignored.
+__attribute__((constructor))
+static void colnorm_kernels_init(){
+  __builtin_cpu_init();
+  int have_avx2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+    __builtin_cpu_supports("f16c");
+  int have_avx512 = __builtin_cpu_supports("avx512f");
+
+  colnorm_kernels = &kernels_sse2;
+  if(have_avx2){
+    colnorm_kernels = &kernels_avx2;
+  }
+  if(have_avx512){
+    colnorm_kernels = &kernels_avx512;
+  }
+
+  char *force = getenv("COLNORM_ISA");
+  if(force != NULL){
+    if(strcmp(force,"sse2") == 0){
+      colnorm_kernels = &kernels_sse2;
+    }
+    else if(strcmp(force,"avx2") == 0 && have_avx2){
+      colnorm_kernels = &kernels_avx2;
+    }
+    else if(strcmp(force,"avx512") == 0 && have_avx512){
+      colnorm_kernels = &kernels_avx512;
+    }
+  }
+}
@@ -0,0 +1,362 @@
+// colnorm_sparse.c: column normalization of sparse matrices stored in
+// compressed sparse row (CSR) or compressed sparse column (CSC) form.
+// Only the nonzeros are stored and visited; the implicit zeros of each
+// column enter the statistics through its count of nonzeros, so the
+// statistics cost O(nnz + cols) time and space rather than rows*cols.
+// Normalized values can either be written centered into a dense
+// matrix_t, as colnorm_OPTM() would produce, or be scaled by 1/std in
+// place without centering, which keeps zeros zero and so keeps the
+// matrix sparse.
+#include "colnorm.h"
+
+// Initialize mat as an empty rows x cols matrix in format COLNORM_CSR
+// or COLNORM_CSC with room for nnz nonzeros; ptr[] is zeroed. Free
+// with smatrix_free_data(). Returns 0 on success and nonzero on error.
+int smatrix_init(smatrix_t *mat, long rows, long cols, long nnz, int format){
+  if(rows <= 0 || cols <= 0 || nnz < 0 || (format != COLNORM_CSR && format != COLNORM_CSC)){
+    printf("smatrix_init: invalid %ld x %ld with %ld nonzeros, format %d\n",rows,cols,nnz,format);
+    return 1;
+  }
+  long outer = format == COLNORM_CSR ? rows : cols;
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->nnz = nnz;
+  mat->format = format;
+  mat->ptr = calloc(outer + 1, sizeof(long));
+  mat->idx = malloc(sizeof(long) * (nnz > 0 ? nnz : 1));
+  mat->val = malloc(sizeof(double) * (nnz > 0 ? nnz : 1));
+  if(mat->ptr == NULL || mat->idx == NULL || mat->val == NULL){
+    printf("smatrix_init: couldn't allocate %ld nonzeros\n",nnz);
+    smatrix_free_data(mat);
+    return 1;
+  }
+  return 0;
+}
+
+void smatrix_free_data(smatrix_t *mat){
+  free(mat->ptr);
+  free(mat->idx);
+  free(mat->val);
+  mat->ptr = mat->idx = NULL;
+  mat->val = NULL;
+}
+
+// Initialize sp in the given format with the nonzero elements of
+// dense. Returns 0 on success and nonzero on error.
+int smatrix_from_matrix(smatrix_t *sp, const matrix_t *dense, int format){
+  long nnz = 0;
+  for(long i=0; i<dense->rows; i++){
+    for(long j=0; j<dense->cols; j++){
+      nnz += MGET(*dense,i,j) != 0.0;
+    }
+  }
+  if(smatrix_init(sp, dense->rows, dense->cols, nnz, format)){
+    return 1;
+  }
+  long k = 0;
+  if(format == COLNORM_CSR){
+    for(long i=0; i<dense->rows; i++){
+      for(long j=0; j<dense->cols; j++){
+        if(MGET(*dense,i,j) != 0.0){
+          sp->idx[k] = j;
+          sp->val[k++] = MGET(*dense,i,j);
+        }
+      }
+      sp->ptr[i+1] = k;
+    }
+  }
+  else{
+    for(long j=0; j<dense->cols; j++){
+      for(long i=0; i<dense->rows; i++){
+        if(MGET(*dense,i,j) != 0.0){
+          sp->idx[k] = i;
+          sp->val[k++] = MGET(*dense,i,j);
+        }
+      }
+      sp->ptr[j+1] = k;
+    }
+  }
+  return 0;
+}
+
+// Split the n rows (CSR) or columns (CSC) whose nonzeros start at
+// ptr[] into parts pieces holding about the same number of nonzeros
+// and set [*beg,*end) to piece idx, so a thread's work follows nnz and
+// not how many rows or columns it has
+static void split_nnz(const long *ptr, long n, int parts, int idx, long *beg, long *end){
+  long *bound[2] = {beg, end};
+  for(int b=0; b<2; b++){
+    long target = ptr[n] / parts * (idx + b) + ptr[n] % parts * (idx + b) / parts;
+    long lo = 0, hi = n;          // first outer index whose nonzeros start at or past target
+    while(lo < hi){
+      long mid = (lo + hi) / 2;
+      if(ptr[mid] < target){
+        lo = mid + 1;
+      }
+      else{
+        hi = mid;
+      }
+    }
+    *bound[b] = (idx + b == parts) ? n : lo;
+  }
+}
+
+// Context shared by the threads computing statistics. Sums are
+// accumulated per thread for CSR, whose rows may touch any column, and
+// straight into avg/std for CSC, where each thread owns its columns.
+typedef struct {
+  const smatrix_t *mat;
+  vector_t *avg;
+  vector_t *std;
+  int flags;
+  double *partials;             // CSR: thread t's sums at 2*t*stride, second pass at (2*t+1)*stride
+  long *counts;                 // CSR: thread t's nonzeros per column at t*stride
+  long stride;                  // cols rounded up to a whole cache line
+  pthread_barrier_t *barrier;
+} sparse_ctx_t;
+
+// Turn the nonzero count and sums of a column into its mean and
+// standard deviation. Default statistics use sum and sumsq over the
+// nonzeros, the zeros adding nothing to either. Stable statistics get
+// the sum of squared deviations of the nonzeros from a second pass
+// and add (rows - nnz) * mean^2 for the zeros.
+static void sparse_finish(sparse_ctx_t *ctx, long j, double sum, double second, long nz){
+  long rows = ctx->mat->rows;
+  double mean = sum / rows;
+  double variance;
+  if(ctx->flags & COLNORM_STABLE){
+    variance = (second + (rows - nz) * mean * mean) / rows;
+  }
+  else{
+    variance = second / rows - mean * mean;
+  }
+  VSET(*ctx->avg,j, mean);
+  VSET(*ctx->std,j, sqrt(variance));
+}
+
+static void sparse_stats_worker(int thread_id, int thread_count, void *arg){
+  sparse_ctx_t *ctx = (sparse_ctx_t *) arg;
+  const smatrix_t *mat = ctx->mat;
+  int stable = (ctx->flags & COLNORM_STABLE) != 0;
+
+  if(mat->format == COLNORM_CSC){   // whole columns: no sharing between threads
+    long c0, c1;
+    split_nnz(mat->ptr, mat->cols, thread_count, thread_id, &c0, &c1);
+    for(long j=c0; j<c1; j++){
+      double sum = 0.0, sumsq = 0.0;
+      for(long k=mat->ptr[j]; k<mat->ptr[j+1]; k++){
+        sum += mat->val[k];
+        sumsq += mat->val[k] * mat->val[k];
+      }
+      if(stable){
+        double mean = sum / mat->rows;
+        sumsq = 0.0;
+        for(long k=mat->ptr[j]; k<mat->ptr[j+1]; k++){
+          double d = mat->val[k] - mean;
+          sumsq += d*d;
+        }
+      }
+      sparse_finish(ctx, j, sum, sumsq, mat->ptr[j+1] - mat->ptr[j]);
+    }
+    return;
+  }
+
+  // CSR: each thread sums a band of rows into its own partials, which
+  // are then reduced column range by column range
+  long r0, r1;
+  split_nnz(mat->ptr, mat->rows, thread_count, thread_id, &r0, &r1);
+  double *sum = ctx->partials + (2*thread_id)*ctx->stride;
+  double *second = ctx->partials + (2*thread_id+1)*ctx->stride;
+  long *count = ctx->counts + thread_id*ctx->stride;
+  memset(sum, 0, sizeof(double) * mat->cols);
+  memset(second, 0, sizeof(double) * mat->cols);
+  memset(count, 0, sizeof(long) * mat->cols);
+  for(long k=mat->ptr[r0]; k<mat->ptr[r1]; k++){
+    long j = mat->idx[k];
+    sum[j] += mat->val[k];
+    second[j] += mat->val[k] * mat->val[k];
+    count[j]++;
+  }
+  pthread_barrier_wait(ctx->barrier);
+
+  long c0, c1;
+  colnorm_split(mat->cols, thread_count, thread_id, &c0, &c1);
+  for(long j=c0; j<c1; j++){    // reduce sums; the means are needed for a second pass
+    double s = 0.0;
+    for(int t=0; t<thread_count; t++){
+      s += ctx->partials[(2*t)*ctx->stride + j];
+    }
+    VSET(*ctx->avg,j, s / mat->rows);
+  }
+  if(stable){                   // second pass: squared deviations of the nonzeros
+    pthread_barrier_wait(ctx->barrier);
+    memset(second, 0, sizeof(double) * mat->cols);
+    for(long k=mat->ptr[r0]; k<mat->ptr[r1]; k++){
+      double d = mat->val[k] - VGET(*ctx->avg, mat->idx[k]);
+      second[mat->idx[k]] += d*d;
+    }
+    pthread_barrier_wait(ctx->barrier);
+  }
+  for(long j=c0; j<c1; j++){
+    double s = 0.0, q = 0.0;
+    long nz = 0;
+    for(int t=0; t<thread_count; t++){
+      s += ctx->partials[(2*t)*ctx->stride + j];
+      q += ctx->partials[(2*t+1)*ctx->stride + j];
+      nz += ctx->counts[t*ctx->stride + j];
+    }
+    sparse_finish(ctx, j, s, q, nz);
+  }
+}
+
+// Compute the mean and population standard deviation of each column of
+// mat, zeros included, into avg_ptr and std_ptr on thread_count
+// threads. flags may be COLNORM_STABLE to use two passes over the
+// nonzeros, which stays accurate for columns with large offsets.
+// Returns 0 on success and nonzero on error.
+int colnorm_sparse_stats(const smatrix_t *mat, vector_t *avg_ptr, vector_t *std_ptr,
+                         int thread_count, int flags){
+  if(avg_ptr->len < mat->cols || std_ptr->len < mat->cols){
+    printf("colnorm_sparse_stats: vectors shorter than %ld cols\n",mat->cols);
+    return 1;
+  }
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+  pthread_barrier_t barrier;
+  sparse_ctx_t ctx = {
+    .mat = mat,
+    .avg = avg_ptr,
+    .std = std_ptr,
+    .flags = flags,
+    .stride = (mat->cols + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES * CN_LINE_DOUBLES,
+    .barrier = &barrier,
+  };
+  if(mat->format == COLNORM_CSR){
+    ctx.partials = malloc(sizeof(double) * 2 * thread_count * ctx.stride);
+    ctx.counts = malloc(sizeof(long) * thread_count * ctx.stride);
+    if(ctx.partials == NULL || ctx.counts == NULL){
+      printf("colnorm_sparse_stats: couldn't allocate partials for %d threads\n",thread_count);
+      free(ctx.partials);
+      free(ctx.counts);
+      return 1;
+    }
+  }
+  pthread_barrier_init(&barrier, NULL, thread_count);
+  colnorm_team_run(sparse_stats_worker, &ctx, thread_count);
+  pthread_barrier_destroy(&barrier);
+  free(ctx.partials);
+  free(ctx.counts);
+  return 0;
+}
+
+// Context for writing normalized values
+typedef struct {
+  const smatrix_t *mat;
+  matrix_t *dst;                // dense output, NULL to scale the nonzeros in place
+  const double *avg;
+  double *inv_std;
+} sparse_norm_ctx_t;
+
+static void sparse_norm_worker(int thread_id, int thread_count, void *arg){
+  sparse_norm_ctx_t *ctx = (sparse_norm_ctx_t *) arg;
+  const smatrix_t *mat = ctx->mat;
+  long outer = mat->format == COLNORM_CSR ? mat->rows : mat->cols;
+  long b0, b1;
+
+  if(ctx->dst == NULL){         // scale only: zeros stay zero, so split the nonzeros
+    split_nnz(mat->ptr, outer, thread_count, thread_id, &b0, &b1);
+    for(long b=b0; b<b1; b++){
+      for(long k=mat->ptr[b]; k<mat->ptr[b+1]; k++){
+        mat->val[k] *= ctx->inv_std[mat->format == COLNORM_CSR ? mat->idx[k] : b];
+      }
+    }
+    return;
+  }
+
+  // a dense row or column costs the same to fill however few nonzeros
+  // it has, so the dense output is split evenly instead
+  colnorm_split(outer, thread_count, thread_id, &b0, &b1);
+  matrix_t *dst = ctx->dst;
+  if(mat->format == COLNORM_CSR){
+    // every element of a row starts as a normalized zero and then the
+    // nonzeros are written over it
+    for(long i=b0; i<b1; i++){
+      double *row = &MGET(*dst,i,0);
+      for(long j=0; j<mat->cols; j++){
+        row[j] = -ctx->avg[j] * ctx->inv_std[j];
+      }
+      for(long k=mat->ptr[i]; k<mat->ptr[i+1]; k++){
+        long j = mat->idx[k];
+        row[j] = (mat->val[k] - ctx->avg[j]) * ctx->inv_std[j];
+      }
+    }
+  }
+  else{
+    // threads own column ranges of every row; filled row by row so the
+    // dense writes stay sequential
+    for(long i=0; i<mat->rows; i++){
+      double *row = &MGET(*dst,i,0);
+      for(long j=b0; j<b1; j++){
+        row[j] = -ctx->avg[j] * ctx->inv_std[j];
+      }
+    }
+    for(long j=b0; j<b1; j++){
+      for(long k=mat->ptr[j]; k<mat->ptr[j+1]; k++){
+        MSET(*dst, mat->idx[k], j, (mat->val[k] - ctx->avg[j]) * ctx->inv_std[j]);
+      }
+    }
+  }
+}
+
+// Run sparse_norm_worker() with the avg/std of each column, computing
+// them first unless flags has COLNORM_APPLY_ONLY
+static int sparse_normalize(smatrix_t *mat, matrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                            int thread_count, int flags, const char *who){
+  if(!(flags & COLNORM_APPLY_ONLY) &&
+     colnorm_sparse_stats(mat, avg_ptr, std_ptr, thread_count, flags)){
+    return 1;
+  }
+  if(flags & COLNORM_STATS_ONLY){
+    return 0;
+  }
+  sparse_norm_ctx_t ctx = {
+    .mat = mat,
+    .dst = dst,
+    .avg = avg_ptr->data,
+    .inv_std = malloc(sizeof(double) * mat->cols),
+  };
+  if(ctx.inv_std == NULL){
+    printf("%s: couldn't allocate %ld cols\n",who,mat->cols);
+    return 1;
+  }
+  for(long j=0; j<mat->cols; j++){
+    ctx.inv_std[j] = 1.0 / VGET(*std_ptr,j);
+  }
+  colnorm_team_run(sparse_norm_worker, &ctx, thread_count);
+  free(ctx.inv_std);
+  return 0;
+}
+
+// Normalize mat into the dense matrix dst, which must be mat->rows x
+// mat->cols: each element, zeros included, has its column mean
+// subtracted and is divided by its column standard deviation, as
+// colnorm_OPTM_into() does for a dense source. flags are as for
+// colnorm_OPTM_flags(). Returns 0 on success and nonzero on error.
+int colnorm_sparse_dense(smatrix_t *mat, matrix_t *dst, vector_t *avg_ptr, vector_t *std_ptr,
+                         int thread_count, int flags){
+  if(dst->rows != mat->rows || dst->cols != mat->cols){
+    printf("colnorm_sparse_dense: bad sizes\n");
+    return 1;
+  }
+  return sparse_normalize(mat, dst, avg_ptr, std_ptr, thread_count, flags, "colnorm_sparse_dense");
+}
+
+// Divide each nonzero of mat by its column standard deviation in
+// place without subtracting the mean, so zeros stay zero and mat stays
+// sparse. avg_ptr still receives the column means. flags are as for
+// colnorm_OPTM_flags(). Returns 0 on success and nonzero on error.
+int colnorm_sparse_scale(smatrix_t *mat, vector_t *avg_ptr, vector_t *std_ptr,
+                         int thread_count, int flags){
+  return sparse_normalize(mat, NULL, avg_ptr, std_ptr, thread_count, flags, "colnorm_sparse_scale");
+}
@@ -0,0 +1,453 @@
+// colnorm_stream.c: out-of-core column normalization of binary matrix
+// files which may be far larger than memory. The file is swept twice
+// in chunks of rows sized to a memory budget. The first pass computes
+// the statistics of each chunk with every thread of the team and
+// merges them into those of the whole matrix; the second normalizes
+// each chunk in the same buffer and writes it to the destination file.
+//
+// The passes are run as a pipeline of four stages connected by a ring
+// of chunk buffers:
+//
+//   read  ->  stats  ->  normalize  ->  write
+//
+// A reader thread fills buffers ahead of the compute team and a writer
+// thread drains them behind it, so the time taken approaches the
+// slowest of I/O and compute rather than their sum. The stats and
+// normalize stages are run in turn by the calling thread and the team.
+// The ring bounds the chunks in flight: the reader stalls until the
+// chunk that last used a buffer is released, by the stats stage in
+// the first pass and by the writer in the second. When every chunk
+// fits in the budget the buffers are kept between the passes and the
+// file is only read once. The reader and writer each transfer their
+// chunks through a colnorm_aio_t, so with io_uring a chunk is read or
+// written as many requests in flight at once.
+#define _GNU_SOURCE             // for posix_fadvise()
+#include "colnorm.h"
+#include <fcntl.h>
+
+#define STREAM_ALIGN 4096       // chunk buffers start on a page like the rows in the file
+#define STREAM_SLACK (256L*1024) // budget held back for the threads' tile scratch and stacks
+#define STREAM_BUFFERS 3        // buffers wanted so read, compute and write can all proceed
+#define STREAM_MIN_CHUNKS 8     // split even small files so compute starts before the read ends
+
+// Run the colnorm_OPTM_*() version for the file's element type on
+// rows rows held in buf, laid out as in the file.
+static int chunk_colnorm(const colnorm_binhdr_t *hdr, void *buf, long rows,
+                         vector_t *avg_ptr, vector_t *std_ptr, int thread_count, int flags){
+  if(hdr->dtype == COLNORM_F64){
+    matrix_t mat = { .rows = rows, .cols = hdr->cols, .col_space = hdr->col_space, .data = buf };
+    return colnorm_OPTM_flags(&mat, avg_ptr, std_ptr, thread_count, flags);
+  }
+  if(hdr->dtype == COLNORM_F32){
+    fmatrix_t mat = { .rows = rows, .cols = hdr->cols, .col_space = hdr->col_space, .data = buf };
+    return colnorm_OPTM_f32(&mat, avg_ptr, std_ptr, thread_count, flags);
+  }
+  hmatrix_t mat = { .rows = rows, .cols = hdr->cols, .col_space = hdr->col_space, .data = buf,
+                    .dtype = hdr->dtype };
+  return colnorm_OPTM_half(&mat, avg_ptr, std_ptr, thread_count, flags);
+}
+
+static double now_seconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+// State shared by the stages. Chunks are numbered by use: use u < n
+// is chunk u in the first pass and use n+k is chunk k in the second,
+// where n is the number of chunks. Use u lives in buffer u % nbufs.
+typedef struct {
+  colnorm_binhdr_t hdr;         // source file
+  colnorm_binhdr_t dst_hdr;     // destination file
+  int src_fd;
+  int dst_fd;
+  char *src_fname;
+  size_t row_bytes;
+  long chunk_rows;
+  long nchunks;                 // n, chunks per pass
+  int passes;                   // 1 for statistics only, 2 to write the normalized matrix
+  int resident;                 // nbufs == n and the second pass reuses the first's buffers
+  char **bufs;
+  int nbufs;
+  pthread_mutex_t lock;         // protects the counts below
+  pthread_cond_t cond;          // broadcast whenever a count changes
+  long read_done;               // uses read
+  long comp_done;               // uses computed, statistics or normalized
+  long write_done;              // chunks written
+  int error;                    // set by a failing stage to stop the others
+  colnorm_aio_t rd_aio;         // used by the reader
+  colnorm_aio_t wr_aio;         // used by the writer
+  colnorm_stream_stats_t *stats;
+} pipe_t;
+
+// rows in chunk k and its offset in the data of a file
+static long pipe_rows(pipe_t *p, long k){
+  long r0 = k * p->chunk_rows;
+  return r0 + p->chunk_rows < p->hdr.rows ? p->chunk_rows : p->hdr.rows - r0;
+}
+
+static off_t pipe_offset(pipe_t *p, long k){
+  return k * p->chunk_rows * p->row_bytes;
+}
+
+// Nonzero once use u no longer needs its buffer: first pass chunks are
+// done when their statistics are in, second pass chunks when written
+static int pipe_released(pipe_t *p, long u){
+  return u < p->nchunks ? p->comp_done > u : p->write_done > u - p->nchunks;
+}
+
+// Wait on the pipeline's condition until ready(p, u) or an error,
+// adding the time stalled to *waited. Called and returns with the lock
+// held. Returns nonzero if the pipeline has failed.
+static int pipe_wait(pipe_t *p, int (*ready)(pipe_t *, long), long u, double *waited){
+  double t0 = now_seconds();
+  while(!p->error && !ready(p, u)){
+    pthread_cond_wait(&p->cond, &p->lock);
+  }
+  *waited += now_seconds() - t0;
+  return p->error;
+}
+
+static int ready_to_read(pipe_t *p, long u){
+  return u < p->nbufs || pipe_released(p, u - p->nbufs);
+}
+
+static int ready_to_compute(pipe_t *p, long u){
+  return p->read_done > u || (p->resident && u >= p->nchunks);
+}
+
+static int ready_to_write(pipe_t *p, long k){
+  return p->comp_done > p->nchunks + k;
+}
+
+// Record that a stage finished its work for use u by setting *count
+// or that it failed, and wake the other stages
+static void pipe_post(pipe_t *p, long *count, long u, int failed){
+  pthread_mutex_lock(&p->lock);
+  if(failed){
+    p->error = 1;
+  }
+  else{
+    *count = u+1;
+  }
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Reader thread: fills each buffer once the use before it in the ring
+// has released it. A resident pipeline reads only the first pass.
+static void *pipe_reader(void *arg){
+  pipe_t *p = (pipe_t *) arg;
+  colnorm_stage_t *st = &p->stats->stage[COLNORM_STAGE_READ];
+  long uses = p->resident ? p->nchunks : p->passes * p->nchunks;
+  for(long u=0; u<uses; u++){
+    pthread_mutex_lock(&p->lock);
+    int failed = pipe_wait(p, ready_to_read, u, &st->wait_out);
+    pthread_mutex_unlock(&p->lock);
+    if(failed){
+      break;
+    }
+    long k = u % p->nchunks;
+    double t0 = now_seconds();
+    failed = colnorm_aio_read(&p->rd_aio, p->src_fd, p->bufs[u % p->nbufs], pipe_rows(p,k) * p->row_bytes,
+                              p->hdr.data_offset + pipe_offset(p,k));
+    st->busy += now_seconds() - t0;
+    st->chunks++;
+    if(failed){
+      printf("colnorm_stream: couldn't read chunk %ld of %s\n", k, p->src_fname);
+    }
+    pipe_post(p, &p->read_done, u, failed);
+  }
+  return NULL;
+}
+
+// Writer thread: writes each normalized chunk of the second pass
+static void *pipe_writer(void *arg){
+  pipe_t *p = (pipe_t *) arg;
+  colnorm_stage_t *st = &p->stats->stage[COLNORM_STAGE_WRITE];
+  for(long k=0; k<p->nchunks; k++){
+    pthread_mutex_lock(&p->lock);
+    int failed = pipe_wait(p, ready_to_write, k, &st->wait_in);
+    pthread_mutex_unlock(&p->lock);
+    if(failed){
+      break;
+    }
+    double t0 = now_seconds();
+    failed = colnorm_aio_write(&p->wr_aio, p->dst_fd, p->bufs[(p->nchunks + k) % p->nbufs],
+                               pipe_rows(p,k) * p->row_bytes, p->dst_hdr.data_offset + pipe_offset(p,k));
+    st->busy += now_seconds() - t0;
+    st->chunks++;
+    if(failed){
+      perror("colnorm_stream: couldn't write normalized rows");
+    }
+    pipe_post(p, &p->write_done, k, failed);
+  }
+  return NULL;
+}
+
+// Choose the chunk size and number of buffers for a budget of avail
+// bytes: enough rows for STREAM_BUFFERS buffers but at least
+// STREAM_MIN_CHUNKS chunks. With direct I/O chunks are kept to a
+// multiple of the rows making a whole number of pages, when that fits,
+// so every chunk starts on a page of the file. If every chunk fits at
+// once the pipeline is resident. Returns nonzero if not even one row
+// fits.
+static int pipe_size(pipe_t *p, size_t avail, int direct){
+  long rows = p->hdr.rows;
+  long fit = avail / p->row_bytes;
+  if(fit < 1){
+    return 1;
+  }
+  long chunk_rows = fit / STREAM_BUFFERS;
+  if(chunk_rows < 1){
+    chunk_rows = fit;           // too tight to overlap; one buffer
+  }
+  long min_split = (rows + STREAM_MIN_CHUNKS - 1) / STREAM_MIN_CHUNKS;
+  if(chunk_rows > min_split){
+    chunk_rows = min_split;
+  }
+  long unit = 1;                // rows in a whole number of pages
+  while(direct && unit < STREAM_ALIGN && (unit * p->row_bytes) % STREAM_ALIGN != 0){
+    unit *= 2;
+  }
+  if(chunk_rows > unit){
+    chunk_rows = chunk_rows / unit * unit;
+  }
+  p->chunk_rows = chunk_rows;
+  p->nchunks = (rows + chunk_rows - 1) / chunk_rows;
+  long nbufs = fit / chunk_rows;
+  p->resident = nbufs >= p->nchunks && p->passes == 2;
+  p->nbufs = nbufs < p->nchunks ? nbufs : p->nchunks;
+  return 0;
+}
+
+// Same as colnorm_stream(); if stats is not NULL it is filled in with
+// the chunking chosen and the time each stage of the pipeline spent
+// working and stalled.
+int colnorm_stream_stats(char *src_fname, char *dst_fname, vector_t *avg_ptr, vector_t *std_ptr,
+                         size_t mem_budget, int thread_count, int flags, colnorm_stream_stats_t *stats){
+  double start = now_seconds();
+  colnorm_stream_stats_t local_stats;
+  if(stats == NULL){
+    stats = &local_stats;
+  }
+  memset(stats, 0, sizeof(*stats));
+  avg_ptr->data = std_ptr->data = NULL;         // nothing for the caller to free on error
+  if(thread_count < 1){
+    thread_count = 1;
+  }
+  pipe_t p;
+  memset(&p, 0, sizeof(p));
+  p.src_fname = src_fname;
+  p.stats = stats;
+  p.dst_fd = -1;
+  p.src_fd = colnorm_binary_open(src_fname, &p.hdr);
+  if(p.src_fd < 0){
+    return 1;
+  }
+  long cols = p.hdr.cols;
+  p.row_bytes = colnorm_dtype_bytes(p.hdr.dtype) * p.hdr.col_space;
+  p.passes = (dst_fname == NULL || (flags & COLNORM_STATS_ONLY)) ? 1 : 2;
+
+  // besides the chunks, memory goes to avg, std, their values for a
+  // chunk, and within colnorm_OPTM() two partials per thread plus the
+  // reciprocals of std, all a double per column
+  size_t overhead = sizeof(double) * cols * (5 + 2*thread_count) + STREAM_SLACK;
+  if(mem_budget <= overhead || pipe_size(&p, mem_budget - overhead, flags & COLNORM_IO_DIRECT)){
+    printf("colnorm_stream: memory budget of %zu bytes is too small for rows of %zu bytes\n",
+           mem_budget, p.row_bytes);
+    close(p.src_fd);
+    return 1;
+  }
+  size_t buf_bytes = (p.chunk_rows * p.row_bytes + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+  p.bufs = calloc(p.nbufs, sizeof(char *));
+  int ret = p.bufs == NULL;
+  for(int b=0; ret == 0 && b<p.nbufs; b++){
+    p.bufs[b] = aligned_alloc(STREAM_ALIGN, buf_bytes);
+    ret = p.bufs[b] == NULL;
+  }
+  vector_t chunk_avg = {.data = NULL}, chunk_std = {.data = NULL};
+  if(ret){
+    printf("colnorm_stream: couldn't allocate %d chunks of %zu bytes\n", p.nbufs, buf_bytes);
+  }
+  else if(vector_init(avg_ptr, cols) || vector_init(std_ptr, cols) ||
+          vector_init(&chunk_avg, cols) || vector_init(&chunk_std, cols) ||
+          avg_ptr->data == NULL || std_ptr->data == NULL ||
+          chunk_avg.data == NULL || chunk_std.data == NULL){
+    printf("colnorm_stream: couldn't allocate vectors of %ld columns\n", cols);
+    ret = 1;
+  }
+  if(ret){                      // free whatever was allocated; entries of bufs start NULL
+    for(int b=0; p.bufs != NULL && b<p.nbufs; b++){
+      free(p.bufs[b]);
+    }
+    free(p.bufs);
+    vector_free_data(avg_ptr);
+    vector_free_data(std_ptr);
+    vector_free_data(&chunk_avg);
+    vector_free_data(&chunk_std);
+    close(p.src_fd);
+    return 1;
+  }
+  memset(avg_ptr->data, 0, sizeof(double) * cols);
+  memset(std_ptr->data, 0, sizeof(double) * cols);
+  stats->chunk_rows = p.chunk_rows;
+  stats->chunks = p.nchunks;
+  stats->buffers = p.nbufs;
+  stats->resident = p.resident;
+  posix_fadvise(p.src_fd, p.hdr.data_offset, 0, POSIX_FADV_SEQUENTIAL);  // only a hint
+
+  if(p.passes == 2){
+    p.dst_hdr = p.hdr;
+    p.dst_fd = colnorm_binary_create(dst_fname, &p.dst_hdr);
+    if(p.dst_fd < 0){
+      p.passes = 0;             // nothing runs below
+      ret = 1;
+    }
+  }
+  if((flags & COLNORM_IO_DIRECT) && (colnorm_aio_direct(p.src_fd, 1) ||
+                                     (p.dst_fd >= 0 && colnorm_aio_direct(p.dst_fd, 1)))){
+    printf("colnorm_stream: O_DIRECT not supported, going through the page cache\n");
+    colnorm_aio_direct(p.src_fd, 0);
+  }
+  int backend = (flags & COLNORM_IO_THREADS) ? COLNORM_AIO_THREADS : COLNORM_AIO_AUTO;
+  size_t reg_bytes[p.nbufs];
+  for(int b=0; b<p.nbufs; b++){
+    reg_bytes[b] = buf_bytes;
+  }
+  colnorm_aio_init(&p.rd_aio, backend, COLNORM_AIO_DEPTH);
+  colnorm_aio_init(&p.wr_aio, backend, COLNORM_AIO_DEPTH);
+  colnorm_aio_register(&p.rd_aio, (void **) p.bufs, reg_bytes, p.nbufs);
+  if(p.passes == 2){
+    colnorm_aio_register(&p.wr_aio, (void **) p.bufs, reg_bytes, p.nbufs);
+  }
+  stats->io_backend = colnorm_aio_name(&p.rd_aio);
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.cond, NULL);
+  pthread_t reader, writer;
+  if(p.passes > 0 && pthread_create(&reader, NULL, pipe_reader, &p) != 0){
+    perror("colnorm_stream: couldn't create reader thread");
+    exit(1);
+  }
+  if(p.passes == 2 && pthread_create(&writer, NULL, pipe_writer, &p) != 0){
+    perror("colnorm_stream: couldn't create writer thread");
+    exit(1);
+  }
+
+  // the stats and normalize stages run here on the team. In the first
+  // pass avg and std hold the running mean and M2 of the rows seen so
+  // far; each chunk's population variance times its row count is its
+  // M2, merged in with Chan's pairwise formula. The second pass
+  // normalizes each chunk in place with the statistics of the whole
+  // matrix.
+  int stats_flags = (flags & COLNORM_STABLE) | COLNORM_STATS_ONLY;
+  for(long u=0; u < p.passes * p.nchunks; u++){
+    long k = u % p.nchunks;
+    int pass = u / p.nchunks;
+    colnorm_stage_t *st = &stats->stage[pass == 0 ? COLNORM_STAGE_STATS : COLNORM_STAGE_NORMALIZE];
+    pthread_mutex_lock(&p.lock);
+    int failed = pipe_wait(&p, ready_to_compute, u, &st->wait_in);
+    pthread_mutex_unlock(&p.lock);
+    if(failed){
+      ret = 1;
+      break;
+    }
+    double t0 = now_seconds();
+    char *buf = p.bufs[u % p.nbufs];
+    long n_b = pipe_rows(&p, k);
+    if(pass == 0){
+      failed = chunk_colnorm(&p.hdr, buf, n_b, &chunk_avg, &chunk_std, thread_count, stats_flags);
+      double n_a = k * p.chunk_rows;
+      double n_ab = n_a + n_b;
+      for(long j=0; j<cols; j++){
+        double delta = VGET(chunk_avg,j) - VGET(*avg_ptr,j);
+        double m2_b = VGET(chunk_std,j) * VGET(chunk_std,j) * n_b;
+        VSET(*avg_ptr, j, VGET(*avg_ptr,j) + delta * (n_b / n_ab));
+        VSET(*std_ptr, j, VGET(*std_ptr,j) + m2_b + delta * delta * (n_a * n_b / n_ab));
+      }
+      if(k == p.nchunks-1){
+        for(long j=0; j<cols; j++){
+          VSET(*std_ptr, j, sqrt(VGET(*std_ptr,j) / p.hdr.rows));
+        }
+      }
+    }
+    else{
+      failed = chunk_colnorm(&p.hdr, buf, n_b, avg_ptr, std_ptr, thread_count, COLNORM_APPLY_ONLY);
+    }
+    st->busy += now_seconds() - t0;
+    st->chunks++;
+    pipe_post(&p, &p.comp_done, u, failed);
+    if(failed){
+      ret = 1;
+      break;
+    }
+  }
+
+  if(p.passes > 0){
+    pthread_join(reader, NULL);
+  }
+  if(p.passes == 2){
+    pthread_join(writer, NULL);
+  }
+  ret = ret || p.error;
+  if(p.dst_fd >= 0 && close(p.dst_fd) != 0){
+    perror("colnorm_stream: couldn't close destination");
+    ret = 1;
+  }
+  pthread_cond_destroy(&p.cond);
+  pthread_mutex_destroy(&p.lock);
+  colnorm_aio_free(&p.rd_aio);
+  colnorm_aio_free(&p.wr_aio);
+  close(p.src_fd);
+  for(int b=0; b<p.nbufs; b++){
+    free(p.bufs[b]);
+  }
+  free(p.bufs);
+  vector_free_data(&chunk_avg);
+  vector_free_data(&chunk_std);
+  if(ret){                      // as for the early returns, the caller frees nothing
+    vector_free_data(avg_ptr);
+    vector_free_data(std_ptr);
+  }
+  stats->wall = now_seconds() - start;
+  return ret;
+}
+
+// Normalize the columns of the binary matrix file src_fname, as
+// written by matrix_write_binary() and friends, into a new binary file
+// dst_fname of the same type and shape, never holding more than about
+// mem_budget bytes of it in memory. thread_count threads work on each
+// chunk while separate threads read and write the file, with io_uring
+// unless flags has COLNORM_IO_THREADS. With COLNORM_IO_DIRECT the file
+// data bypasses the page cache. avg_ptr and std_ptr are initialized
+// here to the column statistics and must be freed by the caller on
+// success; on error nothing is left allocated in them and their data
+// is NULL. If dst_fname is NULL or flags has
+// COLNORM_STATS_ONLY only the statistics are computed, in one pass over
+// the file. COLNORM_STABLE is recommended for large files: chunks are
+// merged with Chan's formula either way but the default sums may lose
+// the variance of columns with large offsets within a chunk. Returns 0
+// on success and nonzero on error.
+int colnorm_stream(char *src_fname, char *dst_fname, vector_t *avg_ptr, vector_t *std_ptr,
+                   size_t mem_budget, int thread_count, int flags){
+  return colnorm_stream_stats(src_fname, dst_fname, avg_ptr, std_ptr, mem_budget, thread_count,
+                              flags, NULL);
+}
+
+// Print how a colnorm_stream_stats() run was chunked and, for each
+// stage, its share of the wall time spent busy and stalled.
+void colnorm_stream_stats_print(FILE *file, colnorm_stream_stats_t *stats){
+  static const char *names[COLNORM_STAGES] = { "read", "stats", "normalize", "write" };
+  fprintf(file,"%ld chunks of %ld rows, %d buffers%s, %s I/O, %.3f s\n", stats->chunks,
+          stats->chunk_rows, stats->buffers, stats->resident ? ", resident" : "",
+          stats->io_backend, stats->wall);
+  fprintf(file,"%-10s %6s %8s %6s %8s %8s\n", "STAGE", "CHUNKS", "BUSY", "OCC%", "WAIT_IN", "WAIT_OUT");
+  double serial = 0.0;
+  for(int s=0; s<COLNORM_STAGES; s++){
+    colnorm_stage_t *st = &stats->stage[s];
+    fprintf(file,"%-10s %6ld %8.4f %6.1f %8.4f %8.4f\n", names[s], st->chunks, st->busy,
+            stats->wall > 0 ? 100.0 * st->busy / stats->wall : 0.0, st->wait_in, st->wait_out);
+    serial += st->busy;
+  }
+  fprintf(file,"stages busy %.3f s in total; overlapped into %.3f s\n", serial, stats->wall);
+}
@@ -0,0 +1,232 @@
+// colnorm_topo.c: discover details of the machine from sysfs that
+// are used to size and place the work done by colnorm_OPTM().
+#define _GNU_SOURCE             // for cpu_set_t and pthread_setaffinity_np()
+#include "colnorm.h"
+#include <sched.h>
+
+#define CN_DEFAULT_L1 (32L*1024)        // used when sysfs can't be read
+#define CN_DEFAULT_L2 (1024L*1024)
+#define CN_DEFAULT_L3 (8L*1024*1024)
+#define CN_MAX_NODES  64                // node directories probed in sysfs
+
+// Reads the first line of a sysfs file into buf. Returns 0 on success
+// and nonzero if the file can't be read.
+static int read_sysfs_line(char *path, char *buf, int size){
+  FILE *file = fopen(path,"r");
+  if(file == NULL){
+    return 1;
+  }
+  char *ret = fgets(buf, size, file);
+  fclose(file);
+  if(ret == NULL){
+    return 1;
+  }
+  buf[strcspn(buf,"\n")] = '\0';
+  return 0;
+}
+
+// Returns the size in bytes of the data or unified cache at the given
+// level for cpu0 as listed under /sys/devices/system/cpu/cpu0/cache
+// or 0 if no such cache is listed. Sizes look like "48K" or "2M".
+static long sysfs_cache_bytes(int level){
+  char path[256], buf[64];
+  for(int idx=0; idx<16; idx++){
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", idx);
+    if(read_sysfs_line(path, buf, sizeof(buf))){
+      break;                    // no more cache indices
+    }
+    if(atoi(buf) != level){
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", idx);
+    if(read_sysfs_line(path, buf, sizeof(buf)) || strcmp(buf,"Instruction") == 0){
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", idx);
+    if(read_sysfs_line(path, buf, sizeof(buf))){
+      continue;
+    }
+    char *suffix;
+    long size = strtol(buf, &suffix, 10);
+    if(*suffix == 'K'){
+      size *= 1024;
+    }
+    else if(*suffix == 'M'){
+      size *= 1024*1024;
+    }
+    return size;
+  }
+  return 0;
+}
+
+// Cache sizes are looked up once and remembered
+static long cache_l1 = -1, cache_l2 = -1, cache_l3 = -1;
+
+// Returns the size in bytes of the level 1, 2 or 3 data cache, falling
+// back to typical sizes if sysfs doesn't report them.
+long colnorm_cache_bytes(int level){
+  if(cache_l1 < 0){
+    cache_l1 = sysfs_cache_bytes(1);
+    cache_l2 = sysfs_cache_bytes(2);
+    cache_l3 = sysfs_cache_bytes(3);
+    if(cache_l1 <= 0){
+      cache_l1 = CN_DEFAULT_L1;
+    }
+    if(cache_l2 <= 0){
+      cache_l2 = CN_DEFAULT_L2;
+    }
+    if(cache_l3 <= 0){
+      cache_l3 = CN_DEFAULT_L3;
+    }
+  }
+  return level == 1 ? cache_l1 : (level == 2 ? cache_l2 : cache_l3);
+}
+
+// Choose the tile used to sweep a matrix with the given number of
+// columns. The column block is sized so the sum and sumsq accumulators
+// for it take half of L1, leaving room for the row data streaming
+// through. The row block is sized so one tile of the matrix fits in
+// half of L2. Narrow matrices get a single column block.
+void colnorm_tile_size(long cols, long *tile_rows, long *tile_cols){
+  long l1 = colnorm_cache_bytes(1);
+  long l2 = colnorm_cache_bytes(2);
+  long tc = (l1 / 2) / (2 * sizeof(double));
+  tc = tc / 8 * 8;              // whole cache lines of columns
+  if(tc < 64){
+    tc = 64;
+  }
+  if(tc > cols){
+    tc = cols;
+  }
+  long tr = (l2 / 2) / (tc * sizeof(double));
+  if(tr < 1){
+    tr = 1;
+  }
+  *tile_rows = tr;
+  *tile_cols = tc;
+}
+
+// Parse a sysfs cpu list such as "0-3,8,10-11" and set entry c of
+// node_of[] to node for each cpu c listed, ignoring cpus >= max.
+static void parse_cpulist(char *list, int node, int *node_of, int max){
+  char *p = list;
+  while(*p != '\0'){
+    char *end;
+    long lo = strtol(p, &end, 10);
+    if(end == p){
+      break;
+    }
+    long hi = lo;
+    p = end;
+    if(*p == '-'){
+      hi = strtol(p+1, &end, 10);
+      p = end;
+    }
+    for(long c=lo; c<=hi && c<max; c++){
+      node_of[c] = node;
+    }
+    if(*p == ','){
+      p++;
+    }
+  }
+}
+
+static colnorm_topo_t topo;
+static int topo_ready = 0;
+
+// Returns the cpus this process may run on grouped node by node as
+// listed in /sys/devices/system/node. Machines without that directory
+// are treated as a single node. Computed once on first use.
+const colnorm_topo_t *colnorm_topology(){
+  if(topo_ready){
+    return &topo;
+  }
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+    for(int c=0; c<CN_MAX_CPUS; c++){
+      CPU_SET(c, &allowed);
+    }
+  }
+
+  int node_of[CN_MAX_CPUS];
+  for(int c=0; c<CN_MAX_CPUS; c++){
+    node_of[c] = 0;
+  }
+  int nnodes = 0;
+  char path[256], buf[4096];
+  for(int node=0; node<CN_MAX_NODES; node++){
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if(read_sysfs_line(path, buf, sizeof(buf))){
+      continue;                 // node numbers may have gaps
+    }
+    parse_cpulist(buf, node, node_of, CN_MAX_CPUS);
+    nnodes = node+1;
+  }
+  if(nnodes == 0){
+    nnodes = 1;
+  }
+
+  topo.nnodes = nnodes;
+  topo.ncpus = 0;
+  for(int node=0; node<nnodes; node++){
+    for(int c=0; c<CN_MAX_CPUS; c++){
+      if(node_of[c] == node && CPU_ISSET(c, &allowed)){
+        topo.cpus[topo.ncpus] = c;
+        topo.cpu_node[topo.ncpus] = node;
+        topo.ncpus++;
+      }
+    }
+  }
+  if(topo.ncpus == 0){          // affinity mask listed nothing we know of
+    topo.cpus[0] = 0;
+    topo.cpu_node[0] = 0;
+    topo.ncpus = 1;
+  }
+  topo_ready = 1;
+  return &topo;
+}
+
+// Index into colnorm_topology()->cpus[] where team member `member` of
+// a team of team_size threads is placed. Members are spread evenly
+// over the cpus so consecutive members, which process consecutive row
+// bands, share a node.
+int colnorm_topo_slot(int member, int team_size){
+  const colnorm_topo_t *t = colnorm_topology();
+  return (int) (((long) member * t->ncpus) / team_size);
+}
+
+// Pin the calling thread to the cpu chosen for the given team member.
+// Returns 0 on success and nonzero if the affinity can't be set.
+int colnorm_topo_pin(int member, int team_size){
+  const colnorm_topo_t *t = colnorm_topology();
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(t->cpus[colnorm_topo_slot(member, team_size)], &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Let the calling thread run on any available cpu again after
+// colnorm_topo_pin(). Returns 0 on success.
+int colnorm_topo_unpin(){
+  const colnorm_topo_t *t = colnorm_topology();
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(int i=0; i<t->ncpus; i++){
+    CPU_SET(t->cpus[i], &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Print the nodes found and where each member of a team of
+// thread_count threads would be pinned.
+void colnorm_topology_print(FILE *file, int thread_count){
+  const colnorm_topo_t *t = colnorm_topology();
+  fprintf(file,"Topology: %d node(s), %d cpu(s) available\n", t->nnodes, t->ncpus);
+  fprintf(file,"Placement for %d threads:", thread_count);
+  for(int m=0; m<thread_count; m++){
+    int slot = colnorm_topo_slot(m, thread_count);
+    fprintf(file," T%d->cpu%d/node%d", m, t->cpus[slot], t->cpu_node[slot]);
+  }
+  fprintf(file,"\n");
+}
@@ -37,15 +37,178 @@ int matrix_init(matrix_t *mat, long rows, long cols){
     // printf("matrix cols %ld to col_space %ld\n",mat->cols,mat->col_space);
   }
   mat->data = malloc(sizeof(double) * rows * mat->col_space);
+  mat->alloc = MATRIX_ALLOC_MALLOC;
+  mat->alloc_bytes = 0;
   return 0;
 }
 
-// copy src matrix to dst; must be both initialized and of equal size
+#define HUGE_PAGE_BYTES (2L*1024*1024)   // x86-64 transparent huge page size
+
+// Like matrix_init() but col_space is padded so that every row starts
+// at a multiple of align bytes (a power of two, at least 16), e.g. 64
+// for cache lines / AVX-512. With MATRIX_HUGEPAGE in flags the data is
+// mapped with mmap() on a huge page boundary and transparent huge
+// pages are requested with madvise() to cut TLB misses; otherwise it
+// comes from posix_memalign(). Returns 0 on success, nonzero on error.
+int matrix_init_aligned(matrix_t *mat, long rows, long cols, long align, int flags){
+  if(rows<=0 || cols<=0){
+    printf("Invalid rows or cols: %ld %ld\n",rows,cols);
+    return 1;
+  }
+  if(align < 16 || (align & (align-1)) != 0){
+    printf("Invalid alignment: %ld\n",align);
+    return 1;
+  }
+  long align_doubles = align / sizeof(double);
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->col_space = (cols + align_doubles - 1) / align_doubles * align_doubles;
+  size_t bytes = sizeof(double) * rows * mat->col_space;
+
+  if(flags & MATRIX_HUGEPAGE){
+    // over-map by a huge page and trim so the data starts on a huge
+    // page boundary which the kernel needs to back it with huge pages
+    size_t mapped = (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    char *raw = mmap(NULL, mapped + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED){
+      perror("matrix_init_aligned: couldn't map matrix");
+      return 1;
+    }
+    char *start = (char *) (((size_t) raw + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1));
+    if(start > raw){
+      munmap(raw, start - raw);
+    }
+    munmap(start + mapped, (raw + HUGE_PAGE_BYTES) - start);
+    madvise(start, mapped, MADV_HUGEPAGE);        // only a hint; ignore failure
+    mat->data = (double *) start;
+    mat->alloc = MATRIX_ALLOC_MMAP;
+    mat->alloc_bytes = mapped;
+  }
+  else{
+    if(posix_memalign((void **) &mat->data, align, bytes) != 0){
+      printf("matrix_init_aligned: couldn't allocate %zu bytes\n",bytes);
+      return 1;
+    }
+    mat->alloc = MATRIX_ALLOC_MALLOC;
+    mat->alloc_bytes = 0;
+  }
+  return 0;
+}
+
+// Fill in stats on how the data of mat is laid out in memory: the
+// alignment every row start shares, the bytes spanned, and how many of
+// those bytes the kernel currently backs with transparent huge pages
+// according to /proc/self/smaps. smaps only gives a total for each
+// mapping, so a mapping the matrix shares, such as a malloc heap, is
+// credited with its huge pages in proportion to the part of it the
+// matrix covers; the result is an estimate in that case and exact for
+// a matrix with mappings of its own. Huge page coverage is only known
+// once pages have been touched. Returns 0 on success, nonzero if smaps
+// can't be read, in which case huge_bytes is 0.
+int matrix_mem_stats(matrix_t *mat, matrix_mem_stats_t *stats){
+  size_t addr = (size_t) mat->data;
+  size_t row_bytes = sizeof(double) * mat->col_space;
+  long align = 4096;
+  while(align > 1 && ((addr % align) != 0 || (mat->rows > 1 && row_bytes % align != 0))){
+    align /= 2;
+  }
+  stats->row_align = align;
+  stats->bytes = row_bytes * mat->rows;
+  stats->huge_bytes = 0;
+
+  FILE *file = fopen("/proc/self/smaps","r");
+  if(file == NULL){
+    return 1;
+  }
+  // smaps lists each mapping as "lo-hi perms ..." followed by lines
+  // of "Field: N kB"; sum AnonHugePages of mappings that overlap data,
+  // each scaled by the fraction of the mapping inside [addr,end)
+  char line[512];
+  double fraction = 0.0;        // of the current mapping overlapping data
+  size_t end = addr + stats->bytes;
+  while(fgets(line, sizeof(line), file) != NULL){
+    size_t lo, hi, kb;
+    if(sscanf(line, "%zx-%zx ", &lo, &hi) == 2){
+      size_t beg = lo > addr ? lo : addr;
+      size_t fin = hi < end ? hi : end;
+      fraction = (beg < fin && hi > lo) ? (double) (fin - beg) / (hi - lo) : 0.0;
+    }
+    else if(fraction > 0.0 && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1){
+      stats->huge_bytes += (size_t) (kb * 1024.0 * fraction);
+    }
+  }
+  fclose(file);
+  if(stats->huge_bytes > stats->bytes){
+    stats->huge_bytes = stats->bytes;
+  }
+  return 0;
+}
+
+// context for first-touching a matrix from the threads that will use it
+typedef struct {
+  matrix_t mat;
+  colnorm_plan_t plan;
+} touch_ctx_t;
+
+// Zero the block of the matrix that colnorm_OPTM() will assign to
+// this thread so the kernel places those pages on this thread's node.
+static void touch_worker(int thread_id, int thread_count, void *arg){
+  touch_ctx_t *ctx = (touch_ctx_t *) arg;
+  long row_beg, row_end, col_beg, col_end;
+  colnorm_plan_block(ctx->plan, ctx->mat.rows, ctx->mat.cols, thread_id,
+                     &row_beg, &row_end, &col_beg, &col_end);
+  if(col_end == ctx->mat.cols){         // include padding at the end of rows
+    col_end = ctx->mat.col_space;
+  }
+  for(long i=row_beg; i<row_end; i++){
+    memset(&MGET(ctx->mat,i,col_beg), 0, sizeof(double) * (col_end-col_beg));
+  }
+}
+
+// Like matrix_init() but lays out the matrix for colnorm_OPTM() with
+// thread_count threads on a NUMA machine. Fresh pages are mapped and
+// each block is first touched, and so placed, by the team member that
+// will process it. Placement is best when a pool of thread_count
+// threads was started with COLNORM_POOL_PIN. Data is zeroed.
+int matrix_init_numa(matrix_t *mat, long rows, long cols, int thread_count){
+  if(rows<=0 || cols<=0){
+    printf("Invalid rows or cols: %ld %ld\n",rows,cols);
+    return 1;
+  }
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->col_space = cols + (cols % 2);
+  mat->alloc_bytes = sizeof(double) * rows * mat->col_space;
+  mat->data = mmap(NULL, mat->alloc_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mat->data == MAP_FAILED){
+    perror("matrix_init_numa: couldn't map matrix");
+    return 1;
+  }
+  mat->alloc = MATRIX_ALLOC_MMAP;
+
+  touch_ctx_t ctx = {
+    .mat = *mat,
+    .plan = colnorm_plan(rows, cols, mat->col_space, thread_count),
+  };
+  colnorm_team_run(touch_worker, &ctx, thread_count);
+  return 0;
+}
+
+// copy src matrix to dst; must be both initialized and of equal size.
+// Matrices padded differently are copied a row at a time.
 int matrix_copy(matrix_t *dst, matrix_t *src){
-  if(dst->rows != src->rows || dst->cols != src->cols || dst->col_space != src->col_space) {
+  if(dst->rows != src->rows || dst->cols != src->cols) {
     printf("ERROR: size mismatch, couldn't copy\n");
     return -1;
   }
+  if(dst->col_space != src->col_space){
+    for(long i=0; i<src->rows; i++){
+      memcpy(&MGET(*dst,i,0), &MGET(*src,i,0), sizeof(double)*src->cols);
+    }
+    return 0;
+  }
   memcpy(dst->data, src->data, sizeof(double)*src->rows*src->col_space);
   return 0;
 }
@@ -69,7 +232,12 @@ void vector_free_data(vector_t *vec){
 
 // Frees memory associated with the data field of mat.
 void matrix_free_data(matrix_t *mat){
-  free(mat->data);
+  if(mat->alloc == MATRIX_ALLOC_MMAP){
+    munmap(mat->data, mat->alloc_bytes);
+  }
+  else{
+    free(mat->data);
+  }
   mat->data = NULL;
   mat->rows = -1;
   mat->cols = -1;
@@ -110,48 +278,123 @@ int vector_read_from_file(char *fname, vector_t *vec_ref){
 // format of the file is space separated numbers.
 // - first two longs indicate size of matrix
 // - remaining ints are data in the matrix
-// Returns 0 on success and non-zero on error.
+// Returns 0 on success and non-zero on error. Parsing is done by
+// matrix_load_text() using the threads of the pool if one is active.
 int matrix_read_from_file(char *fname, matrix_t *mat_ref){
-  FILE *file = fopen(fname,"r");
-  if(file == NULL){
-    perror("couldn't open matrix file");
-    return 1;
-  }
-  long rows, cols;
-  assert(fscanf(file, "%ld %ld",&rows,&cols) == 2);
-  matrix_t mat;
-  int ret = matrix_init(&mat,rows,cols);
-  if(ret){
-    return ret;
-  }
-  for(int i=0; i<rows; i++){
-    for(int j=0; j<cols; j++){
-      double x;
-      assert(fscanf(file,"%lf",&x)==1);
-      MSET(mat,i,j,x);
-    }
-  }
-  fclose(file);
-  *mat_ref = mat;
-  return 0;
+  int thread_count = colnorm_pool_size();
+  return matrix_load_text(fname, mat_ref, thread_count > 0 ? thread_count : 1);
 }
 
 // Writes a vector to an open file handle. Prints some dimension
 // information followed by index and data on each line. Use with
-// stdout to print to the screen.
+// stdout to print to the screen. Formatting is done by
+// vector_write_fmt() which produces the same text as one fprintf()
+// per element but much faster.
 void vector_write(FILE *file, vector_t vec){
-  fprintf(file,"%ld x 1 vector\n",vec.len);
-  for(int i=0; i<vec.len; i++){
-    fprintf(file,"%4d: ",i);
-    fprintf(file,"%6.2f\n", VGET(vec,i));
-  }
+  vector_write_fmt(file, &vec, COLNORM_FMT_FIXED);
   return;
 }
 
 // Writes a matrix to an open file handle. Prints some dimension
 // information followed by index and data on each line. Use with
-// stdout to print to the screen.
+// stdout to print to the screen. Rows are formatted in bulk by
+// matrix_write_fmt(), using the threads of the pool if one is active.
 void matrix_write(FILE *file, matrix_t mat){
+  int thread_count = colnorm_pool_size();
+  matrix_write_fmt(file, &mat, COLNORM_FMT_FIXED, thread_count > 0 ? thread_count : 1);
+  return;
+}
+
+// Single precision counterpart of matrix_init(). col_space is
+// rounded up to a multiple of 4 floats so rows start at addresses
+// divisible by 16 as they do for matrix_t. Returns 0 on success and
+// nonzero if rows,cols are 0 or negative or the data can't be
+// allocated.
+int fmatrix_init(fmatrix_t *mat, long rows, long cols){
+  if(rows<=0 || cols<=0){
+    printf("Invalid rows or cols: %ld %ld\n",rows,cols);
+    return 1;
+  }
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->col_space = (cols + 3) / 4 * 4;
+  mat->data = malloc(sizeof(float) * rows * mat->col_space);
+  if(mat->data == NULL){
+    printf("fmatrix_init: couldn't allocate %ld x %ld floats\n",rows,cols);
+    return 1;
+  }
+  mat->alloc = MATRIX_ALLOC_MALLOC;
+  mat->alloc_bytes = 0;
+  return 0;
+}
+
+// copy src fmatrix to dst; must be both initialized and of equal size
+int fmatrix_copy(fmatrix_t *dst, fmatrix_t *src){
+  if(dst->rows != src->rows || dst->cols != src->cols) {
+    printf("ERROR: size mismatch, couldn't copy\n");
+    return -1;
+  }
+  if(dst->col_space != src->col_space){
+    for(long i=0; i<src->rows; i++){
+      memcpy(&MGET(*dst,i,0), &MGET(*src,i,0), sizeof(float)*src->cols);
+    }
+    return 0;
+  }
+  memcpy(dst->data, src->data, sizeof(float)*src->rows*src->col_space);
+  return 0;
+}
+
+// copy the double matrix src into the float matrix dst rounding each
+// element; must be both initialized and of equal size
+int fmatrix_from_matrix(fmatrix_t *dst, matrix_t *src){
+  if(dst->rows != src->rows || dst->cols != src->cols) {
+    printf("ERROR: size mismatch, couldn't copy\n");
+    return -1;
+  }
+  for(long i=0; i<src->rows; i++){
+    for(long j=0; j<src->cols; j++){
+      MSET(*dst,i,j, (float) MGET(*src,i,j));
+    }
+  }
+  return 0;
+}
+
+// Frees memory associated with the data field of mat.
+void fmatrix_free_data(fmatrix_t *mat){
+  if(mat->alloc == MATRIX_ALLOC_MMAP){
+    munmap(mat->data, mat->alloc_bytes);
+  }
+  else{
+    free(mat->data);
+  }
+  mat->data = NULL;
+  mat->rows = -1;
+  mat->cols = -1;
+  mat->col_space = -1;
+}
+
+// Like matrix_read_from_file() but stores the elements as floats. The
+// text is parsed by matrix_load_text() into doubles which are then
+// rounded to float. Returns 0 on success and non-zero on error.
+int fmatrix_read_from_file(char *fname, fmatrix_t *mat_ref){
+  matrix_t dmat;
+  if(matrix_read_from_file(fname, &dmat)){
+    return 1;
+  }
+  fmatrix_t mat;
+  if(fmatrix_init(&mat, dmat.rows, dmat.cols)){
+    matrix_free_data(&dmat);
+    return 1;
+  }
+  fmatrix_from_matrix(&mat, &dmat);
+  matrix_free_data(&dmat);
+  *mat_ref = mat;
+  return 0;
+}
+
+// Writes a float matrix to an open file handle in the same format as
+// matrix_write().
+void fmatrix_write(FILE *file, fmatrix_t mat){
   fprintf(file,"%ld x %ld matrix\n",mat.rows,mat.cols);
   for(int i=0; i<mat.rows; i++){
     fprintf(file,"%4d: ",i);
@@ -163,6 +406,76 @@ void matrix_write(FILE *file, matrix_t mat){
   return;
 }
 
+// Compact counterpart of matrix_init() for COLNORM_F16 or COLNORM_BF16
+// elements. col_space is rounded up to a multiple of 8 elements so
+// rows start at addresses divisible by 16. Returns 0 on success and
+// nonzero if rows,cols are 0 or negative or dtype isn't a 16-bit type.
+int hmatrix_init(hmatrix_t *mat, long rows, long cols, int dtype){
+  if(rows<=0 || cols<=0){
+    printf("Invalid rows or cols: %ld %ld\n",rows,cols);
+    return 1;
+  }
+  if(dtype != COLNORM_F16 && dtype != COLNORM_BF16){
+    printf("Invalid 16-bit dtype: %d\n",dtype);
+    return 1;
+  }
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->col_space = (cols + 7) / 8 * 8;
+  mat->dtype = dtype;
+  mat->data = malloc(sizeof(uint16_t) * rows * mat->col_space);
+  if(mat->data == NULL){
+    printf("hmatrix_init: couldn't allocate %ld x %ld elements\n",rows,cols);
+    return 1;
+  }
+  mat->alloc = MATRIX_ALLOC_MALLOC;
+  mat->alloc_bytes = 0;
+  return 0;
+}
+
+// copy the double matrix src into the compact matrix dst rounding
+// each element to dst's type; must be both initialized and of equal size
+int hmatrix_from_matrix(hmatrix_t *dst, matrix_t *src){
+  if(dst->rows != src->rows || dst->cols != src->cols) {
+    printf("ERROR: size mismatch, couldn't copy\n");
+    return -1;
+  }
+  for(long i=0; i<src->rows; i++){
+    for(long j=0; j<src->cols; j++){
+      MSET(*dst,i,j, colnorm_double_to_half(MGET(*src,i,j), dst->dtype));
+    }
+  }
+  return 0;
+}
+
+// copy the compact matrix src into the double matrix dst; exact.
+// Must be both initialized and of equal size.
+int matrix_from_hmatrix(matrix_t *dst, hmatrix_t *src){
+  if(dst->rows != src->rows || dst->cols != src->cols) {
+    printf("ERROR: size mismatch, couldn't copy\n");
+    return -1;
+  }
+  for(long i=0; i<src->rows; i++){
+    for(long j=0; j<src->cols; j++){
+      MSET(*dst,i,j, colnorm_half_to_double(MGET(*src,i,j), src->dtype));
+    }
+  }
+  return 0;
+}
+
+// Frees memory associated with the data field of mat.
+void hmatrix_free_data(hmatrix_t *mat){
+  if(mat->alloc == MATRIX_ALLOC_MMAP){
+    munmap(mat->data, mat->alloc_bytes);
+  }
+  else{
+    free(mat->data);
+  }
+  mat->data = NULL;
+  mat->rows = -1;
+  mat->cols = -1;
+  mat->col_space = -1;
+}
 
 // Set elements of the given vector to 0,1,2,...,len
 void vector_fill_sequential(vector_t vec){
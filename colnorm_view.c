@@ -0,0 +1,69 @@
+// colnorm_view.c: a read-only view of a matrix which yields normalized
+// values on the fly. The statistics are computed once, without
+// touching the matrix, and each row segment or tile a consumer asks
+// for is normalized with the SIMD normalize kernel into a buffer the
+// consumer owns, typically small enough to stay in L1. Consumers that
+// want to fuse normalization into their own loops can read single
+// elements with COLNORM_VIEW_GET() or use the view's avg/inv_std
+// directly. Either way the normalized matrix is never written out.
+// Segments still cost a store and a load per element through the
+// buffer, so even on matrices larger than the last level cache they
+// need not beat colnorm_OPTM_into() with streaming stores; fusing the
+// normalization into the consumer's own loop is what saves the pass
+// (see view_report in colnorm_benchmark.c).
+#include "colnorm.h"
+
+// Set up view over mat. Unless flags has COLNORM_APPLY_ONLY the
+// column statistics are first computed into avg_ptr and std_ptr with
+// colnorm_OPTM_stats() on thread_count threads, flags adding e.g.
+// COLNORM_STABLE; otherwise the avg/std given are used. mat and
+// avg_ptr must outlive the view and mat must not change while it is
+// read. Free with colnorm_view_free(). Returns 0 on success and
+// nonzero on error.
+int colnorm_view_init(colnorm_view_t *view, const matrix_t *mat, vector_t *avg_ptr, vector_t *std_ptr,
+                      int thread_count, int flags){
+  if(avg_ptr->len < mat->cols || std_ptr->len < mat->cols){
+    printf("colnorm_view_init: vectors shorter than %ld cols\n",mat->cols);
+    return 1;
+  }
+  if(!(flags & COLNORM_APPLY_ONLY) &&
+     colnorm_OPTM_stats(mat, avg_ptr, std_ptr, thread_count, flags)){
+    return 1;
+  }
+  view->mat = mat;
+  view->rows = mat->rows;
+  view->cols = mat->cols;
+  view->avg = avg_ptr->data;
+  view->inv_std = malloc(sizeof(double) * mat->cols);
+  if(view->inv_std == NULL){
+    printf("colnorm_view_init: couldn't allocate %ld cols\n",mat->cols);
+    return 1;
+  }
+  for(long j=0; j<mat->cols; j++){
+    view->inv_std[j] = 1.0 / VGET(*std_ptr,j);
+  }
+  return 0;
+}
+
+void colnorm_view_free(colnorm_view_t *view){
+  free(view->inv_std);
+  view->inv_std = NULL;
+}
+
+// Write the normalized values of columns [col_beg,col_end) of row i
+// into buf and return buf; the same values colnorm_OPTM() would store
+const double *colnorm_view_row(const colnorm_view_t *view, long i, long col_beg, long col_end, double *buf){
+  colnorm_kernels->normalize(&MGET(*view->mat,i,col_beg), buf, view->avg + col_beg,
+                             view->inv_std + col_beg, col_end - col_beg);
+  return buf;
+}
+
+// Write the normalized tile of rows [row_beg,row_end) and columns
+// [col_beg,col_end) into buf, row i of the tile starting at
+// buf + (i-row_beg)*ld
+void colnorm_view_tile(const colnorm_view_t *view, long row_beg, long row_end, long col_beg, long col_end,
+                       double *buf, long ld){
+  for(long i=row_beg; i<row_end; i++){
+    colnorm_view_row(view, i, col_beg, col_end, buf + (i-row_beg)*ld);
+  }
+}
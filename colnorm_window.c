@@ -0,0 +1,232 @@
+// colnorm_window.c: streaming normalization of rows against moving
+// column statistics rather than those of the whole matrix. Rows are
+// pushed one batch at a time and come back normalized against either
+// the trailing size rows (a sliding window, the row itself included)
+// or an exponentially weighted history in which the newest row has
+// weight alpha (an EWMA window). State is O(cols) per window, plus for
+// a sliding window a ring of the rows still inside it so the departing
+// row can be taken back out. Each row costs one pass over its columns
+// with the window_step / ewma_step kernels of colnorm_simd.c, and
+// batches split their columns into groups run on separate threads.
+// Where a column has no spread in the window, as for the first row
+// pushed or a run of equal values, its standard deviation is 0 and the
+// row normalizes to 0 in that column rather than to 0/0.
+#include "colnorm.h"
+
+#define WINDOW_SYNC_WINDOWS 64  // recompute M2 from the ring after this many windows of rows
+#define WINDOW_GROUP_COLS   64  // fewest columns handed to one thread
+
+// Allocate the per-column state of win; the ring is allocated only for
+// sliding windows
+static int window_alloc(colnorm_window_t *win, long cols, const char *who){
+  win->cols = cols;
+  win->count = 0;
+  win->head = 0;
+  win->since_sync = 0;
+  win->mean = calloc(cols, sizeof(double));
+  win->m2 = calloc(cols, sizeof(double));
+  win->ring = NULL;
+  if(win->kind == COLNORM_WINDOW_SLIDING){
+    win->ring = malloc(sizeof(double) * win->size * cols);
+  }
+  if(win->mean == NULL || win->m2 == NULL ||
+     (win->kind == COLNORM_WINDOW_SLIDING && win->ring == NULL)){
+    printf("%s: couldn't allocate window of %ld cols\n",who,cols);
+    colnorm_window_free(win);
+    return 1;
+  }
+  return 0;
+}
+
+// Initialize win as a sliding window over the last size rows of cols
+// columns. Free with colnorm_window_free(). Returns 0 on success and
+// nonzero on error.
+int colnorm_window_init(colnorm_window_t *win, long cols, long size){
+  if(cols <= 0 || size <= 0){
+    printf("colnorm_window_init: invalid cols %ld or size %ld\n",cols,size);
+    return 1;
+  }
+  win->kind = COLNORM_WINDOW_SLIDING;
+  win->size = size;
+  win->alpha = 1.0 / size;
+  return window_alloc(win, cols, "colnorm_window_init");
+}
+
+// Initialize win as an exponentially weighted window over cols
+// columns: each row pushed has weight alpha and the weight of earlier
+// rows decays by 1-alpha per row. Returns 0 on success and nonzero on
+// error.
+int colnorm_ewma_init(colnorm_window_t *win, long cols, double alpha){
+  if(cols <= 0 || !(alpha > 0.0 && alpha <= 1.0)){
+    printf("colnorm_ewma_init: invalid cols %ld or alpha %g\n",cols,alpha);
+    return 1;
+  }
+  win->kind = COLNORM_WINDOW_EWMA;
+  win->size = 0;
+  win->alpha = alpha;
+  return window_alloc(win, cols, "colnorm_ewma_init");
+}
+
+void colnorm_window_free(colnorm_window_t *win){
+  free(win->mean);
+  free(win->m2);
+  free(win->ring);
+  win->mean = win->m2 = win->ring = NULL;
+}
+
+// Recompute mean and M2 of columns [c0,c1) exactly from the rows in
+// the ring. The add/remove updates of window_step() leave rounding
+// error behind that never leaves the window, so it is cleared out
+// periodically at a cost of two passes over the ring.
+static void window_sync(colnorm_window_t *win, long c0, long c1){
+  double *mean = win->mean, *m2 = win->m2;
+  for(long j=c0; j<c1; j++){
+    mean[j] = 0.0;
+    m2[j] = 0.0;
+  }
+  for(long r=0; r<win->size; r++){
+    double *row = win->ring + r*win->cols;
+    for(long j=c0; j<c1; j++){
+      mean[j] += row[j];
+    }
+  }
+  for(long j=c0; j<c1; j++){
+    mean[j] /= win->size;
+  }
+  for(long r=0; r<win->size; r++){
+    double *row = win->ring + r*win->cols;
+    for(long j=c0; j<c1; j++){
+      double d = row[j] - mean[j];
+      m2[j] += d*d;
+    }
+  }
+}
+
+// Position of a window in its stream of rows. Threads handling
+// different column groups each advance their own copy in step.
+typedef struct {
+  long count;
+  long head;
+  long since_sync;
+} window_pos_t;
+
+// Push one row through columns [c0,c1) of win at position pos and
+// write it normalized to dst, which may be src
+static void window_row(colnorm_window_t *win, window_pos_t *pos, const double *src, double *dst,
+                       long c0, long c1){
+  long n = c1 - c0;
+  if(win->kind == COLNORM_WINDOW_EWMA){
+    if(pos->count == 0){                        // the first row is the whole history
+      memcpy(win->mean + c0, src + c0, sizeof(double) * n);
+    }
+    colnorm_kernels->ewma_step(src + c0, win->mean + c0, win->m2 + c0, dst + c0, win->alpha, n);
+    pos->count++;
+    return;
+  }
+
+  if(pos->count < win->size){                   // window still filling up
+    double inv_count = 1.0 / (pos->count + 1);
+    colnorm_kernels->welford(src + c0, win->mean + c0, win->m2 + c0, inv_count, n);
+    memcpy(win->ring + pos->count*win->cols + c0, src + c0, sizeof(double) * n);
+    for(long j=c0; j<c1; j++){
+      double s = sqrt(win->m2[j] * inv_count);
+      dst[j] = s != 0.0 ? (src[j] - win->mean[j]) / s : 0.0;
+    }
+    pos->count++;
+    return;
+  }
+
+  colnorm_kernels->window_step(src + c0, win->ring + pos->head*win->cols + c0,
+                               win->mean + c0, win->m2 + c0, dst + c0, 1.0 / win->size, n);
+  pos->count++;
+  pos->head = (pos->head + 1) % win->size;
+  pos->since_sync++;
+  if(pos->since_sync >= WINDOW_SYNC_WINDOWS * win->size){
+    window_sync(win, c0, c1);
+    pos->since_sync = 0;
+  }
+}
+
+// Push one row of win->cols values through the window and write it
+// normalized to dst, which may be src
+void colnorm_window_push_row(colnorm_window_t *win, const double *src, double *dst){
+  window_pos_t pos = { win->count, win->head, win->since_sync };
+  window_row(win, &pos, src, dst, 0, win->cols);
+  win->count = pos.count;
+  win->head = pos.head;
+  win->since_sync = pos.since_sync;
+}
+
+// Context shared by the threads pushing one batch; each thread takes
+// a group of columns through every row of the batch
+typedef struct {
+  colnorm_window_t *win;
+  const matrix_t *src;
+  matrix_t *dst;
+  long group_cols;              // columns per group, a multiple of a cache line
+  window_pos_t end;             // position after the batch, set by thread 0
+} window_ctx_t;
+
+static void window_worker(int thread_id, int thread_count, void *arg){
+  window_ctx_t *ctx = (window_ctx_t *) arg;
+  colnorm_window_t *win = ctx->win;
+  long c0 = thread_id * ctx->group_cols;
+  long c1 = thread_id == thread_count-1 ? win->cols : c0 + ctx->group_cols;
+  window_pos_t pos = { win->count, win->head, win->since_sync };
+  for(long i=0; i<ctx->src->rows; i++){
+    window_row(win, &pos, &MGET(*ctx->src,i,0), &MGET(*ctx->dst,i,0), c0, c1);
+  }
+  if(thread_id == 0){
+    ctx->end = pos;
+  }
+}
+
+// Push the rows of src through the window in order and write them
+// normalized into the same rows of dst, which may be src. Columns are
+// independent so groups of them run on up to thread_count threads,
+// each taking its group through the whole batch without waiting on
+// the others. Returns 0 on success and nonzero on error.
+int colnorm_window_push(colnorm_window_t *win, const matrix_t *src, matrix_t *dst, int thread_count){
+  if(src->cols != win->cols || dst->cols != win->cols || dst->rows < src->rows){
+    printf("colnorm_window_push: matrices are %ld x %ld and %ld x %ld, expected %ld cols\n",
+           src->rows,src->cols,dst->rows,dst->cols,win->cols);
+    return 1;
+  }
+  int groups = thread_count;
+  if(groups > win->cols / WINDOW_GROUP_COLS){
+    groups = win->cols / WINDOW_GROUP_COLS;
+  }
+  if(groups <= 1){
+    for(long i=0; i<src->rows; i++){
+      colnorm_window_push_row(win, &MGET(*src,i,0), &MGET(*dst,i,0));
+    }
+    return 0;
+  }
+
+  window_ctx_t ctx = { .win = win, .src = src, .dst = dst };
+  // whole 64-byte lines per group
+  ctx.group_cols = (win->cols / groups + CN_LINE_DOUBLES - 1) / CN_LINE_DOUBLES * CN_LINE_DOUBLES;
+  while(groups > 1 && (groups-1) * ctx.group_cols >= win->cols){
+    groups--;
+  }
+  colnorm_team_run(window_worker, &ctx, groups);
+  win->count = ctx.end.count;
+  win->head = ctx.end.head;
+  win->since_sync = ctx.end.since_sync;
+  return 0;
+}
+
+// Copy the current window means and standard deviations into avg_ptr
+// and std_ptr which must have win->cols elements
+void colnorm_window_stats(colnorm_window_t *win, vector_t *avg_ptr, vector_t *std_ptr){
+  long n = win->count < win->size ? win->count : win->size;
+  for(long j=0; j<win->cols; j++){
+    VSET(*avg_ptr, j, win->mean[j]);
+    if(win->kind == COLNORM_WINDOW_EWMA){
+      VSET(*std_ptr, j, sqrt(win->m2[j]));
+    }
+    else{
+      VSET(*std_ptr, j, n > 0 ? sqrt(win->m2[j] / n) : 0.0);
+    }
+  }
+}